@@ -5,10 +5,42 @@
 #include <stdexcept>
 #include <algorithm>
 #include <map>
+#include <set>
+#include <deque>
+#include <queue>
+#include <unordered_map>
 #include <chrono>
 #include <iomanip>
 #include <functional>
 #include <sstream>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <cstdint>
+#include <exception>
+#include <cmath>
+#include <limits>
+#include <ctime>
+#include <cstring>
+#include <variant>
+#include <iterator>
+#include <cctype>
+#include <string_view>
+#include <optional>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <shared_mutex>
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 /**
  * Base exception class for library-related errors
@@ -40,49 +72,773 @@ public:
     ReturnException(const std::string& message) : LibraryException("Return failed: " + message) {}
 };
 
+class RenewalException : public LibraryException {
+public:
+    RenewalException(const std::string& message) : LibraryException("Renewal failed: " + message) {}
+};
+
+class LibraryItem;
+class LibraryPatron;
+
+/**
+ * Notified by items and patrons when state that aggregates depend on changes
+ */
+class LibraryObserver {
+public:
+    virtual ~LibraryObserver() = default;
+    virtual void onAvailabilityChanged(const LibraryItem& item, size_t availableBefore) = 0;
+    virtual void onActiveChanged(const LibraryPatron& patron, bool wasActive) = 0;
+};
+
+/**
+ * A physical copy of a library item. Bibliographic data lives once on the
+ * LibraryItem; copies only carry their barcode and availability.
+ */
+struct ItemCopy {
+    std::string barcode;
+    bool available;
+};
+
+/**
+ * Loans are day-granular: dates are stored as local calendar days since
+ * 1970-01-01
+ */
+using EpochDay = int32_t;
+
+// Day of a date field that is missing or could not be parsed
+constexpr EpochDay kUnknownDay = std::numeric_limits<EpochDay>::min();
+
+/**
+ * Thread-safe date rendering. Local time comes from localtime_r
+ * (localtime_s on Windows) instead of the non-reentrant std::localtime,
+ * and each thread caches the UTC offset per hour and the rendered text per
+ * local day, so formatting a timestamp is mostly integer arithmetic.
+ */
+class DateFormatter {
+private:
+    struct OffsetEntry {
+        int64_t hour = std::numeric_limits<int64_t>::min();
+        int64_t offset = 0;
+    };
+    
+    struct DayEntry {
+        int64_t day = std::numeric_limits<int64_t>::min();
+        char text[11] = {};
+    };
+    
+    static constexpr size_t kOffsetSlots = 64;
+    static constexpr size_t kDaySlots = 1024;
+    
+    static bool toLocal(std::time_t t, std::tm& out) {
+#ifdef _WIN32
+        return localtime_s(&out, &t) == 0;
+#else
+        return localtime_r(&t, &out) != nullptr;
+#endif
+    }
+    
+    static int64_t floorDiv(int64_t a, int64_t b) {
+        return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+    }
+    
+    // Seconds east of UTC at time t
+    static int64_t computeOffset(std::time_t t) {
+        std::tm local{};
+        if (!toLocal(t, local)) return 0;
+        int64_t day = daysFromCivil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+        int64_t localSeconds = day * 86400 + local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+        return localSeconds - static_cast<int64_t>(t);
+    }
+    
+    static int64_t utcOffset(std::time_t t) {
+        thread_local std::array<OffsetEntry, kOffsetSlots> cache;
+        int64_t hour = floorDiv(static_cast<int64_t>(t), 3600);
+        OffsetEntry& entry = cache[static_cast<size_t>(hour) % kOffsetSlots];
+        if (entry.hour == hour) return entry.offset;
+        
+        int64_t start = computeOffset(static_cast<std::time_t>(hour * 3600));
+        int64_t end = computeOffset(static_cast<std::time_t>(hour * 3600 + 3599));
+        if (start != end) {
+            // A zone transition falls inside this hour; don't cache it
+            return computeOffset(t);
+        }
+        entry.hour = hour;
+        entry.offset = start;
+        return start;
+    }
+    
+    static void writeTwoDigits(char* out, int value) {
+        out[0] = static_cast<char>('0' + value / 10);
+        out[1] = static_cast<char>('0' + value % 10);
+    }
+    
+    static const char* dayText(int64_t day) {
+        thread_local std::array<DayEntry, kDaySlots> cache;
+        DayEntry& entry = cache[static_cast<size_t>(day) % kDaySlots];
+        if (entry.day != day) {
+            int year, month, dayOfMonth;
+            civilFromDays(day, year, month, dayOfMonth);
+            year = std::min(std::max(year, 0), 9999);
+            writeTwoDigits(entry.text, year / 100);
+            writeTwoDigits(entry.text + 2, year % 100);
+            entry.text[4] = '-';
+            writeTwoDigits(entry.text + 5, month);
+            entry.text[7] = '-';
+            writeTwoDigits(entry.text + 8, dayOfMonth);
+            entry.day = day;
+        }
+        return entry.text;
+    }
+    
+public:
+    /**
+     * Day number of an ISO date: "YYYY-MM-DD", or "YYYY-MM" / "YYYY" for the
+     * first day of that month or year. Returns false for anything else,
+     * including impossible dates such as 2023-02-30.
+     */
+    static bool parseDate(const std::string& text, int64_t& day) {
+        if (text.size() != 4 && text.size() != 7 && text.size() != 10) return false;
+        int parts[3] = {0, 1, 1};
+        size_t pos = 0;
+        for (int part = 0; pos < text.size(); ++part) {
+            size_t width = part == 0 ? 4 : 2;
+            if (part > 0 && text[pos++] != '-') return false;
+            int value = 0;
+            for (size_t i = 0; i < width; ++i, ++pos) {
+                if (!std::isdigit(static_cast<unsigned char>(text[pos]))) return false;
+                value = value * 10 + (text[pos] - '0');
+            }
+            parts[part] = value;
+        }
+        if (parts[1] < 1 || parts[1] > 12 || parts[2] < 1 || parts[2] > 31) return false;
+        
+        day = daysFromCivil(parts[0], parts[1], parts[2]);
+        int year, month, dayOfMonth;
+        civilFromDays(day, year, month, dayOfMonth);
+        return month == parts[1] && dayOfMonth == parts[2];
+    }
+    
+    // As parseDate, but kUnknownDay if the text is not a date
+    static EpochDay parseDay(const std::string& text) {
+        int64_t day;
+        return parseDate(text, day) ? static_cast<EpochDay>(day) : kUnknownDay;
+    }
+    
+    // Days since 1970-01-01 for a proleptic Gregorian date
+    static int64_t daysFromCivil(int64_t year, int month, int day) {
+        year -= month <= 2;
+        int64_t era = floorDiv(year, 400);
+        int64_t yearOfEra = year - era * 400;
+        int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+    
+    static void civilFromDays(int64_t days, int& year, int& month, int& day) {
+        days += 719468;
+        int64_t era = floorDiv(days, 146097);
+        int64_t dayOfEra = days - era * 146097;
+        int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        int64_t mp = (5 * dayOfYear + 2) / 153;
+        day = static_cast<int>(dayOfYear - (153 * mp + 2) / 5 + 1);
+        month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+        year = static_cast<int>(yearOfEra + era * 400 + (month <= 2));
+    }
+    
+    // Local calendar day (days since epoch) containing t
+    static int64_t localDay(std::time_t t) {
+        return floorDiv(static_cast<int64_t>(t) + utcOffset(t), 86400);
+    }
+    
+    // YYYY-MM-DD for a day number
+    static std::string formatDay(int64_t day) {
+        return std::string(dayText(day), 10);
+    }
+    
+    // Appends YYYY-MM-DD without a temporary string
+    static void appendDay(std::string& out, int64_t day) {
+        out.append(dayText(day), 10);
+    }
+    
+    // YYYY-MM-DD in local time
+    static std::string formatDate(std::time_t t) {
+        return formatDay(localDay(t));
+    }
+    
+    // YYYY-MM-DD HH:MM:SS in local time
+    static std::string formatDateTime(std::time_t t) {
+        int64_t local = static_cast<int64_t>(t) + utcOffset(t);
+        int64_t day = floorDiv(local, 86400);
+        int64_t secondOfDay = local - day * 86400;
+        
+        char buffer[19];
+        std::memcpy(buffer, dayText(day), 10);
+        buffer[10] = ' ';
+        writeTwoDigits(buffer + 11, static_cast<int>(secondOfDay / 3600));
+        buffer[13] = ':';
+        writeTwoDigits(buffer + 14, static_cast<int>(secondOfDay / 60 % 60));
+        buffer[16] = ':';
+        writeTwoDigits(buffer + 17, static_cast<int>(secondOfDay % 60));
+        return std::string(buffer, sizeof(buffer));
+    }
+};
+
+/**
+ * Folds text to a search key: lower case, Latin diacritics stripped (é -> e,
+ * ß -> ss), apostrophes dropped and every other run of punctuation or
+ * whitespace collapsed to one space. Input is UTF-8; characters outside
+ * Latin-1 and Latin Extended-A pass through unchanged.
+ */
+class TextNormalizer {
+private:
+    // Base letters for U+00C0..U+017F; '*' marks ligatures expanded in
+    // expand() and '-' marks symbols treated as punctuation
+    static constexpr const char* kLatinBase =
+        "aaaaaa*ceeeeiiiidnooooo-ouuuuy**"
+        "aaaaaa*ceeeeiiiidnooooo-ouuuuy*y"
+        "aaaaaaccccccccddddeeeeeeeeeegggg"
+        "gggghhhhiiiiiiiiii**jjkkklllllll"
+        "lllnnnnnnnnnoooooo**rrrrrrssssss"
+        "ssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+    
+    static const char* expand(uint32_t codePoint) {
+        switch (codePoint) {
+            case 0xC6: case 0xE6: return "ae";
+            case 0xDE: case 0xFE: return "th";
+            case 0xDF: return "ss";
+            case 0x132: case 0x133: return "ij";
+            case 0x152: case 0x153: return "oe";
+            default: return "";
+        }
+    }
+    
+public:
+    static std::string normalize(const std::string& text) {
+        std::string out;
+        out.reserve(text.size());
+        bool pendingSpace = false;
+        auto emit = [&](const char* letters, size_t length) {
+            if (pendingSpace && !out.empty()) out += ' ';
+            pendingSpace = false;
+            out.append(letters, length);
+        };
+        
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c < 0x80) {
+                if (std::isalnum(c)) {
+                    char lower = static_cast<char>(std::tolower(c));
+                    emit(&lower, 1);
+                } else if (c != '\'') {
+                    pendingSpace = true;
+                }
+                continue;
+            }
+            
+            // Two-byte sequence: decode and fold Latin letters
+            if ((c & 0xE0) == 0xC0 && i + 1 < text.size() && (static_cast<unsigned char>(text[i + 1]) & 0xC0) == 0x80) {
+                uint32_t codePoint = (static_cast<uint32_t>(c & 0x1F) << 6) | (static_cast<unsigned char>(text[i + 1]) & 0x3F);
+                if (codePoint >= 0x300 && codePoint <= 0x36F) {
+                    // Combining diacritical mark (decomposed input)
+                    ++i;
+                    continue;
+                }
+                if (codePoint >= 0xC0 && codePoint <= 0x17F) {
+                    char base = kLatinBase[codePoint - 0xC0];
+                    if (base == '*') {
+                        emit(expand(codePoint), 2);
+                    } else if (base == '-') {
+                        pendingSpace = true;
+                    } else {
+                        emit(&base, 1);
+                    }
+                    ++i;
+                    continue;
+                }
+                if (codePoint < 0xC0) {
+                    // Latin-1 symbols and non-breaking space
+                    pendingSpace = true;
+                    ++i;
+                    continue;
+                }
+            }
+            
+            // Anything else: copy the whole sequence through
+            size_t length = 1;
+            while (i + length < text.size() && (static_cast<unsigned char>(text[i + length]) & 0xC0) == 0x80) ++length;
+            emit(text.data() + i, length);
+            i += length - 1;
+        }
+        return out;
+    }
+};
+
+/**
+ * Normalised search text for an item, built once when it is catalogued.
+ * All fields share one buffer; creator is the author, director or
+ * publisher depending on the item type.
+ */
+class SearchKeys {
+public:
+    enum Field { Title, Creator, Genre, kFieldCount };
+    
+private:
+    std::string text_;
+    std::array<uint32_t, kFieldCount + 1> offsets_{};
+    
+public:
+    SearchKeys() = default;
+    
+    SearchKeys(const std::string& title, const std::string& creator, const std::string& genre) {
+        const std::string* raw[kFieldCount] = {&title, &creator, &genre};
+        for (int f = 0; f < kFieldCount; ++f) {
+            offsets_[f] = static_cast<uint32_t>(text_.size());
+            text_ += TextNormalizer::normalize(*raw[f]);
+        }
+        offsets_[kFieldCount] = static_cast<uint32_t>(text_.size());
+        text_.shrink_to_fit();
+    }
+    
+    std::string_view get(Field field) const {
+        return std::string_view(text_).substr(offsets_[field], offsets_[field + 1] - offsets_[field]);
+    }
+    
+    bool contains(Field field, const std::string& normalizedText) const {
+        return get(field).find(normalizedText) != std::string_view::npos;
+    }
+};
+
+/**
+ * Registry of item and patron types. Each type is declared once here with
+ * its name, loan rules and the constructor fields that follow the ID. The
+ * codec, search dispatch, statistics and the add/search menus are all
+ * driven from these tables, and code needing the concrete class switches
+ * on the kind rather than using dynamic_cast or comparing type names.
+ *
+ * Adding a type: add its kind, its field list, a spec row in kind order,
+ * the class (with kKind, fieldValues() and create()) and an entry in
+ * RegisteredItems or RegisteredPatrons. Types may have any number of fields;
+ * ISBN fields and fields naming a rangeField are indexed by Library::addItem().
+ */
+enum class ItemKind : uint8_t { Book, Magazine, DVD };
+enum class PatronKind : uint8_t { Student, Faculty };
+
+// How a field is entered and checked
+enum class FieldInput : uint8_t { Text, Integer, Date, Isbn };
+
+/**
+ * Item fields a query can filter on
+ */
+enum class ItemField {
+    Id,
+    Title,
+    Type,
+    Author,
+    Genre,
+    Director,
+    Publisher,
+    Available,
+    ReleaseDay,
+    PublicationDay,
+    Duration
+};
+
+// What an item type's creator field holds, which decides the searches it answers
+enum class CreatorRole : uint8_t { Author, Director, Publisher };
+
+struct FieldSpec {
+    const char* label;
+    FieldInput input;
+    // Range query field served from this field's sorted index, or Id if none
+    ItemField rangeField = ItemField::Id;
+};
+
+// A type's fields, viewing one of the constexpr arrays below
+class FieldList {
+private:
+    const FieldSpec* fields_;
+    size_t count_;
+    
+public:
+    template<size_t N>
+    constexpr FieldList(const FieldSpec (&fields)[N]) : fields_(fields), count_(N) {}
+    
+    constexpr size_t size() const { return count_; }
+    constexpr const FieldSpec& operator[](size_t index) const { return fields_[index]; }
+    constexpr const FieldSpec* begin() const { return fields_; }
+    constexpr const FieldSpec* end() const { return fields_ + count_; }
+};
+
+// Field values in registry order, one per FieldSpec
+using FieldValues = std::vector<std::string>;
+
+struct ItemTypeSpec {
+    ItemKind kind;
+    const char* name;
+    int maxLoanDays;
+    double dailyFine;
+    // Fields after the ID; fields[0] is the title and fields[1] the creator
+    FieldList fields;
+    CreatorRole creator;
+    int genreField;  // index into fields, or -1 if the type has no genre
+};
+
+struct PatronTypeSpec {
+    PatronKind kind;
+    const char* name;
+    int maxBorrowItems;
+    int loanExtensionDays;
+    bool holdPriority;  // holds served ahead of other patron types
+    // Fields after the ID, name and contact info
+    FieldList fields;
+    int cardField;  // index into fields of the library card number, or -1
+};
+
+constexpr FieldSpec kBookFields[] = {
+    {"Title", FieldInput::Text}, {"Author", FieldInput::Text}, {"ISBN", FieldInput::Isbn}, {"Genre", FieldInput::Text}};
+constexpr FieldSpec kMagazineFields[] = {
+    {"Title", FieldInput::Text}, {"Publisher", FieldInput::Text},
+    {"Issue Number", FieldInput::Integer}, {"Publication Date", FieldInput::Date, ItemField::PublicationDay}};
+constexpr FieldSpec kDvdFields[] = {
+    {"Title", FieldInput::Text}, {"Director", FieldInput::Text},
+    {"Duration (minutes)", FieldInput::Integer, ItemField::Duration},
+    {"Release Date", FieldInput::Date, ItemField::ReleaseDay}};
+constexpr FieldSpec kStudentFields[] = {{"Student ID", FieldInput::Text}, {"Major", FieldInput::Text}};
+constexpr FieldSpec kFacultyFields[] = {{"Department", FieldInput::Text}, {"Employee ID", FieldInput::Text}};
+
+constexpr std::array<ItemTypeSpec, 3> kItemTypes = {{
+    {ItemKind::Book, "Book", 21, 0.50, kBookFields, CreatorRole::Author, 3},
+    {ItemKind::Magazine, "Magazine", 14, 0.25, kMagazineFields, CreatorRole::Publisher, -1},
+    {ItemKind::DVD, "DVD", 7, 1.00, kDvdFields, CreatorRole::Director, -1},
+}};
+
+constexpr std::array<PatronTypeSpec, 2> kPatronTypes = {{
+    {PatronKind::Student, "Student", 5, 7, false, kStudentFields, 0},
+    {PatronKind::Faculty, "Faculty", 10, 14, true, kFacultyFields, 1},
+}};
+
+constexpr size_t kItemKindCount = kItemTypes.size();
+constexpr size_t kPatronKindCount = kPatronTypes.size();
+
+constexpr bool registryInKindOrder() {
+    for (size_t i = 0; i < kItemKindCount; ++i) {
+        if (static_cast<size_t>(kItemTypes[i].kind) != i) return false;
+    }
+    for (size_t i = 0; i < kPatronKindCount; ++i) {
+        if (static_cast<size_t>(kPatronTypes[i].kind) != i) return false;
+    }
+    return true;
+}
+static_assert(registryInKindOrder(), "Type registry rows must be listed in kind order");
+
+constexpr bool registryFieldsValid() {
+    for (const auto& spec : kItemTypes) {
+        if (spec.fields.size() < 2 || spec.genreField >= static_cast<int>(spec.fields.size())) return false;
+        for (const FieldSpec& field : spec.fields) {
+            bool ranged = field.rangeField == ItemField::ReleaseDay || field.rangeField == ItemField::PublicationDay ||
+                          field.rangeField == ItemField::Duration;
+            bool numeric = field.input == FieldInput::Date || field.input == FieldInput::Integer;
+            if (field.rangeField != ItemField::Id && !(ranged && numeric)) return false;
+        }
+    }
+    for (const auto& spec : kPatronTypes) {
+        if (spec.cardField >= static_cast<int>(spec.fields.size())) return false;
+    }
+    return true;
+}
+static_assert(registryFieldsValid(),
+              "Item types need a title and creator field; genre and card fields must exist; "
+              "range fields must be numeric");
+
+constexpr const ItemTypeSpec& itemTypeSpec(ItemKind kind) {
+    return kItemTypes[static_cast<size_t>(kind)];
+}
+
+constexpr const PatronTypeSpec& patronTypeSpec(PatronKind kind) {
+    return kPatronTypes[static_cast<size_t>(kind)];
+}
+
+inline bool typeNameEquals(std::string_view name, const char* typeName) {
+    std::string_view expected(typeName);
+    if (name.size() != expected.size()) return false;
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(name[i])) != std::tolower(static_cast<unsigned char>(expected[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Spec for a type name, ignoring case, or nullptr if none is registered
+inline const ItemTypeSpec* findItemType(std::string_view name) {
+    for (const auto& spec : kItemTypes) {
+        if (typeNameEquals(name, spec.name)) return &spec;
+    }
+    return nullptr;
+}
+
+inline const PatronTypeSpec* findPatronType(std::string_view name) {
+    for (const auto& spec : kPatronTypes) {
+        if (typeNameEquals(name, spec.name)) return &spec;
+    }
+    return nullptr;
+}
+
+inline bool tryParseInteger(const std::string& text, int& value) {
+    try {
+        size_t used = 0;
+        value = std::stoi(text, &used);
+        return used == text.size();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Integer field value for create(); throws naming the field if malformed
+inline int parseIntegerField(const std::string& text, const char* label) {
+    int value;
+    if (tryParseInteger(text, value)) return value;
+    throw LibraryException(std::string("Invalid ") + label + ": " + text);
+}
+
 /**
  * Base class for all library items
  */
 class LibraryItem : public std::enable_shared_from_this<LibraryItem> {
 private:
+    ItemKind kind_;
     std::string id_;
     std::string title_;
-    bool available_;
+    std::vector<ItemCopy> copies_;
+    std::vector<size_t> freeCopies_;  // indexes of available copies
+    std::vector<size_t> freeSlot_;    // position of each available copy in freeCopies_
+    LibraryObserver* observer_ = nullptr;
+    SearchKeys searchKeys_;
+    
+    void pushFree(size_t copyIndex) {
+        freeSlot_[copyIndex] = freeCopies_.size();
+        freeCopies_.push_back(copyIndex);
+    }
+    
+    // Swap-and-pop so taking a particular copy stays O(1)
+    void removeFree(size_t copyIndex) {
+        size_t slot = freeSlot_[copyIndex];
+        size_t moved = freeCopies_.back();
+        freeCopies_[slot] = moved;
+        freeSlot_[moved] = slot;
+        freeCopies_.pop_back();
+    }
+    
+    void notifyAvailability(size_t availableBefore) {
+        if (observer_ && availableBefore != freeCopies_.size()) {
+            observer_->onAvailabilityChanged(*this, availableBefore);
+        }
+    }
     
 protected:
     double dailyFine_;
     int maxLoanDays_;
 public:
-    LibraryItem(std::string id, std::string title)
-        : id_(std::move(id)), title_(std::move(title)), available_(true),
-          dailyFine_(0.0), maxLoanDays_(0)
-    {}
+    static constexpr size_t kAnyCopy = static_cast<size_t>(-1);
+    
+    LibraryItem(ItemKind kind, std::string id, std::string title)
+        : kind_(kind), id_(std::move(id)), title_(std::move(title)),
+          dailyFine_(itemTypeSpec(kind).dailyFine), maxLoanDays_(itemTypeSpec(kind).maxLoanDays)
+    {
+        // The first copy is barcoded with the item ID itself
+        copies_.push_back({id_, true});
+        freeSlot_.push_back(0);
+        pushFree(0);
+    }
     
     virtual ~LibraryItem() = default;
     
-    std::string getId() const { return id_; }
-    std::string getTitle() const { return title_; }
-    bool isAvailable() const { return available_; }
+    ItemKind getKind() const { return kind_; }
+    const std::string& getId() const { return id_; }
+    const std::string& getTitle() const { return title_; }
+    bool isAvailable() const { return !freeCopies_.empty(); }
     int getMaxLoanDays() const { return maxLoanDays_; }
+    double getDailyFine() const { return dailyFine_; }
+    
+    size_t getCopyCount() const { return copies_.size(); }
+    size_t getAvailableCopies() const { return freeCopies_.size(); }
+    const std::vector<ItemCopy>& getCopies() const { return copies_; }
+    const std::string& getCopyBarcode(size_t copyIndex) const { return copies_.at(copyIndex).barcode; }
+    
+    // Normalised search text; built by Library::addItem()
+    const SearchKeys& getSearchKeys() const { return searchKeys_; }
+    void setSearchKeys(SearchKeys keys) { searchKeys_ = std::move(keys); }
+    
+    void setObserver(LibraryObserver* observer) { observer_ = observer; }
+    
+    size_t addCopy(std::string barcode) {
+        size_t before = freeCopies_.size();
+        copies_.push_back({std::move(barcode), true});
+        freeSlot_.push_back(0);
+        pushFree(copies_.size() - 1);
+        notifyAvailability(before);
+        return copies_.size() - 1;
+    }
+    
+    void setAvailable(bool available) {
+        size_t before = freeCopies_.size();
+        freeCopies_.clear();
+        for (size_t i = 0; i < copies_.size(); ++i) {
+            copies_[i].available = available;
+            if (available) pushFree(i);
+        }
+        notifyAvailability(before);
+    }
     
-    void setAvailable(bool available) { available_ = available; }
+    std::string getItemType() const { return itemTypeSpec(kind_).name; }
+    
+    double calculateFine(int daysOverdue) const {
+        if (daysOverdue <= 0) return 0.0;
+        return daysOverdue * dailyFine_;
+    }
     
-    virtual std::string getItemType() const = 0;
-    virtual double calculateFine(int daysOverdue) const = 0;
     virtual std::string getDetails() const = 0;
     
-    void checkOut() {
-        if (!available_) {
-            throw CheckoutException("Item is not available for checkout");
+    // Checks out the given copy, or any available copy, and returns its index
+    size_t checkOut(size_t copyIndex = kAnyCopy) {
+        size_t before = freeCopies_.size();
+        if (copyIndex == kAnyCopy) {
+            if (freeCopies_.empty()) {
+                throw CheckoutException("Item is not available for checkout");
+            }
+            copyIndex = freeCopies_.back();
+            freeCopies_.pop_back();
+        } else {
+            if (copyIndex >= copies_.size() || !copies_[copyIndex].available) {
+                throw CheckoutException("Item is not available for checkout");
+            }
+            removeFree(copyIndex);
+        }
+        copies_[copyIndex].available = false;
+        notifyAvailability(before);
+        return copyIndex;
+    }
+    
+    void returnItem(size_t copyIndex = 0) {
+        if (copyIndex >= copies_.size() || copies_[copyIndex].available) return;
+        size_t before = freeCopies_.size();
+        copies_[copyIndex].available = true;
+        pushFree(copyIndex);
+        notifyAvailability(before);
+    }
+    
+    // Available copies in the order checkOut() hands them out, last first
+    const std::vector<size_t>& getFreeCopies() const { return freeCopies_; }
+    
+    // Reinstates the hand-out order read back from a checkpoint; order must
+    // list exactly the available copies
+    void restoreFreeOrder(const std::vector<size_t>& order) {
+        if (order.size() != freeCopies_.size()) throw LibraryException("Free copies do not match item: " + id_);
+        std::vector<bool> seen(copies_.size(), false);
+        for (size_t copyIndex : order) {
+            if (copyIndex >= copies_.size() || !copies_[copyIndex].available || seen[copyIndex]) {
+                throw LibraryException("Free copies do not match item: " + id_);
+            }
+            seen[copyIndex] = true;
+        }
+        freeCopies_.clear();
+        for (size_t copyIndex : order) pushFree(copyIndex);
+    }
+};
+
+/**
+ * ISBN parsing and validation. Hyphens and spaces are ignored; ISBN-10s
+ * are converted to their 978-prefixed ISBN-13 form. A valid ISBN packs
+ * into a 64-bit key holding its 13 digits as an integer.
+ */
+class Isbn {
+public:
+    // Key of an ISBN that is missing or invalid
+    static constexpr uint64_t kInvalid = 0;
+    
+    static uint64_t parse(const std::string& text) {
+        char digits[13];
+        size_t count = 0;
+        for (char c : text) {
+            if (c == '-' || c == ' ') continue;
+            bool checkX = (c == 'X' || c == 'x') && count == 9;
+            if (!std::isdigit(static_cast<unsigned char>(c)) && !checkX) return kInvalid;
+            if (count == 13) return kInvalid;
+            digits[count++] = checkX ? 'X' : c;
+        }
+        
+        if (count == 10) {
+            int sum = 0;
+            for (int i = 0; i < 10; ++i) {
+                int value = digits[i] == 'X' ? 10 : digits[i] - '0';
+                sum += value * (10 - i);
+            }
+            if (sum % 11 != 0) return kInvalid;
+            // Re-prefix with 978 and recompute the ISBN-13 check digit
+            uint64_t key = 978;
+            for (int i = 0; i < 9; ++i) key = key * 10 + static_cast<uint64_t>(digits[i] - '0');
+            return key * 10 + checkDigit13(key);
+        }
+        
+        // The check character X is only valid in an ISBN-10
+        if (count == 13 && std::find(digits, digits + 13, 'X') == digits + 13) {
+            uint64_t key = 0;
+            for (int i = 0; i < 12; ++i) key = key * 10 + static_cast<uint64_t>(digits[i] - '0');
+            if (checkDigit13(key) != static_cast<uint64_t>(digits[12] - '0')) return kInvalid;
+            return key * 10 + checkDigit13(key);
+        }
+        return kInvalid;
+    }
+    
+    static bool isValid(const std::string& text) { return parse(text) != kInvalid; }
+    
+    // The 13 digits of a key, unhyphenated
+    static std::string format(uint64_t key) {
+        std::string text(13, '0');
+        for (int i = 12; i >= 0; --i) {
+            text[i] = static_cast<char>('0' + key % 10);
+            key /= 10;
         }
-        available_ = false;
+        return text;
     }
     
-    void returnItem() {
-        available_ = true;
+private:
+    // Check digit for the first 12 digits of an ISBN-13
+    static uint64_t checkDigit13(uint64_t first12) {
+        uint64_t sum = 0;
+        for (int i = 0; i < 12; ++i) {
+            sum += (first12 % 10) * (i % 2 == 0 ? 3 : 1);
+            first12 /= 10;
+        }
+        return (10 - sum % 10) % 10;
     }
 };
 
+/**
+ * Why value cannot be stored in field, or an empty string if it can. Dates
+ * and ISBNs may be left blank; integers may not.
+ */
+inline std::string fieldError(const FieldSpec& field, const std::string& value) {
+    int number;
+    switch (field.input) {
+        case FieldInput::Text:
+            break;
+        case FieldInput::Integer:
+            if (!tryParseInteger(value, number)) return std::string("Invalid ") + field.label + ": " + value;
+            break;
+        case FieldInput::Date:
+            if (!value.empty() && DateFormatter::parseDay(value) == kUnknownDay) {
+                return std::string("Invalid ") + field.label + " (expected YYYY-MM-DD): " + value;
+            }
+            break;
+        case FieldInput::Isbn:
+            if (!value.empty() && Isbn::parse(value) == Isbn::kInvalid) return std::string("Invalid ") + field.label + ": " + value;
+            break;
+    }
+    return std::string();
+}
+
 /**
  * Book class - derives from LibraryItem
  */
@@ -90,28 +846,27 @@ class Book : public LibraryItem {
 private:
     std::string author_;
     std::string isbn_;
+    uint64_t isbnKey_;
     std::string genre_;
 public:
-    Book(std::string id, std::string title, std::string author, std::string isbn, std::string genre)
-        : LibraryItem(std::move(id), std::move(title)),
-          author_(std::move(author)), isbn_(std::move(isbn)), genre_(std::move(genre))
-    {
-        dailyFine_ = 0.50;
-        maxLoanDays_ = 21;
-    }
+    static constexpr ItemKind kKind = ItemKind::Book;
     
-    std::string getAuthor() const { return author_; }
-    std::string getIsbn() const { return isbn_; }
-    std::string getGenre() const { return genre_; }
+    Book(std::string id, std::string title, std::string author, std::string isbn, std::string genre)
+        : LibraryItem(kKind, std::move(id), std::move(title)),
+          author_(std::move(author)), isbn_(std::move(isbn)), isbnKey_(Isbn::parse(isbn_)), genre_(std::move(genre))
+    {}
     
-    std::string getItemType() const override {
-        return "Book";
+    static std::unique_ptr<LibraryItem> create(std::string id, const FieldValues& fields) {
+        return std::make_unique<Book>(std::move(id), fields[0], fields[1], fields[2], fields[3]);
     }
     
-    double calculateFine(int daysOverdue) const override {
-        if (daysOverdue <= 0) return 0.0;
-        return daysOverdue * dailyFine_;
-    }
+    FieldValues fieldValues() const { return {getTitle(), author_, isbn_, genre_}; }
+    
+    const std::string& getAuthor() const { return author_; }
+    const std::string& getIsbn() const { return isbn_; }
+    // Packed ISBN-13, or Isbn::kInvalid if the ISBN is missing or invalid
+    uint64_t getIsbnKey() const { return isbnKey_; }
+    const std::string& getGenre() const { return genre_; }
     
     std::string getDetails() const override {
         return "Author: " + author_ + ", ISBN: " + isbn_ + ", Genre: " + genre_;
@@ -126,30 +881,33 @@ private:
     std::string publisher_;
     int issueNumber_;
     std::string publicationDate_;
+    EpochDay publicationDay_;
 public:
+    static constexpr ItemKind kKind = ItemKind::Magazine;
+    
     Magazine(std::string id, std::string title, std::string publisher, 
              int issueNumber, std::string publicationDate)
-        : LibraryItem(std::move(id), std::move(title)),
+        : LibraryItem(kKind, std::move(id), std::move(title)),
           publisher_(std::move(publisher)), issueNumber_(issueNumber),
-          publicationDate_(std::move(publicationDate))
-    {
-        dailyFine_ = 0.25;
-        maxLoanDays_ = 14;
-    }
-    
-    std::string getPublisher() const { return publisher_; }
-    int getIssueNumber() const { return issueNumber_; }
-    std::string getPublicationDate() const { return publicationDate_; }
+          publicationDate_(std::move(publicationDate)),
+          publicationDay_(DateFormatter::parseDay(publicationDate_))
+    {}
     
-    std::string getItemType() const override {
-        return "Magazine";
+    static std::unique_ptr<LibraryItem> create(std::string id, const FieldValues& fields) {
+        return std::make_unique<Magazine>(std::move(id), fields[0], fields[1],
+                                          parseIntegerField(fields[2], kMagazineFields[2].label), fields[3]);
     }
     
-    double calculateFine(int daysOverdue) const override {
-        if (daysOverdue <= 0) return 0.0;
-        return daysOverdue * dailyFine_;
+    FieldValues fieldValues() const {
+        return {getTitle(), publisher_, std::to_string(issueNumber_), publicationDate_};
     }
     
+    const std::string& getPublisher() const { return publisher_; }
+    int getIssueNumber() const { return issueNumber_; }
+    const std::string& getPublicationDate() const { return publicationDate_; }
+    // Parsed publication date, or kUnknownDay
+    EpochDay getPublicationDay() const { return publicationDay_; }
+    
     std::string getDetails() const override {
         return "Publisher: " + publisher_ + ", Issue: " + std::to_string(issueNumber_) + 
                ", Published: " + publicationDate_;
@@ -164,30 +922,33 @@ private:
     std::string director_;
     int duration_;
     std::string releaseDate_;
+    EpochDay releaseDay_;
 public:
+    static constexpr ItemKind kKind = ItemKind::DVD;
+    
     DVD(std::string id, std::string title, std::string director, 
         int duration, std::string releaseDate)
-        : LibraryItem(std::move(id), std::move(title)),
+        : LibraryItem(kKind, std::move(id), std::move(title)),
           director_(std::move(director)), duration_(duration),
-          releaseDate_(std::move(releaseDate))
-    {
-        dailyFine_ = 1.00;
-        maxLoanDays_ = 7;
-    }
-    
-    std::string getDirector() const { return director_; }
-    int getDuration() const { return duration_; }
-    std::string getReleaseDate() const { return releaseDate_; }
+          releaseDate_(std::move(releaseDate)),
+          releaseDay_(DateFormatter::parseDay(releaseDate_))
+    {}
     
-    std::string getItemType() const override {
-        return "DVD";
+    static std::unique_ptr<LibraryItem> create(std::string id, const FieldValues& fields) {
+        return std::make_unique<DVD>(std::move(id), fields[0], fields[1],
+                                     parseIntegerField(fields[2], kDvdFields[2].label), fields[3]);
     }
     
-    double calculateFine(int daysOverdue) const override {
-        if (daysOverdue <= 0) return 0.0;
-        return daysOverdue * dailyFine_;
+    FieldValues fieldValues() const {
+        return {getTitle(), director_, std::to_string(duration_), releaseDate_};
     }
     
+    const std::string& getDirector() const { return director_; }
+    int getDuration() const { return duration_; }
+    const std::string& getReleaseDate() const { return releaseDate_; }
+    // Parsed release date, or kUnknownDay
+    EpochDay getReleaseDay() const { return releaseDay_; }
+    
     std::string getDetails() const override {
         return "Director: " + director_ + ", Duration: " + std::to_string(duration_) + 
                " mins, Released: " + releaseDate_;
@@ -195,39 +956,147 @@ public:
 };
 
 /**
- * Base class for library patrons
+ * Compile-time list of concrete types, in kind order. visit() calls a
+ * generic visitor with the item cast to its class, dispatching on the kind
+ * with integer compares; create() builds a type from its field values.
  */
-class LibraryPatron : public std::enable_shared_from_this<LibraryPatron> {
-private:
-    std::string id_;
-    std::string name_;
-    std::string contactInfo_;
-    bool active_;
+template<typename Base, typename... Types>
+struct TypeList {
+    static constexpr size_t kSize = sizeof...(Types);
     
-protected:
-    int maxBorrowItems_;
-public:
-    LibraryPatron(std::string id, std::string name, std::string contactInfo)
-        : id_(std::move(id)), name_(std::move(name)), contactInfo_(std::move(contactInfo)),
-          active_(true), maxBorrowItems_(0)
-    {}
+    static constexpr bool inKindOrder() {
+        size_t index = 0;
+        return ((static_cast<size_t>(Types::kKind) == index++) && ...);
+    }
     
-    virtual ~LibraryPatron() = default;
+    template<typename Visitor>
+    static decltype(auto) visit(const Base& object, Visitor&& visitor) {
+        return visitFrom<Types...>(object, visitor);
+    }
     
-    std::string getId() const { return id_; }
-    std::string getName() const { return name_; }
-    std::string getContactInfo() const { return contactInfo_; }
+    template<typename Kind, typename... Args>
+    static std::unique_ptr<Base> create(Kind kind, Args&&... args) {
+        return createFrom<Types...>(kind, std::forward<Args>(args)...);
+    }
+    
+private:
+    template<typename First, typename... Rest, typename Visitor>
+    static decltype(auto) visitFrom(const Base& object, Visitor& visitor) {
+        // Every kind is registered, so the last type needs no check
+        if constexpr (sizeof...(Rest) == 0) {
+            return visitor(static_cast<const First&>(object));
+        } else {
+            if (object.getKind() == First::kKind) return visitor(static_cast<const First&>(object));
+            return visitFrom<Rest...>(object, visitor);
+        }
+    }
+    
+    template<typename First, typename... Rest, typename Kind, typename... Args>
+    static std::unique_ptr<Base> createFrom(Kind kind, Args&&... args) {
+        if (kind == First::kKind) return First::create(std::forward<Args>(args)...);
+        if constexpr (sizeof...(Rest) > 0) {
+            return createFrom<Rest...>(kind, std::forward<Args>(args)...);
+        } else {
+            throw LibraryException("Unregistered type");
+        }
+    }
+};
+
+using RegisteredItems = TypeList<LibraryItem, Book, Magazine, DVD>;
+static_assert(RegisteredItems::kSize == kItemKindCount && RegisteredItems::inKindOrder(),
+              "RegisteredItems must list every item class in kind order");
+
+// Constructor fields after the ID, in registry order
+inline FieldValues itemFieldValues(const LibraryItem& item) {
+    return RegisteredItems::visit(item, [](const auto& typed) { return typed.fieldValues(); });
+}
+
+// Throws on a field count or value the registry does not accept for the type
+inline void checkFields(const char* typeName, const FieldList& specs, const FieldValues& fields) {
+    if (fields.size() != specs.size()) {
+        throw LibraryException(std::string(typeName) + " takes " + std::to_string(specs.size()) + " fields, got " +
+                               std::to_string(fields.size()));
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        std::string error = fieldError(specs[i], fields[i]);
+        if (!error.empty()) throw LibraryException(error);
+    }
+}
+
+inline std::unique_ptr<LibraryItem> createItem(ItemKind kind, std::string id, const FieldValues& fields) {
+    checkFields(itemTypeSpec(kind).name, itemTypeSpec(kind).fields, fields);
+    return RegisteredItems::create(kind, std::move(id), fields);
+}
+
+// Numeric value of a range field's text, or kUnknownDay if it does not parse
+inline int64_t rangeFieldValue(const FieldSpec& spec, const std::string& value) {
+    if (spec.input == FieldInput::Date) return DateFormatter::parseDay(value);
+    int number;
+    return tryParseInteger(value, number) ? number : kUnknownDay;
+}
+
+// Value of the registry's genre field, or empty if the type has none
+inline std::string itemGenre(const LibraryItem& item) {
+    int genreField = itemTypeSpec(item.getKind()).genreField;
+    return genreField < 0 ? std::string() : itemFieldValues(item)[static_cast<size_t>(genreField)];
+}
+
+/**
+ * Builds the normalised search keys for any item type: title, creator and
+ * the genre field named by the registry, if any
+ */
+inline SearchKeys buildSearchKeys(const LibraryItem& item) {
+    FieldValues fields = itemFieldValues(item);
+    int genreField = itemTypeSpec(item.getKind()).genreField;
+    return SearchKeys(item.getTitle(), fields[1], genreField >= 0 ? fields[static_cast<size_t>(genreField)] : "");
+}
+
+/**
+ * Base class for library patrons
+ */
+class LibraryPatron : public std::enable_shared_from_this<LibraryPatron> {
+private:
+    PatronKind kind_;
+    std::string id_;
+    std::string name_;
+    std::string contactInfo_;
+    bool active_;
+    LibraryObserver* observer_ = nullptr;
+    
+protected:
+    int maxBorrowItems_;
+public:
+    LibraryPatron(PatronKind kind, std::string id, std::string name, std::string contactInfo)
+        : kind_(kind), id_(std::move(id)), name_(std::move(name)), contactInfo_(std::move(contactInfo)),
+          active_(true), maxBorrowItems_(patronTypeSpec(kind).maxBorrowItems)
+    {}
+    
+    virtual ~LibraryPatron() = default;
+    
+    PatronKind getKind() const { return kind_; }
+    std::string getId() const { return id_; }
+    std::string getName() const { return name_; }
+    std::string getContactInfo() const { return contactInfo_; }
     bool isActive() const { return active_; }
     int getMaxBorrowItems() const { return maxBorrowItems_; }
     
-    void setActive(bool active) { active_ = active; }
+    void setObserver(LibraryObserver* observer) { observer_ = observer; }
+    
+    void setActive(bool active) {
+        bool wasActive = active_;
+        active_ = active;
+        if (observer_ && wasActive != active_) observer_->onActiveChanged(*this, wasActive);
+    }
     void setContactInfo(const std::string& contactInfo) { contactInfo_ = contactInfo; }
     
-    virtual std::string getPatronType() const = 0;
-    virtual int getLoanExtensionDays() const = 0;
+    std::string getPatronType() const { return patronTypeSpec(kind_).name; }
+    int getLoanExtensionDays() const { return patronTypeSpec(kind_).loanExtensionDays; }
+    
+    // Copy of the record, without its observer, for registering elsewhere
+    std::unique_ptr<LibraryPatron> clone() const;
     
-    void deactivate() { active_ = false; }
-    void activate() { active_ = true; }
+    void deactivate() { setActive(false); }
+    void activate() { setActive(true); }
 };
 
 /**
@@ -238,24 +1107,23 @@ private:
     std::string studentId_;
     std::string major_;
 public:
+    static constexpr PatronKind kKind = PatronKind::Student;
+    
     Student(std::string id, std::string name, std::string contactInfo, 
             std::string studentId, std::string major)
-        : LibraryPatron(std::move(id), std::move(name), std::move(contactInfo)),
+        : LibraryPatron(kKind, std::move(id), std::move(name), std::move(contactInfo)),
           studentId_(std::move(studentId)), major_(std::move(major))
-    {
-        maxBorrowItems_ = 5;
+    {}
+    
+    static std::unique_ptr<LibraryPatron> create(std::string id, std::string name, std::string contactInfo,
+                                                 const FieldValues& fields) {
+        return std::make_unique<Student>(std::move(id), std::move(name), std::move(contactInfo), fields[0], fields[1]);
     }
     
+    FieldValues fieldValues() const { return {studentId_, major_}; }
+    
     std::string getStudentId() const { return studentId_; }
     std::string getMajor() const { return major_; }
-    
-    std::string getPatronType() const override {
-        return "Student";
-    }
-    
-    int getLoanExtensionDays() const override {
-        return 7;
-    }
 };
 
 /**
@@ -266,23 +1134,97 @@ private:
     std::string department_;
     std::string employeeId_;
 public:
+    static constexpr PatronKind kKind = PatronKind::Faculty;
+    
     Faculty(std::string id, std::string name, std::string contactInfo,
             std::string department, std::string employeeId)
-        : LibraryPatron(std::move(id), std::move(name), std::move(contactInfo)),
+        : LibraryPatron(kKind, std::move(id), std::move(name), std::move(contactInfo)),
           department_(std::move(department)), employeeId_(std::move(employeeId))
-    {
-        maxBorrowItems_ = 10;
+    {}
+    
+    static std::unique_ptr<LibraryPatron> create(std::string id, std::string name, std::string contactInfo,
+                                                 const FieldValues& fields) {
+        return std::make_unique<Faculty>(std::move(id), std::move(name), std::move(contactInfo), fields[0], fields[1]);
     }
     
+    FieldValues fieldValues() const { return {department_, employeeId_}; }
+    
     std::string getDepartment() const { return department_; }
     std::string getEmployeeId() const { return employeeId_; }
+};
+
+using RegisteredPatrons = TypeList<LibraryPatron, Student, Faculty>;
+static_assert(RegisteredPatrons::kSize == kPatronKindCount && RegisteredPatrons::inKindOrder(),
+              "RegisteredPatrons must list every patron class in kind order");
+
+// Fields after the ID, name and contact info, in registry order
+inline FieldValues patronFieldValues(const LibraryPatron& patron) {
+    return RegisteredPatrons::visit(patron, [](const auto& typed) { return typed.fieldValues(); });
+}
+
+inline std::unique_ptr<LibraryPatron> createPatron(PatronKind kind, std::string id, std::string name,
+                                                   std::string contactInfo, const FieldValues& fields) {
+    checkFields(patronTypeSpec(kind).name, patronTypeSpec(kind).fields, fields);
+    return RegisteredPatrons::create(kind, std::move(id), std::move(name), std::move(contactInfo), fields);
+}
+
+inline std::unique_ptr<LibraryPatron> LibraryPatron::clone() const {
+    auto copy = createPatron(kind_, id_, name_, contactInfo_, patronFieldValues(*this));
+    copy->setActive(active_);
+    return copy;
+}
+
+/**
+ * Source of the current time for Library, injectable so "as of" evaluation
+ * and benchmarks can run against a simulated clock
+ */
+class LibraryClock {
+public:
+    virtual ~LibraryClock() = default;
+    virtual std::chrono::system_clock::time_point now() const = 0;
+    
+    EpochDay today() const { return toEpochDay(now()); }
+    
+    static EpochDay toEpochDay(std::chrono::system_clock::time_point tp) {
+        return static_cast<EpochDay>(DateFormatter::localDay(std::chrono::system_clock::to_time_t(tp)));
+    }
+};
+
+class SystemClock : public LibraryClock {
+public:
+    std::chrono::system_clock::time_point now() const override {
+        return std::chrono::system_clock::now();
+    }
+};
+
+/**
+ * Manually advanced clock for tests, benchmarks and replays
+ */
+class SimulatedClock : public LibraryClock {
+private:
+    std::atomic<int64_t> nowNs_;
     
-    std::string getPatronType() const override {
-        return "Faculty";
+public:
+    explicit SimulatedClock(std::chrono::system_clock::time_point start = std::chrono::system_clock::now())
+        : nowNs_(std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count())
+    {}
+    
+    std::chrono::system_clock::time_point now() const override {
+        auto ns = std::chrono::nanoseconds(nowNs_.load(std::memory_order_relaxed));
+        return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(ns));
+    }
+    
+    void set(std::chrono::system_clock::time_point tp) {
+        nowNs_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count(),
+                     std::memory_order_relaxed);
+    }
+    
+    void advance(std::chrono::nanoseconds delta) {
+        nowNs_.fetch_add(delta.count(), std::memory_order_relaxed);
     }
     
-    int getLoanExtensionDays() const override {
-        return 14;
+    void advanceDays(int days) {
+        advance(std::chrono::hours(24 * days));
     }
 };
 
@@ -295,23 +1237,18 @@ private:
     std::chrono::system_clock::time_point timestamp_;
     
 public:
-    Transaction() : timestamp_(std::chrono::system_clock::now()) {
-        auto time_t_now = std::chrono::system_clock::to_time_t(timestamp_);
-        std::stringstream ss;
-        ss << "TXN" << time_t_now;
-        transactionId_ = ss.str();
-    }
+    explicit Transaction(std::chrono::system_clock::time_point timestamp = std::chrono::system_clock::now())
+        : timestamp_(timestamp) {}
     
     virtual ~Transaction() = default;
     
+    // "TXN" and the journal sequence number; empty until the library journals it
     std::string getTransactionId() const { return transactionId_; }
+    void assignTransactionId(uint64_t sequence) { transactionId_ = "TXN" + std::to_string(sequence); }
     std::chrono::system_clock::time_point getTimestamp() const { return timestamp_; }
     
     std::string getFormattedTimestamp() const {
-        auto time_t_now = std::chrono::system_clock::to_time_t(timestamp_);
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&time_t_now), "%Y-%m-%d %H:%M:%S");
-        return ss.str();
+        return DateFormatter::formatDateTime(std::chrono::system_clock::to_time_t(timestamp_));
     }
     
     virtual std::string getTransactionType() const = 0;
@@ -325,12 +1262,18 @@ class Checkout : public Transaction {
 private:
     std::shared_ptr<LibraryItem> item_;
     std::shared_ptr<LibraryPatron> patron_;
-    std::chrono::system_clock::time_point dueDate_;
+    EpochDay checkoutDay_;
+    EpochDay dueDay_;
+    size_t copyIndex_;
+    int renewals_ = 0;
     
 public:
     Checkout(std::shared_ptr<LibraryItem> item, std::shared_ptr<LibraryPatron> patron,
-             int loanDays)
-        : item_(item), patron_(patron)
+             int loanDays, size_t copyIndex = LibraryItem::kAnyCopy,
+             std::chrono::system_clock::time_point now = std::chrono::system_clock::now())
+        : Transaction(now), item_(item), patron_(patron),
+          checkoutDay_(LibraryClock::toEpochDay(now)), dueDay_(checkoutDay_ + loanDays),
+          copyIndex_(copyIndex)
     {
         if (!item || !patron) {
             throw CheckoutException("Invalid item or patron");
@@ -342,34 +1285,41 @@ public:
             throw CheckoutException("Patron is not active");
         }
         
-        item_->checkOut();
-        
-        auto duration = std::chrono::hours(24 * loanDays);
-        dueDate_ = std::chrono::system_clock::now() + duration;
+        copyIndex_ = item_->checkOut(copyIndex);
     }
     
     std::shared_ptr<LibraryItem> getItem() const { return item_; }
     std::shared_ptr<LibraryPatron> getPatron() const { return patron_; }
-    std::chrono::system_clock::time_point getDueDate() const { return dueDate_; }
+    EpochDay getCheckoutDay() const { return checkoutDay_; }
+    EpochDay getDueDay() const { return dueDay_; }
+    size_t getCopyIndex() const { return copyIndex_; }
+    const std::string& getCopyBarcode() const { return item_->getCopyBarcode(copyIndex_); }
+    int getRenewalCount() const { return renewals_; }
+    
+    // Extends the loan in place; the item never shows as available
+    void renew(int extraDays) {
+        dueDay_ += extraDays;
+        ++renewals_;
+    }
+    
+    // Reinstates the terms of a loan read back from a checkpoint
+    void restoreTerms(EpochDay checkoutDay, EpochDay dueDay, int renewals) {
+        checkoutDay_ = checkoutDay;
+        dueDay_ = dueDay;
+        renewals_ = renewals;
+    }
     
     std::string getFormattedDueDate() const {
-        auto time_t_due = std::chrono::system_clock::to_time_t(dueDate_);
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&time_t_due), "%Y-%m-%d");
-        return ss.str();
+        return DateFormatter::formatDay(dueDay_);
     }
     
-    bool isOverdue() const {
-        return std::chrono::system_clock::now() > dueDate_;
+    bool isOverdue(EpochDay asOf) const {
+        return asOf > dueDay_;
     }
     
-    double calculateFine() const {
-        if (!isOverdue()) return 0.0;
-        
-        auto overdueTime = std::chrono::system_clock::now() - dueDate_;
-        auto overdueDays = std::chrono::duration_cast<std::chrono::hours>(overdueTime).count() / 24;
-        
-        return item_->calculateFine(static_cast<int>(overdueDays));
+    double calculateFine(EpochDay asOf) const {
+        if (!isOverdue(asOf)) return 0.0;
+        return item_->calculateFine(asOf - dueDay_);
     }
     
     std::string getTransactionType() const override {
@@ -378,12 +1328,19 @@ public:
     
     std::string getDetails() const override {
         std::stringstream ss;
-        ss << "Item: " << item_->getTitle() << " (" << item_->getId() << ")\n"
-           << "Patron: " << patron_->getName() << " (" << patron_->getId() << ")\n"
-           << "Due Date: " << getFormattedDueDate() << "\n"
-           << "Overdue: " << (isOverdue() ? "Yes" : "No");
+        ss << "Item: " << item_->getTitle() << " (" << item_->getId() << ")\n";
+        if (getCopyBarcode() != item_->getId()) {
+            ss << "Copy: " << getCopyBarcode() << "\n";
+        }
+        ss << "Patron: " << patron_->getName() << " (" << patron_->getId() << ")\n"
+           << "Due Date: " << getFormattedDueDate();
         return ss.str();
     }
+    
+    // Overdue status is judged against the caller's day, usually Library::today()
+    std::string getDetails(EpochDay asOf) const {
+        return getDetails() + "\nOverdue: " + (isOverdue(asOf) ? "Yes" : "No");
+    }
 };
 
 /**
@@ -395,14 +1352,14 @@ private:
     double fine_;
     
 public:
-    Return(std::shared_ptr<Checkout> checkout)
-        : checkout_(checkout), fine_(0.0)
+    Return(std::shared_ptr<Checkout> checkout, double fine,
+           std::chrono::system_clock::time_point now = std::chrono::system_clock::now())
+        : Transaction(now), checkout_(checkout), fine_(fine)
     {
         if (!checkout) {
             throw ReturnException("Invalid checkout transaction");
         }
-        fine_ = checkout_->calculateFine();
-        checkout_->getItem()->returnItem();
+        checkout_->getItem()->returnItem(checkout_->getCopyIndex());
     }
     
     std::shared_ptr<Checkout> getCheckout() const { return checkout_; }
@@ -422,326 +1379,7064 @@ public:
 };
 
 /**
- * Library class to manage the entire system
+ * Per-item hold queues. Faculty holds are served before Student holds,
+ * each group first-come first-served. When a copy frees up it is pulled
+ * off the shelf for the next hold in O(1); expirations are driven by a
+ * min-heap of deadlines instead of sweeps over all holds.
  */
-class Library {
+class HoldManager {
+public:
+    struct Hold {
+        uint64_t holdId;
+        std::shared_ptr<LibraryItem> item;
+        std::shared_ptr<LibraryPatron> patron;
+        std::chrono::system_clock::time_point placedAt;
+        std::chrono::system_clock::time_point expiresAt;  // pickup deadline once ready
+        bool ready;
+        size_t copyIndex;
+    };
+    
 private:
-    std::map<std::string, std::unique_ptr<LibraryItem>> items_;
-    std::map<std::string, std::unique_ptr<LibraryPatron>> patrons_;
-    std::vector<std::shared_ptr<Transaction>> transactions_;
-    std::map<std::string, std::shared_ptr<Checkout>> activeCheckouts_;
+    struct Queue {
+        std::deque<uint64_t> priority;
+        std::deque<uint64_t> regular;
+        size_t waiting = 0;
+    };
     
-    LibraryItem* findItemById(const std::string& id) {
-        auto it = items_.find(id);
-        if (it != items_.end()) {
-            return it->second.get();
+    struct Timer {
+        std::chrono::system_clock::time_point deadline;
+        uint64_t holdId;
+        // Equal deadlines expire in hold order, so a journal replay matches
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : holdId > other.holdId;
         }
-        return nullptr;
+    };
+    
+    std::unordered_map<uint64_t, Hold> holds_;
+    std::unordered_map<std::string, Queue> queues_;              // by item ID
+    std::unordered_map<std::string, uint64_t> byItemAndPatron_;  // item ID + '\n' + patron ID
+    std::unordered_map<std::string, uint64_t> readyByCopy_;      // copy barcode
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t nextHoldId_ = 1;
+    int holdLifetimeDays_ = 180;
+    int pickupDays_ = 7;
+    
+    static std::string pairKey(const std::string& itemId, const std::string& patronId) {
+        return itemId + '\n' + patronId;
     }
     
-    LibraryPatron* findPatronById(const std::string& id) {
-        auto it = patrons_.find(id);
-        if (it != patrons_.end()) {
-            return it->second.get();
+    static bool hasPriority(const LibraryPatron& patron) {
+        return patronTypeSpec(patron.getKind()).holdPriority;
+    }
+    
+    // Pops the next hold still waiting in the queue; cancelled ids are skipped lazily
+    Hold* popNextWaiting(Queue& queue) {
+        for (auto* ids : {&queue.priority, &queue.regular}) {
+            while (!ids->empty()) {
+                uint64_t id = ids->front();
+                ids->pop_front();
+                auto it = holds_.find(id);
+                if (it != holds_.end() && !it->second.ready) {
+                    --queue.waiting;
+                    return &it->second;
+                }
+            }
         }
         return nullptr;
     }
     
+    void erase(const Hold& hold) {
+        if (hold.ready) readyByCopy_.erase(hold.item->getCopyBarcode(hold.copyIndex));
+        byItemAndPatron_.erase(pairKey(hold.item->getId(), hold.patron->getId()));
+        holds_.erase(hold.holdId);
+    }
+    
 public:
-    Library() = default;
+    void setHoldLifetimeDays(int days) { holdLifetimeDays_ = days; }
+    void setPickupDays(int days) { pickupDays_ = days; }
+    int getPickupDays() const { return pickupDays_; }
     
-    void addItem(std::unique_ptr<LibraryItem> item) {
-        if (!item) {
-            throw LibraryException("Cannot add null item");
+    uint64_t place(std::shared_ptr<LibraryItem> item, std::shared_ptr<LibraryPatron> patron,
+                   std::chrono::system_clock::time_point now) {
+        std::string key = pairKey(item->getId(), patron->getId());
+        if (byItemAndPatron_.count(key)) {
+            throw LibraryException("Patron " + patron->getId() + " already has a hold on item: " + item->getId());
         }
-        items_[item->getId()] = std::move(item);
+        
+        uint64_t id = nextHoldId_++;
+        Hold hold{id, item, patron, now, now + std::chrono::hours(24 * holdLifetimeDays_), false, 0};
+        Queue& queue = queues_[item->getId()];
+        (hasPriority(*patron) ? queue.priority : queue.regular).push_back(id);
+        ++queue.waiting;
+        holds_.emplace(id, hold);
+        byItemAndPatron_[key] = id;
+        timers_.push({hold.expiresAt, id});
+        
+        allocate(*item, now);
+        return id;
     }
     
-    void addPatron(std::unique_ptr<LibraryPatron> patron) {
-        if (!patron) {
-            throw LibraryException("Cannot add null patron");
+    // Moves free copies of the item onto the hold shelf for waiting holds
+    void allocate(LibraryItem& item, std::chrono::system_clock::time_point now) {
+        auto queueIt = queues_.find(item.getId());
+        if (queueIt == queues_.end()) return;
+        while (item.isAvailable()) {
+            Hold* hold = popNextWaiting(queueIt->second);
+            if (!hold) break;
+            hold->copyIndex = item.checkOut();
+            hold->ready = true;
+            hold->expiresAt = now + std::chrono::hours(24 * pickupDays_);
+            readyByCopy_[item.getCopyBarcode(hold->copyIndex)] = hold->holdId;
+            timers_.push({hold->expiresAt, hold->holdId});
         }
-        patrons_[patron->getId()] = std::move(patron);
-    }
-    
-    const LibraryItem* findItem(const std::string& id) const {
-        auto it = items_.find(id);
-        if (it != items_.end()) {
-            return it->second.get();
+        if (queueIt->second.priority.empty() && queueIt->second.regular.empty()) {
+            queues_.erase(queueIt);
         }
-        throw ItemNotFoundException(id);
     }
     
-    const LibraryPatron* findPatron(const std::string& id) const {
-        auto it = patrons_.find(id);
-        if (it != patrons_.end()) {
-            return it->second.get();
-        }
-        throw PatronNotFoundException(id);
+    // Copy on the hold shelf for this patron, or kAnyCopy; claims nothing
+    size_t heldCopy(const std::string& itemId, const std::string& patronId) const {
+        auto key = byItemAndPatron_.find(pairKey(itemId, patronId));
+        if (key == byItemAndPatron_.end()) return LibraryItem::kAnyCopy;
+        const Hold& hold = holds_.at(key->second);
+        return hold.ready ? hold.copyIndex : LibraryItem::kAnyCopy;
     }
     
-    std::shared_ptr<Checkout> checkoutItem(const std::string& itemId, const std::string& patronId) {
-        LibraryItem* itemPtr = findItemById(itemId);
-        LibraryPatron* patronPtr = findPatronById(patronId);
-        
-        if (!itemPtr) throw ItemNotFoundException(itemId);
-        if (!patronPtr) throw PatronNotFoundException(patronId);
-        
-        auto sharedItem = itemPtr->shared_from_this();
-        auto sharedPatron = patronPtr->shared_from_this();
-        
-        auto checkout = std::make_shared<Checkout>(sharedItem, sharedPatron, itemPtr->getMaxLoanDays());
-        activeCheckouts_[itemId] = checkout;
-        transactions_.push_back(checkout);
+    // Releases the copy reserved for this patron so it can be checked out;
+    // returns its index, or kAnyCopy if the patron has no ready hold
+    size_t claim(const std::string& itemId, const std::string& patronId) {
+        auto key = byItemAndPatron_.find(pairKey(itemId, patronId));
+        if (key == byItemAndPatron_.end()) return LibraryItem::kAnyCopy;
+        Hold& hold = holds_.at(key->second);
+        if (!hold.ready) return LibraryItem::kAnyCopy;
         
-        return checkout;
+        size_t copyIndex = hold.copyIndex;
+        std::shared_ptr<LibraryItem> item = hold.item;
+        erase(hold);
+        item->returnItem(copyIndex);
+        return copyIndex;
     }
     
-    std::shared_ptr<Return> returnItem(const std::string& itemId) {
-        auto it = activeCheckouts_.find(itemId);
-        if (it == activeCheckouts_.end()) {
-            throw ReturnException("No active checkout for item: " + itemId);
+    void cancel(uint64_t holdId, std::chrono::system_clock::time_point now) {
+        auto it = holds_.find(holdId);
+        if (it == holds_.end()) {
+            throw LibraryException("Hold not found: " + std::to_string(holdId));
         }
-        
-        auto ret = std::make_shared<Return>(it->second);
-        transactions_.push_back(ret);
-        activeCheckouts_.erase(it);
-        
-        return ret;
-    }
-    
-    std::vector<const LibraryItem*> searchItemsByTitle(const std::string& title) const {
-        std::vector<const LibraryItem*> results;
-        for (const auto& pair : items_) {
-            if (pair.second->getTitle().find(title) != std::string::npos) {
-                results.push_back(pair.second.get());
-            }
+        Hold hold = it->second;
+        erase(hold);
+        if (!hold.ready) {
+            --queues_.at(hold.item->getId()).waiting;
+        } else {
+            hold.item->returnItem(hold.copyIndex);
+            allocate(*hold.item, now);
         }
-        return results;
     }
     
-    std::vector<const LibraryItem*> searchItemsByAuthor(const std::string& author) const {
-        std::vector<const LibraryItem*> results;
-        for (const auto& pair : items_) {
-            if (pair.second->getItemType() == "Book") {
-                const Book* book = dynamic_cast<const Book*>(pair.second.get());
-                if (book && book->getAuthor().find(author) != std::string::npos) {
-                    results.push_back(pair.second.get());
-                }
-            }
+    // Expires holds whose deadline has passed; returns how many expired
+    size_t expire(std::chrono::system_clock::time_point now) {
+        size_t expired = 0;
+        while (!timers_.empty() && timers_.top().deadline <= now) {
+            Timer timer = timers_.top();
+            timers_.pop();
+            auto it = holds_.find(timer.holdId);
+            // Stale timer: hold already gone or its deadline was moved
+            if (it == holds_.end() || it->second.expiresAt != timer.deadline) continue;
+            cancel(timer.holdId, now);
+            ++expired;
         }
-        return results;
+        return expired;
     }
     
-    std::vector<const LibraryItem*> searchItemsByGenre(const std::string& genre) const {
-        std::vector<const LibraryItem*> results;
-        for (const auto& pair : items_) {
-            if (pair.second->getItemType() == "Book") {
-                const Book* book = dynamic_cast<const Book*>(pair.second.get());
-                if (book && book->getGenre().find(genre) != std::string::npos) {
-                    results.push_back(pair.second.get());
-                }
-            }
-        }
-        return results;
+    const Hold* find(uint64_t holdId) const {
+        auto it = holds_.find(holdId);
+        return it == holds_.end() ? nullptr : &it->second;
     }
     
-    std::vector<const LibraryItem*> searchItemsByType(const std::string& type) const {
-        std::vector<const LibraryItem*> results;
-        for (const auto& pair : items_) {
-            if (pair.second->getItemType() == type) {
-                results.push_back(pair.second.get());
-            }
-        }
-        return results;
+    const Hold* findReadyForCopy(const std::string& barcode) const {
+        auto it = readyByCopy_.find(barcode);
+        return it == readyByCopy_.end() ? nullptr : find(it->second);
     }
     
-    std::vector<const LibraryItem*> searchItems(const std::function<bool(const LibraryItem&)>& predicate) const {
-        std::vector<const LibraryItem*> results;
-        for (const auto& pair : items_) {
-            if (predicate(*pair.second)) {
-                results.push_back(pair.second.get());
+    // Holds on an item in service order: ready holds first, then the queue
+    std::vector<const Hold*> getHolds(const LibraryItem& item) const {
+        std::vector<const Hold*> result;
+        for (const auto& copy : item.getCopies()) {
+            if (const Hold* hold = findReadyForCopy(copy.barcode)) result.push_back(hold);
+        }
+        auto queueIt = queues_.find(item.getId());
+        if (queueIt == queues_.end()) return result;
+        for (const auto* ids : {&queueIt->second.priority, &queueIt->second.regular}) {
+            for (uint64_t id : *ids) {
+                auto it = holds_.find(id);
+                if (it != holds_.end() && !it->second.ready) result.push_back(&it->second);
             }
         }
-        return results;
+        return result;
     }
     
-    void printOverdueItems() const {
-        std::cout << "\n=== OVERDUE ITEMS ===\n";
-        bool found = false;
-        for (const auto& checkout : activeCheckouts_) {
-            if (checkout.second->isOverdue()) {
-                found = true;
-                std::cout << "Item: " << checkout.second->getItem()->getTitle() << "\n"
-                          << "Patron: " << checkout.second->getPatron()->getName() << "\n"
-                          << "Due Date: " << checkout.second->getFormattedDueDate() << "\n"
-                          << "Fine: $" << std::fixed << std::setprecision(2) 
-                          << checkout.second->calculateFine() << "\n\n";
-            }
-        }
-        if (!found) {
-            std::cout << "No overdue items.\n";
-        }
+    bool hasWaitingHolds(const std::string& itemId) const {
+        auto it = queues_.find(itemId);
+        return it != queues_.end() && it->second.waiting > 0;
     }
     
-    void printPatronHistory(const std::string& patronId) const {
-        std::cout << "\n=== PATRON HISTORY: " << patronId << " ===\n";
-        bool found = false;
-        for (const auto& transaction : transactions_) {
-            if (transaction->getTransactionType() == "Checkout") {
-                const Checkout* checkout = dynamic_cast<const Checkout*>(transaction.get());
-                if (checkout && checkout->getPatron()->getId() == patronId) {
-                    found = true;
-                    std::cout << checkout->getDetails() << "\n\n";
-                }
-            }
+    /**
+     * Reinstates a hold read back from a checkpoint. Call in getHolds()
+     * order for each item, so queues keep their service order; a ready
+     * hold takes its copy off the shelf again.
+     */
+    void restore(const Hold& hold) {
+        std::string key = pairKey(hold.item->getId(), hold.patron->getId());
+        if (holds_.count(hold.holdId) || byItemAndPatron_.count(key)) {
+            throw LibraryException("Duplicate hold in checkpoint: " + std::to_string(hold.holdId));
         }
-        if (!found) {
-            std::cout << "No transactions found for this patron.\n";
+        if (hold.ready) {
+            hold.item->checkOut(hold.copyIndex);
+            readyByCopy_[hold.item->getCopyBarcode(hold.copyIndex)] = hold.holdId;
+        } else {
+            Queue& queue = queues_[hold.item->getId()];
+            (hasPriority(*hold.patron) ? queue.priority : queue.regular).push_back(hold.holdId);
+            ++queue.waiting;
         }
+        holds_.emplace(hold.holdId, hold);
+        byItemAndPatron_[key] = hold.holdId;
+        timers_.push({hold.expiresAt, hold.holdId});
+        nextHoldId_ = std::max(nextHoldId_, hold.holdId + 1);
     }
     
-    void printInventory() const {
-        std::cout << "\n=== LIBRARY INVENTORY ===\n";
-        for (const auto& pair : items_) {
-            const auto& item = pair.second;
-            std::cout << "ID: " << item->getId() << "\n"
-                      << "Title: " << item->getTitle() << "\n"
-                      << "Type: " << item->getItemType() << "\n"
-                      << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n"
-                      << "Details: " << item->getDetails() << "\n\n";
-        }
-    }
+    // Hold IDs continue from next, so IDs from before a restart are not reused
+    void resumeHoldIds(uint64_t next) { nextHoldId_ = std::max(nextHoldId_, next); }
+    uint64_t getNextHoldId() const { return nextHoldId_; }
+    
+    size_t size() const { return holds_.size(); }
 };
 
 /**
- * Simple test framework for unit testing
+ * Fine policy table: per item type rate, grace period and cap, plus
+ * per patron type multipliers. Item types without a rule keep the item's
+ * own daily fine with no grace period and no cap.
  */
-class UnitTest {
+class FinePolicy {
+public:
+    struct ItemRule {
+        std::string itemType;
+        double dailyRate;
+        int graceDays;
+        double maxFine;  // 0 means uncapped
+    };
+    
+    struct PatronRule {
+        std::string patronType;
+        double multiplier;
+    };
+    
 private:
-    int passed_ = 0;
-    int failed_ = 0;
+    std::vector<ItemRule> itemRules_;
+    std::vector<PatronRule> patronRules_;
+    bool loanExtensionAsGrace_ = false;
     
 public:
-    template<typename Func>
-    void test(const std::string& testName, Func testFunc) {
-        try {
-            testFunc();
-            std::cout << "✓ PASS: " << testName << std::endl;
-            passed_++;
+    FinePolicy& setItemRule(const std::string& itemType, double dailyRate, int graceDays = 0, double maxFine = 0.0) {
+        if (dailyRate < 0.0 || graceDays < 0 || maxFine < 0.0) {
+            throw LibraryException("Invalid fine rule for item type: " + itemType);
         }
-        catch (const std::exception& e) {
-            std::cout << "✗ FAIL: " << testName << " - " << e.what() << std::endl;
-            failed_++;
+        for (auto& rule : itemRules_) {
+            if (rule.itemType == itemType) {
+                rule = {itemType, dailyRate, graceDays, maxFine};
+                return *this;
+            }
         }
+        itemRules_.push_back({itemType, dailyRate, graceDays, maxFine});
+        return *this;
     }
     
-    void printSummary() const {
-        std::cout << "\n===== TEST RESULTS =====\n";
-        std::cout << "Passed: " << passed_ << std::endl;
-        std::cout << "Failed: " << failed_ << std::endl;
-        std::cout << "========================\n";
+    FinePolicy& setPatronMultiplier(const std::string& patronType, double multiplier) {
+        if (multiplier < 0.0) {
+            throw LibraryException("Invalid fine multiplier for patron type: " + patronType);
+        }
+        for (auto& rule : patronRules_) {
+            if (rule.patronType == patronType) {
+                rule.multiplier = multiplier;
+                return *this;
+            }
+        }
+        patronRules_.push_back({patronType, multiplier});
+        return *this;
+    }
+    
+    // Extends each loan's grace period by the patron's getLoanExtensionDays()
+    FinePolicy& setLoanExtensionAsGrace(bool enabled) {
+        loanExtensionAsGrace_ = enabled;
+        return *this;
     }
+    
+    const std::vector<ItemRule>& getItemRules() const { return itemRules_; }
+    const std::vector<PatronRule>& getPatronRules() const { return patronRules_; }
+    bool isLoanExtensionAsGrace() const { return loanExtensionAsGrace_; }
 };
 
 /**
- * Function to run all unit tests
+ * Active loans laid out as flat arrays, with every policy lookup already
+ * resolved, so a whole batch can be priced in one branch-free integer pass
  */
-void runTests() {
+struct FineBatch {
+    std::vector<std::shared_ptr<Checkout>> loans;
+    std::vector<int32_t> dueDay;
+    std::vector<int32_t> graceDays;
+    std::vector<int64_t> dailyRateCents;
+    std::vector<int64_t> maxFineCents;
+    
+    size_t size() const { return loans.size(); }
+};
+
+/**
+ * FinePolicy flattened into lookup tables. Rules are resolved once per loan
+ * (rates rounded to whole cents) when a FineBatch is prepared; evaluation
+ * is then pure integer arithmetic.
+ */
+class CompiledFinePolicy {
+public:
+    // A loan's rules resolved to whole cents
+    struct FineTerms {
+        int32_t graceDays;
+        int64_t dailyRateCents;
+        int64_t maxFineCents;
+    };
+    
+private:
+    // Indexed by kind; rules naming unregistered types never apply
+    std::array<std::optional<FinePolicy::ItemRule>, kItemKindCount> itemRules_{};
+    std::array<double, kPatronKindCount> patronMultipliers_{};
+    bool loanExtensionAsGrace_ = false;
+    
+    static int64_t toCents(double amount) {
+        return static_cast<int64_t>(std::llround(amount * 100.0));
+    }
+    
+    FineTerms resolve(const Checkout& checkout) const {
+        const auto& item = *checkout.getItem();
+        const auto& patron = *checkout.getPatron();
+        
+        int32_t graceDays = 0;
+        double dailyRate = item.getDailyFine();
+        int64_t maxFineCents = std::numeric_limits<int64_t>::max();
+        if (const auto& itemRule = itemRules_[static_cast<size_t>(item.getKind())]) {
+            graceDays = itemRule->graceDays;
+            dailyRate = itemRule->dailyRate;
+            if (itemRule->maxFine > 0.0) maxFineCents = toCents(itemRule->maxFine);
+        }
+        dailyRate *= patronMultipliers_[static_cast<size_t>(patron.getKind())];
+        if (loanExtensionAsGrace_) {
+            graceDays += patron.getLoanExtensionDays();
+        }
+        return {graceDays, toCents(dailyRate), maxFineCents};
+    }
+    
+    static int64_t fineCents(int32_t asOf, int32_t due, int32_t grace, int64_t rateCents, int64_t capCents) {
+        int64_t days = static_cast<int64_t>(asOf) - due - grace;
+        days = days > 0 ? days : 0;
+        int64_t fine = days * rateCents;
+        return fine < capCents ? fine : capCents;
+    }
+    
+public:
+    CompiledFinePolicy() {
+        patronMultipliers_.fill(1.0);
+    }
+    
+    explicit CompiledFinePolicy(const FinePolicy& policy)
+        : loanExtensionAsGrace_(policy.isLoanExtensionAsGrace())
+    {
+        patronMultipliers_.fill(1.0);
+        for (const auto& rule : policy.getItemRules()) {
+            if (const ItemTypeSpec* spec = findItemType(rule.itemType)) {
+                itemRules_[static_cast<size_t>(spec->kind)] = rule;
+            }
+        }
+        for (const auto& rule : policy.getPatronRules()) {
+            if (const PatronTypeSpec* spec = findPatronType(rule.patronType)) {
+                patronMultipliers_[static_cast<size_t>(spec->kind)] = rule.multiplier;
+            }
+        }
+    }
+    
+    FineBatch prepare(const std::vector<std::shared_ptr<Checkout>>& loans) const {
+        FineBatch batch;
+        batch.loans = loans;
+        batch.dueDay.reserve(loans.size());
+        batch.graceDays.reserve(loans.size());
+        batch.dailyRateCents.reserve(loans.size());
+        batch.maxFineCents.reserve(loans.size());
+        for (const auto& loan : loans) {
+            FineTerms rule = resolve(*loan);
+            batch.dueDay.push_back(loan->getDueDay());
+            batch.graceDays.push_back(rule.graceDays);
+            batch.dailyRateCents.push_back(rule.dailyRateCents);
+            batch.maxFineCents.push_back(rule.maxFineCents);
+        }
+        return batch;
+    }
+    
+    // Computes fines in cents for every loan in the batch as of the given day
+    void evaluate(const FineBatch& batch, EpochDay asOf, std::vector<int64_t>& fines) const {
+        const size_t n = batch.size();
+        fines.resize(n);
+        const int32_t* due = batch.dueDay.data();
+        const int32_t* grace = batch.graceDays.data();
+        const int64_t* rate = batch.dailyRateCents.data();
+        const int64_t* cap = batch.maxFineCents.data();
+        int64_t* out = fines.data();
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = fineCents(asOf, due[i], grace[i], rate[i], cap[i]);
+        }
+    }
+    
+    FineTerms termsFor(const Checkout& checkout) const {
+        return resolve(checkout);
+    }
+    
+    // Fine for a loan due on dueDay under already resolved terms
+    static double fineFor(const FineTerms& terms, EpochDay dueDay, EpochDay asOf) {
+        if (asOf <= dueDay) return 0.0;
+        return fineCents(asOf, dueDay, terms.graceDays, terms.dailyRateCents, terms.maxFineCents) / 100.0;
+    }
+    
+    double fineFor(const Checkout& checkout, EpochDay asOf) const {
+        if (!checkout.isOverdue(asOf)) return 0.0;
+        FineTerms rule = resolve(checkout);
+        return fineCents(asOf, checkout.getDueDay(), rule.graceDays, rule.dailyRateCents, rule.maxFineCents) / 100.0;
+    }
+};
+
+/**
+ * Running fine balance per patron. Amounts are kept in whole cents so
+ * repeated charges and payments never drift.
+ */
+class FineLedger {
+private:
+    struct Account {
+        int64_t balanceCents = 0;
+        int64_t chargedCents = 0;
+        int64_t paidCents = 0;
+    };
+    
+    std::unordered_map<std::string, Account> accounts_;
+    int64_t blockThresholdCents_ = 1000;
+    int64_t outstandingCents_ = 0;
+    
+    static int64_t toCents(double amount) {
+        return static_cast<int64_t>(std::llround(amount * 100.0));
+    }
+    
+public:
+    void charge(const std::string& patronId, double amount) {
+        int64_t cents = toCents(amount);
+        if (cents <= 0) return;
+        Account& account = accounts_[patronId];
+        account.balanceCents += cents;
+        account.chargedCents += cents;
+        outstandingCents_ += cents;
+    }
+    
+    void pay(const std::string& patronId, double amount) {
+        int64_t cents = toCents(amount);
+        if (cents <= 0) {
+            throw LibraryException("Payment amount must be positive");
+        }
+        auto it = accounts_.find(patronId);
+        int64_t balance = it == accounts_.end() ? 0 : it->second.balanceCents;
+        if (cents > balance) {
+            throw LibraryException("Payment exceeds outstanding balance for patron: " + patronId);
+        }
+        it->second.balanceCents -= cents;
+        it->second.paidCents += cents;
+        outstandingCents_ -= cents;
+    }
+    
+    double getBalance(const std::string& patronId) const {
+        auto it = accounts_.find(patronId);
+        return it == accounts_.end() ? 0.0 : it->second.balanceCents / 100.0;
+    }
+    
+    double getTotalCharged(const std::string& patronId) const {
+        auto it = accounts_.find(patronId);
+        return it == accounts_.end() ? 0.0 : it->second.chargedCents / 100.0;
+    }
+    
+    double getTotalPaid(const std::string& patronId) const {
+        auto it = accounts_.find(patronId);
+        return it == accounts_.end() ? 0.0 : it->second.paidCents / 100.0;
+    }
+    
+    // Sum of all patron balances
+    double getTotalOutstanding() const { return outstandingCents_ / 100.0; }
+    
+    void setBlockThreshold(double amount) {
+        if (amount < 0.0) {
+            throw LibraryException("Block threshold cannot be negative");
+        }
+        blockThresholdCents_ = toCents(amount);
+    }
+    
+    double getBlockThreshold() const { return blockThresholdCents_ / 100.0; }
+    
+    // Patrons owing more than the threshold may not borrow
+    bool isBlocked(const std::string& patronId) const {
+        auto it = accounts_.find(patronId);
+        return it != accounts_.end() && it->second.balanceCents > blockThresholdCents_;
+    }
+    
+    // Visits (patronId, chargedCents, paidCents) for every account
+    template<typename Visitor>
+    void forEachAccount(Visitor visit) const {
+        for (const auto& pair : accounts_) visit(pair.first, pair.second.chargedCents, pair.second.paidCents);
+    }
+    
+    // Reinstates an account read back from a checkpoint
+    void restoreAccount(const std::string& patronId, int64_t chargedCents, int64_t paidCents) {
+        if (chargedCents < 0 || paidCents < 0 || paidCents > chargedCents) {
+            throw LibraryException("Invalid account totals for patron: " + patronId);
+        }
+        Account& account = accounts_[patronId];
+        outstandingCents_ -= account.balanceCents;
+        account.chargedCents = chargedCents;
+        account.paidCents = paidCents;
+        account.balanceCents = chargedCents - paidCents;
+        outstandingCents_ += account.balanceCents;
+    }
+};
+
+/**
+ * Composable item query: field predicates combined with AND/OR/NOT, plus an
+ * optional sort order and limit. For example:
+ *     (ItemQuery::titleContains("War") && ItemQuery::typeIs("Book")).sortBy(ItemQuery::SortKey::Title).limit(20)
+ */
+class ItemQuery {
+public:
+    enum class Op { All, Contains, Equals, Between, Available, And, Or, Not };
+    enum class SortKey { Id, Title };
+    
+    struct Node {
+        Op op;
+        ItemField field;
+        std::string value;
+        std::vector<std::shared_ptr<const Node>> children;
+        int64_t low = 0;   // inclusive bounds for Between
+        int64_t high = 0;
+    };
+    
+private:
+    std::shared_ptr<const Node> root_;
+    SortKey sortKey_ = SortKey::Id;
+    size_t limit_ = std::numeric_limits<size_t>::max();
+    
+    static ItemQuery leaf(Op op, ItemField field, std::string value) {
+        ItemQuery query;
+        query.root_ = std::make_shared<Node>(Node{op, field, std::move(value), {}});
+        return query;
+    }
+    
+    static ItemQuery between(ItemField field, int64_t low, int64_t high) {
+        ItemQuery query;
+        query.root_ = std::make_shared<Node>(Node{Op::Between, field, "", {}, low, high});
+        return query;
+    }
+    
+    static ItemQuery combine(Op op, const ItemQuery& lhs, const ItemQuery& rhs) {
+        Node node{op, ItemField::Id, "", {}};
+        // Flatten chains of the same operator so evaluation stays shallow
+        for (const ItemQuery* side : {&lhs, &rhs}) {
+            if (side->root_->op == op) {
+                node.children.insert(node.children.end(), side->root_->children.begin(), side->root_->children.end());
+            } else {
+                node.children.push_back(side->root_);
+            }
+        }
+        ItemQuery query;
+        query.root_ = std::make_shared<Node>(std::move(node));
+        return query;
+    }
+    
+public:
+    ItemQuery() : root_(std::make_shared<Node>(Node{Op::All, ItemField::Id, "", {}})) {}
+    
+    static ItemQuery all() { return ItemQuery(); }
+    static ItemQuery idIs(std::string id) { return leaf(Op::Equals, ItemField::Id, std::move(id)); }
+    static ItemQuery typeIs(std::string type) { return leaf(Op::Equals, ItemField::Type, std::move(type)); }
+    static ItemQuery titleContains(std::string text) { return leaf(Op::Contains, ItemField::Title, std::move(text)); }
+    static ItemQuery authorContains(std::string text) { return leaf(Op::Contains, ItemField::Author, std::move(text)); }
+    static ItemQuery genreContains(std::string text) { return leaf(Op::Contains, ItemField::Genre, std::move(text)); }
+    static ItemQuery directorContains(std::string text) { return leaf(Op::Contains, ItemField::Director, std::move(text)); }
+    static ItemQuery publisherContains(std::string text) { return leaf(Op::Contains, ItemField::Publisher, std::move(text)); }
+    static ItemQuery available() { return leaf(Op::Available, ItemField::Available, ""); }
+    // Inclusive ranges; items of other types, or with an unknown date, never match
+    static ItemQuery releasedBetween(EpochDay from, EpochDay to) { return between(ItemField::ReleaseDay, from, to); }
+    static ItemQuery publishedBetween(EpochDay from, EpochDay to) { return between(ItemField::PublicationDay, from, to); }
+    static ItemQuery durationBetween(int minMinutes, int maxMinutes) { return between(ItemField::Duration, minMinutes, maxMinutes); }
+    
+    friend ItemQuery operator&&(const ItemQuery& lhs, const ItemQuery& rhs) { return combine(Op::And, lhs, rhs); }
+    friend ItemQuery operator||(const ItemQuery& lhs, const ItemQuery& rhs) { return combine(Op::Or, lhs, rhs); }
+    
+    friend ItemQuery operator!(const ItemQuery& operand) {
+        ItemQuery query;
+        query.root_ = std::make_shared<Node>(Node{Op::Not, ItemField::Id, "", {operand.root_}});
+        return query;
+    }
+    
+    ItemQuery& sortBy(SortKey key) { sortKey_ = key; return *this; }
+    ItemQuery& limit(size_t count) { limit_ = count; return *this; }
+    
+    const Node& getRoot() const { return *root_; }
+    SortKey getSortKey() const { return sortKey_; }
+    size_t getLimit() const { return limit_; }
+};
+
+/**
+ * ItemQuery predicate tree flattened into one contiguous node array,
+ * evaluated with a switch per node and short-circuiting AND/OR
+ */
+class CompiledItemPredicate {
+private:
+    struct Node {
+        ItemQuery::Op op;
+        ItemField field;
+        std::string value;
+        uint32_t firstChild;
+        uint32_t childCount;
+        int64_t low;
+        int64_t high;
+    };
+    
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> children_;
+    
+    uint32_t compile(const ItemQuery::Node& node) {
+        uint32_t index = static_cast<uint32_t>(nodes_.size());
+        // Substring matches compare normalised text, so fold the needle once here
+        std::string value = node.op == ItemQuery::Op::Contains ? TextNormalizer::normalize(node.value) : node.value;
+        nodes_.push_back({node.op, node.field, std::move(value), 0, 0, node.low, node.high});
+        if (node.op == ItemQuery::Op::Equals && node.field == ItemField::Type) {
+            // Type matches compare kinds; -1 (no registered type) matches nothing
+            const ItemTypeSpec* spec = findItemType(node.value);
+            nodes_[index].low = spec ? static_cast<int64_t>(spec->kind) : -1;
+        }
+        std::vector<uint32_t> compiled;
+        for (const auto& child : node.children) {
+            compiled.push_back(compile(*child));
+        }
+        nodes_[index].firstChild = static_cast<uint32_t>(children_.size());
+        nodes_[index].childCount = static_cast<uint32_t>(compiled.size());
+        children_.insert(children_.end(), compiled.begin(), compiled.end());
+        return index;
+    }
+    
+    bool evaluate(uint32_t index, const LibraryItem& item) const;
+    
+public:
+    explicit CompiledItemPredicate(const ItemQuery& query) {
+        compile(query.getRoot());
+    }
+    
+    bool operator()(const LibraryItem& item) const {
+        return evaluate(0, item);
+    }
+    
+    // Index of a text field among the item type's registry fields, or -1 if
+    // the type has no such field
+    static int registryField(ItemKind kind, ItemField field);
+    
+    // True if the item type has the field and its text equals value
+    static bool fieldEquals(const LibraryItem& item, ItemField field, const std::string& value);
+    
+    // Numeric value of a range field, or kUnknownDay if the item type has
+    // no such field or its date is unknown
+    static int64_t rangeValue(const LibraryItem& item, ItemField field);
+    
+    // Search key holding a field's normalised text, or kFieldCount if the
+    // item type has no such field
+    static SearchKeys::Field searchField(const LibraryItem& item, ItemField field);
+};
+
+inline int64_t CompiledItemPredicate::rangeValue(const LibraryItem& item, ItemField field) {
+    int index = registryField(item.getKind(), field);
+    if (index < 0) return kUnknownDay;
+    return rangeFieldValue(itemTypeSpec(item.getKind()).fields[static_cast<size_t>(index)],
+                           itemFieldValues(item)[static_cast<size_t>(index)]);
+}
+
+inline int CompiledItemPredicate::registryField(ItemKind kind, ItemField field) {
+    const ItemTypeSpec& spec = itemTypeSpec(kind);
+    switch (field) {
+        case ItemField::Title: return 0;
+        case ItemField::Author: return spec.creator == CreatorRole::Author ? 1 : -1;
+        case ItemField::Director: return spec.creator == CreatorRole::Director ? 1 : -1;
+        case ItemField::Publisher: return spec.creator == CreatorRole::Publisher ? 1 : -1;
+        case ItemField::Genre: return spec.genreField;
+        default:
+            for (size_t i = 0; i < spec.fields.size(); ++i) {
+                if (field != ItemField::Id && spec.fields[i].rangeField == field) return static_cast<int>(i);
+            }
+            return -1;
+    }
+}
+
+inline SearchKeys::Field CompiledItemPredicate::searchField(const LibraryItem& item, ItemField field) {
+    int index = registryField(item.getKind(), field);
+    if (index == 0) return SearchKeys::Title;
+    if (index == 1) return SearchKeys::Creator;
+    if (index > 1) return SearchKeys::Genre;
+    return SearchKeys::kFieldCount;
+}
+
+inline bool CompiledItemPredicate::fieldEquals(const LibraryItem& item, ItemField field, const std::string& value) {
+    if (field == ItemField::Id) return item.getId() == value;
+    if (field == ItemField::Title) return item.getTitle() == value;
+    int index = registryField(item.getKind(), field);
+    return index >= 0 && itemFieldValues(item)[static_cast<size_t>(index)] == value;
+}
+
+inline bool CompiledItemPredicate::evaluate(uint32_t index, const LibraryItem& item) const {
+    const Node& node = nodes_[index];
+    switch (node.op) {
+        case ItemQuery::Op::All:
+            return true;
+        case ItemQuery::Op::Available:
+            return item.isAvailable();
+        case ItemQuery::Op::Equals:
+            if (node.field == ItemField::Type) return static_cast<int64_t>(item.getKind()) == node.low;
+            return fieldEquals(item, node.field, node.value);
+        case ItemQuery::Op::Between: {
+            int64_t value = rangeValue(item, node.field);
+            return value != kUnknownDay && value >= node.low && value <= node.high;
+        }
+        case ItemQuery::Op::Contains: {
+            if (node.field == ItemField::Id) return item.getId().find(node.value) != std::string::npos;
+            SearchKeys::Field field = searchField(item, node.field);
+            return field != SearchKeys::kFieldCount && item.getSearchKeys().contains(field, node.value);
+        }
+        case ItemQuery::Op::And:
+            for (uint32_t i = 0; i < node.childCount; ++i) {
+                if (!evaluate(children_[node.firstChild + i], item)) return false;
+            }
+            return true;
+        case ItemQuery::Op::Or:
+            for (uint32_t i = 0; i < node.childCount; ++i) {
+                if (evaluate(children_[node.firstChild + i], item)) return true;
+            }
+            return false;
+        case ItemQuery::Op::Not:
+            return !evaluate(children_[node.firstChild], item);
+    }
+    return false;
+}
+
+/**
+ * Lazily evaluated query results. Candidates come from the access path the
+ * planner chose, already in the requested order, and are filtered as the
+ * caller iterates. Valid as long as the Library that produced them.
+ */
+class QueryResult {
+public:
+    using CatalogIterator = std::map<std::string, std::shared_ptr<LibraryItem>>::const_iterator;
+    using IndexIterator = std::map<std::string, const LibraryItem*>::const_iterator;
+    using ListIterator = std::vector<const LibraryItem*>::const_iterator;
+    
+    template<typename It>
+    struct Range {
+        It first;
+        It last;
+    };
+    
+    using Source = std::variant<Range<CatalogIterator>, Range<IndexIterator>, Range<ListIterator>>;
+    
+private:
+    Source source_;
+    std::shared_ptr<const CompiledItemPredicate> predicate_;
+    std::shared_ptr<const std::vector<const LibraryItem*>> materialized_;
+    size_t limit_;
+    std::string plan_;
+    
+    static const LibraryItem* deref(const CatalogIterator& it) { return it->second.get(); }
+    static const LibraryItem* deref(const IndexIterator& it) { return it->second; }
+    static const LibraryItem* deref(const ListIterator& it) { return *it; }
+    
+public:
+    class iterator {
+    private:
+        const QueryResult* owner_ = nullptr;
+        Source position_;
+        size_t emitted_ = 0;
+        const LibraryItem* current_ = nullptr;
+        
+        void advance() {
+            current_ = nullptr;
+            if (emitted_ >= owner_->limit_) return;
+            std::visit([this](auto& range) {
+                while (range.first != range.last) {
+                    const LibraryItem* item = deref(range.first);
+                    ++range.first;
+                    if (!owner_->predicate_ || (*owner_->predicate_)(*item)) {
+                        current_ = item;
+                        return;
+                    }
+                }
+            }, position_);
+            if (current_) ++emitted_;
+        }
+        
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = const LibraryItem*;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const LibraryItem* const*;
+        using reference = const LibraryItem* const&;
+        
+        iterator() = default;
+        
+        iterator(const QueryResult* owner, Source position)
+            : owner_(owner), position_(std::move(position))
+        {
+            advance();
+        }
+        
+        reference operator*() const { return current_; }
+        const LibraryItem* operator->() const { return current_; }
+        
+        iterator& operator++() {
+            advance();
+            return *this;
+        }
+        
+        bool operator==(const iterator& other) const { return current_ == other.current_; }
+        bool operator!=(const iterator& other) const { return current_ != other.current_; }
+    };
+    
+    QueryResult(Source source, std::shared_ptr<const CompiledItemPredicate> predicate, size_t limit, std::string plan)
+        : source_(std::move(source)), predicate_(std::move(predicate)), limit_(limit), plan_(std::move(plan))
+    {}
+    
+    // Results already filtered, sorted and limited
+    QueryResult(std::vector<const LibraryItem*> items, std::string plan)
+        : materialized_(std::make_shared<const std::vector<const LibraryItem*>>(std::move(items))),
+          limit_(std::numeric_limits<size_t>::max()), plan_(std::move(plan))
+    {
+        source_ = Range<ListIterator>{materialized_->begin(), materialized_->end()};
+    }
+    
+    iterator begin() const { return iterator(this, source_); }
+    iterator end() const { return iterator(); }
+    
+    std::vector<const LibraryItem*> toVector() const {
+        return std::vector<const LibraryItem*>(begin(), end());
+    }
+    
+    // Human-readable description of the chosen access path
+    const std::string& getPlan() const { return plan_; }
+};
+
+/**
+ * One page of search results plus the token for the next page; the token
+ * is empty on the last page
+ */
+struct SearchPage {
+    std::vector<const LibraryItem*> items;
+    std::string nextToken;
+    
+    bool hasMore() const { return !nextToken.empty(); }
+    
+    // Tokens are hex so they survive being printed, typed or put in a URL
+    static std::string encodeToken(const std::string& key) {
+        static const char kHex[] = "0123456789abcdef";
+        std::string token;
+        token.reserve(key.size() * 2);
+        for (unsigned char c : key) {
+            token += kHex[c >> 4];
+            token += kHex[c & 0xF];
+        }
+        return token;
+    }
+    
+    static bool decodeToken(const std::string& token, std::string& key) {
+        if (token.size() % 2 != 0) return false;
+        auto nibble = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        };
+        key.clear();
+        for (size_t i = 0; i < token.size(); i += 2) {
+            int high = nibble(token[i]);
+            int low = nibble(token[i + 1]);
+            if (high < 0 || low < 0) return false;
+            key += static_cast<char>(high << 4 | low);
+        }
+        return true;
+    }
+};
+
+/**
+ * Typo-tolerant word index over item titles, authors and directors, using
+ * SymSpell-style deletion signatures. Every distinct word stores the hashes
+ * of all strings reachable by deleting up to kMaxDistance characters from
+ * its first kPrefixLength characters. A query word generates its own
+ * deletions, and any word sharing a signature is a candidate, confirmed
+ * with a bounded edit distance. Lookup cost depends on the query length
+ * rather than the catalog size.
+ */
+class FuzzyIndex {
+public:
+    enum Field : unsigned {
+        Title = 1u << 0,
+        Author = 1u << 1,
+        Director = 1u << 2,
+        AllFields = Title | Author | Director
+    };
+    
+    static constexpr int kMaxDistance = 2;
+    static constexpr size_t kPrefixLength = 7;
+    
+private:
+    struct Posting {
+        const LibraryItem* item;
+        unsigned fields;
+    };
+    
+    std::vector<std::string> words_;
+    std::unordered_map<std::string, uint32_t> wordIds_;
+    std::vector<std::vector<Posting>> postings_;  // per word
+    std::unordered_map<uint64_t, std::vector<uint32_t>> signatures_;  // deletion hash -> words
+    
+    static uint64_t hashSignature(const std::string& text) {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : text) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+    
+    // Every string reachable by deleting up to distance characters from the
+    // word's prefix, generated breadth-first so each is expanded once
+    static std::set<std::string> deletions(const std::string& word, int distance) {
+        std::set<std::string> out{word.substr(0, kPrefixLength)};
+        std::vector<std::string> frontier(out.begin(), out.end());
+        for (int d = 0; d < distance; ++d) {
+            std::vector<std::string> next;
+            for (const std::string& current : frontier) {
+                if (current.size() <= 1) continue;
+                for (size_t i = 0; i < current.size(); ++i) {
+                    std::string shorter = current.substr(0, i) + current.substr(i + 1);
+                    if (out.insert(shorter).second) next.push_back(std::move(shorter));
+                }
+            }
+            frontier = std::move(next);
+        }
+        return out;
+    }
+    
+    uint32_t internWord(const std::string& word) {
+        auto it = wordIds_.find(word);
+        if (it != wordIds_.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(words_.size());
+        words_.push_back(word);
+        wordIds_.emplace(word, id);
+        postings_.emplace_back();
+        for (const std::string& deletion : deletions(word, kMaxDistance)) {
+            signatures_[hashSignature(deletion)].push_back(id);
+        }
+        return id;
+    }
+    
+    void addField(const LibraryItem& item, const std::string& text, Field field) {
+        for (const std::string& word : tokenize(text)) {
+            std::vector<Posting>& postings = postings_[internWord(word)];
+            if (!postings.empty() && postings.back().item == &item) {
+                postings.back().fields |= field;
+            } else {
+                postings.push_back({&item, static_cast<unsigned>(field)});
+            }
+        }
+    }
+    
+public:
+    // Words of the normalised text (see TextNormalizer)
+    static std::vector<std::string> tokenize(const std::string& text) {
+        std::vector<std::string> words;
+        std::istringstream stream(TextNormalizer::normalize(text));
+        std::string word;
+        while (stream >> word) words.push_back(std::move(word));
+        return words;
+    }
+    
+    /**
+     * Optimal string alignment distance (adjacent transpositions count as
+     * one edit), or maxDistance + 1 once it is known to exceed maxDistance
+     */
+    static int editDistance(const std::string& a, const std::string& b, int maxDistance) {
+        int n = static_cast<int>(a.size());
+        int m = static_cast<int>(b.size());
+        if (std::abs(n - m) > maxDistance) return maxDistance + 1;
+        std::vector<int> before(m + 1), previous(m + 1), current(m + 1);
+        for (int j = 0; j <= m; ++j) previous[j] = j;
+        for (int i = 1; i <= n; ++i) {
+            current[0] = i;
+            int rowMin = current[0];
+            for (int j = 1; j <= m; ++j) {
+                int cost = a[i - 1] == b[j - 1] ? 0 : 1;
+                current[j] = std::min({previous[j] + 1, current[j - 1] + 1, previous[j - 1] + cost});
+                if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+                    current[j] = std::min(current[j], before[j - 2] + 1);
+                }
+                rowMin = std::min(rowMin, current[j]);
+            }
+            if (rowMin > maxDistance) return maxDistance + 1;
+            std::swap(before, previous);
+            std::swap(previous, current);
+        }
+        return std::min(previous[m], maxDistance + 1);
+    }
+    
+    // Edits tolerated for a query word: none for very short words, since
+    // they would match almost anything
+    static int allowedDistance(const std::string& word, int maxDistance) {
+        if (word.size() <= 2) return 0;
+        if (word.size() <= 5) return std::min(maxDistance, 1);
+        return std::min(maxDistance, kMaxDistance);
+    }
+    
+    void add(const LibraryItem& item) {
+        addField(item, item.getTitle(), Title);
+        CreatorRole role = itemTypeSpec(item.getKind()).creator;
+        if (role == CreatorRole::Author || role == CreatorRole::Director) {
+            addField(item, itemFieldValues(item)[1], role == CreatorRole::Author ? Author : Director);
+        }
+    }
+    
+    /**
+     * Items in which every query word matches some word of the selected
+     * fields within its allowed distance, best total distance first and
+     * then by title
+     */
+    std::vector<const LibraryItem*> search(const std::string& text, int maxDistance, size_t limit,
+                                           unsigned fields = AllFields) const {
+        std::vector<std::string> queryWords = tokenize(text);
+        std::unordered_map<const LibraryItem*, int> totals;
+        
+        for (size_t q = 0; q < queryWords.size(); ++q) {
+            const std::string& queryWord = queryWords[q];
+            int allowed = allowedDistance(queryWord, maxDistance);
+            
+            // Candidate words share a deletion signature with the query word
+            std::unordered_map<uint32_t, int> wordDistances;
+            for (const std::string& deletion : deletions(queryWord, allowed)) {
+                auto it = signatures_.find(hashSignature(deletion));
+                if (it == signatures_.end()) continue;
+                for (uint32_t wordId : it->second) {
+                    if (wordDistances.count(wordId)) continue;
+                    wordDistances[wordId] = editDistance(queryWord, words_[wordId], allowed);
+                }
+            }
+            
+            std::unordered_map<const LibraryItem*, int> best;
+            for (const auto& entry : wordDistances) {
+                if (entry.second > allowed) continue;
+                for (const Posting& posting : postings_[entry.first]) {
+                    if (!(posting.fields & fields)) continue;
+                    if (q > 0 && !totals.count(posting.item)) continue;
+                    auto found = best.find(posting.item);
+                    if (found == best.end() || entry.second < found->second) best[posting.item] = entry.second;
+                }
+            }
+            
+            std::unordered_map<const LibraryItem*, int> next;
+            for (const auto& entry : best) {
+                next[entry.first] = (q > 0 ? totals[entry.first] : 0) + entry.second;
+            }
+            totals = std::move(next);
+            if (totals.empty()) break;
+        }
+        
+        std::vector<std::pair<int, const LibraryItem*>> ranked;
+        ranked.reserve(totals.size());
+        for (const auto& entry : totals) ranked.emplace_back(entry.second, entry.first);
+        auto better = [](const std::pair<int, const LibraryItem*>& a, const std::pair<int, const LibraryItem*>& b) {
+            if (a.first != b.first) return a.first < b.first;
+            if (a.second->getTitle() != b.second->getTitle()) return a.second->getTitle() < b.second->getTitle();
+            return a.second->getId() < b.second->getId();
+        };
+        size_t keep = std::min(limit, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(), better);
+        
+        std::vector<const LibraryItem*> results;
+        results.reserve(keep);
+        for (size_t i = 0; i < keep; ++i) results.push_back(ranked[i].second);
+        return results;
+    }
+    
+    size_t getWordCount() const { return words_.size(); }
+};
+
+/**
+ * Desk lookups for patrons: a hash index on card numbers (student and
+ * employee IDs, per the registry's cardField) and a sorted index on
+ * normalized names. Every word of a name starts an index key, so
+ * "john" and "smi" both find "John Smith". Patrons must be removed
+ * before the record they point to is replaced.
+ */
+class PatronDirectory {
+private:
+    // Words of a name beyond this are not indexed as starting points
+    static constexpr size_t kMaxNameWords = 4;
+    
+    std::unordered_map<std::string, const LibraryPatron*> cards_;
+    std::multimap<std::string, const LibraryPatron*> names_;
+    
+    static std::vector<std::string> nameKeys(const LibraryPatron& patron) {
+        std::string name = TextNormalizer::normalize(patron.getName());
+        std::vector<std::string> keys;
+        size_t start = 0;
+        while (start < name.size() && keys.size() < kMaxNameWords) {
+            keys.push_back(name.substr(start));
+            size_t space = name.find(' ', start);
+            if (space == std::string::npos) break;
+            start = space + 1;
+        }
+        return keys;
+    }
+    
+public:
+    // Card swipes may carry stray whitespace or a different letter case
+    static std::string cardKey(std::string_view cardId) {
+        size_t first = 0;
+        size_t last = cardId.size();
+        while (first < last && std::isspace(static_cast<unsigned char>(cardId[first]))) ++first;
+        while (last > first && std::isspace(static_cast<unsigned char>(cardId[last - 1]))) --last;
+        std::string key(cardId.substr(first, last - first));
+        for (char& c : key) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        return key;
+    }
+    
+    // Normalized card number, empty if the patron's type has none
+    static std::string cardOf(const LibraryPatron& patron) {
+        int field = patronTypeSpec(patron.getKind()).cardField;
+        return field < 0 ? std::string() : cardKey(patronFieldValues(patron)[static_cast<size_t>(field)]);
+    }
+    
+    void add(const LibraryPatron& patron) {
+        std::string card = cardOf(patron);
+        if (!card.empty()) cards_[card] = &patron;
+        for (auto& key : nameKeys(patron)) names_.emplace(std::move(key), &patron);
+    }
+    
+    void remove(const LibraryPatron& patron) {
+        auto card = cards_.find(cardOf(patron));
+        if (card != cards_.end() && card->second == &patron) cards_.erase(card);
+        for (const auto& key : nameKeys(patron)) {
+            auto range = names_.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == &patron) {
+                    names_.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+    
+    const LibraryPatron* findByCard(std::string_view cardId) const {
+        auto it = cards_.find(cardKey(cardId));
+        return it != cards_.end() ? it->second : nullptr;
+    }
+    
+    // Patrons with a name word starting with prefix, ordered by the matching word
+    std::vector<const LibraryPatron*> findByNamePrefix(const std::string& prefix, size_t limit) const {
+        std::vector<const LibraryPatron*> results;
+        std::string needle = TextNormalizer::normalize(prefix);
+        if (needle.empty()) return results;
+        for (auto it = names_.lower_bound(needle);
+             it != names_.end() && results.size() < limit && it->first.compare(0, needle.size(), needle) == 0; ++it) {
+            // A patron matches once per name word sharing the prefix
+            if (std::find(results.begin(), results.end(), it->second) == results.end()) {
+                results.push_back(it->second);
+            }
+        }
+        return results;
+    }
+    
+    size_t getCardCount() const { return cards_.size(); }
+};
+
+/**
+ * Log-linear (HDR-style) latency histogram over nanoseconds.
+ * Values below 2 * kSubBuckets are recorded exactly; above that each power of
+ * two is split into kSubBuckets linear buckets, giving ~3% relative precision.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 5;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMagnitudes = 36;
+    static constexpr int kBucketCount = kMagnitudes * kSubBuckets;
+    
+    static int bucketFor(uint64_t ns) {
+        if (ns < 2 * kSubBuckets) return static_cast<int>(ns);
+        int shift = highestBit(ns) - kSubBucketBits;
+        int index = (shift + 1) * kSubBuckets + static_cast<int>((ns >> shift) - kSubBuckets);
+        return std::min(index, kBucketCount - 1);
+    }
+    
+    static uint64_t bucketLowerBound(int index) {
+        if (index < 2 * kSubBuckets) return static_cast<uint64_t>(index);
+        int shift = index / kSubBuckets - 1;
+        uint64_t top = static_cast<uint64_t>(index % kSubBuckets + kSubBuckets);
+        return top << shift;
+    }
+    
+    static uint64_t bucketUpperBound(int index) {
+        if (index < 2 * kSubBuckets) return static_cast<uint64_t>(index);
+        int shift = index / kSubBuckets - 1;
+        return bucketLowerBound(index) + ((uint64_t(1) << shift) - 1);
+    }
+    
+private:
+    static int highestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        int bit = 0;
+        while (value >>= 1) ++bit;
+        return bit;
+#endif
+    }
+};
+
+/**
+ * Operations instrumented inside Library
+ */
+enum class LibraryOperation {
+    Checkout,
+    Return,
+    Renew,
+    SearchByTitle,
+    SearchByAuthor,
+    SearchByGenre,
+    SearchByType,
+    SearchByIsbn,
+    SearchByPredicate,
+    Query,
+    FuzzySearch,
+    Recommend,
+    FindPatronByCard,
+    FindPatronsByName,
+    CirculationReport,
+    PrintOverdueItems,
+    WriteOverdueNotices,
+    Count
+};
+
+inline const char* operationName(LibraryOperation op) {
+    switch (op) {
+        case LibraryOperation::Checkout: return "checkoutItem";
+        case LibraryOperation::Return: return "returnItem";
+        case LibraryOperation::Renew: return "renewItem";
+        case LibraryOperation::SearchByTitle: return "searchItemsByTitle";
+        case LibraryOperation::SearchByAuthor: return "searchItemsByAuthor";
+        case LibraryOperation::SearchByGenre: return "searchItemsByGenre";
+        case LibraryOperation::SearchByType: return "searchItemsByType";
+        case LibraryOperation::SearchByIsbn: return "findItemsByIsbn";
+        case LibraryOperation::SearchByPredicate: return "searchItems";
+        case LibraryOperation::Query: return "query";
+        case LibraryOperation::FuzzySearch: return "fuzzySearch";
+        case LibraryOperation::Recommend: return "recommendItems";
+        case LibraryOperation::FindPatronByCard: return "findPatronByCard";
+        case LibraryOperation::FindPatronsByName: return "findPatronsByName";
+        case LibraryOperation::CirculationReport: return "circulationReport";
+        case LibraryOperation::PrintOverdueItems: return "printOverdueItems";
+        case LibraryOperation::WriteOverdueNotices: return "writeOverdueNotices";
+        default: return "unknown";
+    }
+}
+
+/**
+ * Merged, point-in-time view of one operation's counters and histogram
+ */
+struct OperationStats {
+    LibraryOperation operation = LibraryOperation::Count;
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(LatencyHistogram::kBucketCount, 0);
+    
+    double meanNs() const {
+        return count == 0 ? 0.0 : static_cast<double>(totalNs) / static_cast<double>(count);
+    }
+    
+    // Returns the upper bound of the bucket holding the given quantile (0.0 - 1.0)
+    uint64_t percentileNs(double quantile) const {
+        if (count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(count)));
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencyHistogram::kBucketCount; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return std::min(LatencyHistogram::bucketUpperBound(i), maxNs);
+            }
+        }
+        return maxNs;
+    }
+};
+
+/**
+ * Low-overhead per-operation counters and latency histograms.
+ * Each thread records into its own shard (single writer, relaxed atomics, no
+ * locking); shards are only merged when a report is requested.
+ */
+class LibraryMetrics {
+private:
+    static constexpr int kOperations = static_cast<int>(LibraryOperation::Count);
+    
+    struct OperationShard {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+        std::array<std::atomic<uint64_t>, LatencyHistogram::kBucketCount> buckets{};
+    };
+    
+    struct Shard {
+        std::array<OperationShard, kOperations> operations;
+    };
+    
+    struct ThreadCacheEntry {
+        uint64_t ownerId;
+        Shard* shard;
+    };
+    
+    uint64_t instanceId_;
+    mutable std::mutex shardsMutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    
+    static uint64_t nextInstanceId() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+    
+    static void bump(std::atomic<uint64_t>& counter, uint64_t delta) {
+        // Only the owning thread writes a shard, so a plain load/store is enough
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    
+    Shard& localShard() {
+        // Instance ids are never reused, so stale entries from destroyed
+        // instances are simply never matched again
+        thread_local std::vector<ThreadCacheEntry> cache;
+        for (const auto& entry : cache) {
+            if (entry.ownerId == instanceId_) return *entry.shard;
+        }
+        
+        auto shard = std::make_unique<Shard>();
+        Shard* raw = shard.get();
+        {
+            std::lock_guard<std::mutex> lock(shardsMutex_);
+            shards_.push_back(std::move(shard));
+        }
+        if (cache.size() >= 16) cache.erase(cache.begin());
+        cache.push_back({instanceId_, raw});
+        return *raw;
+    }
+    
+public:
+    LibraryMetrics() : instanceId_(nextInstanceId()) {}
+    
+    LibraryMetrics(const LibraryMetrics&) = delete;
+    LibraryMetrics& operator=(const LibraryMetrics&) = delete;
+    
+    void record(LibraryOperation op, uint64_t ns, bool failed) {
+        OperationShard& s = localShard().operations[static_cast<int>(op)];
+        bump(s.count, 1);
+        if (failed) bump(s.errors, 1);
+        bump(s.totalNs, ns);
+        if (ns > s.maxNs.load(std::memory_order_relaxed)) {
+            s.maxNs.store(ns, std::memory_order_relaxed);
+        }
+        bump(s.buckets[LatencyHistogram::bucketFor(ns)], 1);
+    }
+    
+    OperationStats snapshot(LibraryOperation op) const {
+        OperationStats stats;
+        stats.operation = op;
+        std::lock_guard<std::mutex> lock(shardsMutex_);
+        for (const auto& shard : shards_) {
+            const OperationShard& s = shard->operations[static_cast<int>(op)];
+            stats.count += s.count.load(std::memory_order_relaxed);
+            stats.errors += s.errors.load(std::memory_order_relaxed);
+            stats.totalNs += s.totalNs.load(std::memory_order_relaxed);
+            stats.maxNs = std::max(stats.maxNs, s.maxNs.load(std::memory_order_relaxed));
+            for (int i = 0; i < LatencyHistogram::kBucketCount; ++i) {
+                stats.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+            }
+        }
+        return stats;
+    }
+    
+    std::vector<OperationStats> snapshotAll() const {
+        std::vector<OperationStats> all;
+        for (int i = 0; i < kOperations; ++i) {
+            all.push_back(snapshot(static_cast<LibraryOperation>(i)));
+        }
+        return all;
+    }
+    
+    void printReport(std::ostream& out) const {
+        out << "\n=== PERFORMANCE METRICS (microseconds) ===\n";
+        out << std::left << std::setw(22) << "Operation" << std::right
+            << std::setw(10) << "Count" << std::setw(8) << "Errors"
+            << std::setw(11) << "Mean" << std::setw(11) << "p50"
+            << std::setw(11) << "p99" << std::setw(11) << "p999"
+            << std::setw(11) << "Max" << "\n";
+        out << std::fixed << std::setprecision(2);
+        for (const auto& stats : snapshotAll()) {
+            out << std::left << std::setw(22) << operationName(stats.operation) << std::right
+                << std::setw(10) << stats.count << std::setw(8) << stats.errors
+                << std::setw(11) << stats.meanNs() / 1000.0
+                << std::setw(11) << stats.percentileNs(0.50) / 1000.0
+                << std::setw(11) << stats.percentileNs(0.99) / 1000.0
+                << std::setw(11) << stats.percentileNs(0.999) / 1000.0
+                << std::setw(11) << stats.maxNs / 1000.0 << "\n";
+        }
+    }
+    
+    // Machine-readable export; latencies are in nanoseconds
+    std::string toJson() const {
+        std::stringstream ss;
+        ss << "{\"operations\":[";
+        bool first = true;
+        for (const auto& stats : snapshotAll()) {
+            if (!first) ss << ",";
+            first = false;
+            ss << "{\"name\":\"" << operationName(stats.operation) << "\""
+               << ",\"count\":" << stats.count
+               << ",\"errors\":" << stats.errors
+               << ",\"total_ns\":" << stats.totalNs
+               << ",\"mean_ns\":" << static_cast<uint64_t>(stats.meanNs())
+               << ",\"p50_ns\":" << stats.percentileNs(0.50)
+               << ",\"p99_ns\":" << stats.percentileNs(0.99)
+               << ",\"p999_ns\":" << stats.percentileNs(0.999)
+               << ",\"max_ns\":" << stats.maxNs << "}";
+        }
+        ss << "]}";
+        return ss.str();
+    }
+};
+
+/**
+ * RAII timer that records one operation into LibraryMetrics, counting it as
+ * an error if the scope is left by an exception
+ */
+class ScopedLatency {
+private:
+    LibraryMetrics& metrics_;
+    LibraryOperation op_;
+    int uncaught_;
+    std::chrono::steady_clock::time_point start_;
+    
+public:
+    ScopedLatency(LibraryMetrics& metrics, LibraryOperation op)
+        : metrics_(metrics), op_(op), uncaught_(std::uncaught_exceptions()),
+          start_(std::chrono::steady_clock::now())
+    {}
+    
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+    
+    ~ScopedLatency() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        metrics_.record(op_, static_cast<uint64_t>(ns), std::uncaught_exceptions() > uncaught_);
+    }
+};
+
+/**
+ * Dashboard aggregates as of one moment
+ */
+struct LibraryStats {
+    size_t totalItems = 0;
+    size_t totalCopies = 0;
+    size_t availableItems = 0;
+    size_t availableCopies = 0;
+    size_t totalPatrons = 0;
+    size_t activePatrons = 0;
+    size_t activeLoans = 0;
+    size_t overdueLoans = 0;
+    size_t pendingHolds = 0;
+    double outstandingFines = 0.0;
+    std::map<std::string, size_t> itemsByType;
+    std::map<std::string, size_t> activeLoansByPatronType;
+};
+
+/**
+ * Incrementally maintained counters behind Library::getStats(). Items and
+ * patrons report availability/active changes through LibraryObserver;
+ * Library reports loans opening, closing and moving due day.
+ */
+class StatsCollector : public LibraryObserver {
+private:
+    size_t totalItems_ = 0;
+    size_t totalCopies_ = 0;
+    size_t availableItems_ = 0;
+    size_t availableCopies_ = 0;
+    size_t totalPatrons_ = 0;
+    size_t activePatrons_ = 0;
+    size_t activeLoans_ = 0;
+    std::array<size_t, kItemKindCount> itemsByType_{};
+    std::array<size_t, kPatronKindCount> loansByPatronType_{};
+    
+    // Active loans per due day; overdueCount_ counts loans due before
+    // overdueCursor_ and the cursor is moved to the queried day on demand
+    std::map<EpochDay, size_t> dueHistogram_;
+    EpochDay overdueCursor_ = std::numeric_limits<EpochDay>::min();
+    size_t overdueCount_ = 0;
+    
+public:
+    void onItemAdded(const LibraryItem& item) {
+        ++totalItems_;
+        ++itemsByType_[static_cast<size_t>(item.getKind())];
+        totalCopies_ += item.getCopyCount();
+        availableCopies_ += item.getAvailableCopies();
+        if (item.isAvailable()) ++availableItems_;
+    }
+    
+    void onCopyAdded() {
+        ++totalCopies_;
+    }
+    
+    void onPatronAdded(const LibraryPatron& patron) {
+        ++totalPatrons_;
+        if (patron.isActive()) ++activePatrons_;
+    }
+    
+    void onPatronRemoved(const LibraryPatron& patron) {
+        --totalPatrons_;
+        if (patron.isActive()) --activePatrons_;
+    }
+    
+    void onAvailabilityChanged(const LibraryItem& item, size_t availableBefore) override {
+        availableCopies_ += item.getAvailableCopies();
+        availableCopies_ -= availableBefore;
+        if (availableBefore == 0 && item.isAvailable()) ++availableItems_;
+        if (availableBefore > 0 && !item.isAvailable()) --availableItems_;
+    }
+    
+    void onActiveChanged(const LibraryPatron& patron, bool wasActive) override {
+        if (!wasActive && patron.isActive()) ++activePatrons_;
+        if (wasActive && !patron.isActive()) --activePatrons_;
+    }
+    
+    void onLoanOpened(const Checkout& checkout) {
+        ++activeLoans_;
+        ++loansByPatronType_[static_cast<size_t>(checkout.getPatron()->getKind())];
+        ++dueHistogram_[checkout.getDueDay()];
+        if (checkout.getDueDay() < overdueCursor_) ++overdueCount_;
+    }
+    
+    void onLoanClosed(const Checkout& checkout) {
+        --activeLoans_;
+        --loansByPatronType_[static_cast<size_t>(checkout.getPatron()->getKind())];
+        removeDue(checkout.getDueDay());
+    }
+    
+    void onLoanDueChanged(EpochDay oldDueDay, EpochDay newDueDay) {
+        removeDue(oldDueDay);
+        ++dueHistogram_[newDueDay];
+        if (newDueDay < overdueCursor_) ++overdueCount_;
+    }
+    
+    // Loans due before the given day; amortised O(1) when polled with a
+    // steadily advancing day
+    size_t overdueAsOf(EpochDay today) {
+        if (overdueCursor_ == std::numeric_limits<EpochDay>::min()) {
+            overdueCount_ = 0;
+            for (auto it = dueHistogram_.begin(); it != dueHistogram_.end() && it->first < today; ++it) {
+                overdueCount_ += it->second;
+            }
+        } else if (today > overdueCursor_) {
+            for (auto it = dueHistogram_.lower_bound(overdueCursor_); it != dueHistogram_.end() && it->first < today; ++it) {
+                overdueCount_ += it->second;
+            }
+        } else if (today < overdueCursor_) {
+            for (auto it = dueHistogram_.lower_bound(today); it != dueHistogram_.end() && it->first < overdueCursor_; ++it) {
+                overdueCount_ -= it->second;
+            }
+        }
+        overdueCursor_ = today;
+        return overdueCount_;
+    }
+    
+    LibraryStats snapshot(EpochDay today, double outstandingFines, size_t pendingHolds) {
+        LibraryStats stats;
+        stats.totalItems = totalItems_;
+        stats.totalCopies = totalCopies_;
+        stats.availableItems = availableItems_;
+        stats.availableCopies = availableCopies_;
+        stats.totalPatrons = totalPatrons_;
+        stats.activePatrons = activePatrons_;
+        stats.activeLoans = activeLoans_;
+        stats.overdueLoans = overdueAsOf(today);
+        stats.pendingHolds = pendingHolds;
+        stats.outstandingFines = outstandingFines;
+        for (const auto& spec : kItemTypes) {
+            size_t count = itemsByType_[static_cast<size_t>(spec.kind)];
+            if (count > 0) stats.itemsByType[spec.name] = count;
+        }
+        for (const auto& spec : kPatronTypes) {
+            size_t count = loansByPatronType_[static_cast<size_t>(spec.kind)];
+            if (count > 0) stats.activeLoansByPatronType[spec.name] = count;
+        }
+        return stats;
+    }
+    
+private:
+    void removeDue(EpochDay dueDay) {
+        auto it = dueHistogram_.find(dueDay);
+        if (--it->second == 0) dueHistogram_.erase(it);
+        if (dueDay < overdueCursor_) --overdueCount_;
+    }
+};
+
+/**
+ * Rows addressed by slot, stored in fixed-size chunks. Copying a table
+ * shares every chunk; the copy's set() and erase() duplicate a chunk the
+ * first time they touch it, so the original never sees the change.
+ * Ownership is tracked explicitly rather than through use_count(), which
+ * gives no ordering against readers on other threads.
+ */
+template<typename Row>
+class ChunkedRows {
+private:
+    static constexpr size_t kChunkSize = 64;
+    using Chunk = std::array<std::optional<Row>, kChunkSize>;
+    
+    std::vector<std::shared_ptr<Chunk>> chunks_;
+    std::vector<bool> owned_;  // chunk is private to this table
+    size_t count_ = 0;
+    
+    Chunk& writableChunk(size_t slot) {
+        size_t index = slot / kChunkSize;
+        if (index >= chunks_.size()) {
+            chunks_.resize(index + 1);
+            owned_.resize(index + 1, false);
+        }
+        auto& chunk = chunks_[index];
+        if (!chunk) {
+            chunk = std::make_shared<Chunk>();
+        } else if (!owned_[index]) {
+            chunk = std::make_shared<Chunk>(*chunk);
+        }
+        owned_[index] = true;
+        return *chunk;
+    }
+    
+public:
+    ChunkedRows() = default;
+    
+    ChunkedRows(const ChunkedRows& other)
+        : chunks_(other.chunks_), owned_(other.chunks_.size(), false), count_(other.count_)
+    {}
+    
+    ChunkedRows& operator=(const ChunkedRows& other) {
+        chunks_ = other.chunks_;
+        owned_.assign(chunks_.size(), false);
+        count_ = other.count_;
+        return *this;
+    }
+    
+    const Row* get(size_t slot) const {
+        size_t index = slot / kChunkSize;
+        if (index >= chunks_.size() || !chunks_[index]) return nullptr;
+        const auto& row = (*chunks_[index])[slot % kChunkSize];
+        return row ? &*row : nullptr;
+    }
+    
+    void set(size_t slot, Row row) {
+        auto& entry = writableChunk(slot)[slot % kChunkSize];
+        if (!entry) ++count_;
+        entry = std::move(row);
+    }
+    
+    void erase(size_t slot) {
+        if (!get(slot)) return;
+        writableChunk(slot)[slot % kChunkSize].reset();
+        --count_;
+    }
+    
+    size_t size() const { return count_; }
+    
+    template<typename Func>
+    void forEach(Func func) const {
+        for (const auto& chunk : chunks_) {
+            if (!chunk) continue;
+            for (const auto& row : *chunk) {
+                if (row) func(*row);
+            }
+        }
+    }
+};
+
+/**
+ * An item as it stood when a snapshot was taken
+ */
+struct ItemRow {
+    std::string id;
+    std::string title;
+    std::string type;
+    std::string details;
+    size_t copies = 0;
+    size_t availableCopies = 0;
+};
+
+/**
+ * An active loan as it stood when a snapshot was taken, with the fine
+ * terms resolved so fines can be computed without the live objects
+ */
+struct LoanRow {
+    std::string barcode;
+    std::string itemId;
+    std::string title;
+    std::string patronId;
+    std::string patronName;
+    std::string patronContact;
+    EpochDay dueDay = 0;
+    CompiledFinePolicy::FineTerms terms{};
+    
+    double fineAsOf(EpochDay asOf) const {
+        return CompiledFinePolicy::fineFor(terms, dueDay, asOf);
+    }
+};
+
+/**
+ * Immutable point-in-time view of the catalog and active loans. Taking one
+ * is O(1); it stays consistent and can be read from any thread while the
+ * library keeps circulating, since later changes copy the chunks they touch.
+ */
+class LibrarySnapshot {
+public:
+    struct State {
+        ChunkedRows<ItemRow> items;
+        ChunkedRows<LoanRow> loans;
+        uint64_t version = 0;
+    };
+    
+private:
+    std::shared_ptr<const State> state_;
+    EpochDay asOf_;
+    
+public:
+    LibrarySnapshot(std::shared_ptr<const State> state, EpochDay asOf)
+        : state_(std::move(state)), asOf_(asOf)
+    {}
+    
+    // Number of changes published before this snapshot
+    uint64_t getVersion() const { return state_->version; }
+    EpochDay getAsOf() const { return asOf_; }
+    size_t getItemCount() const { return state_->items.size(); }
+    size_t getLoanCount() const { return state_->loans.size(); }
+    
+    template<typename Func>
+    void forEachItem(Func func) const { state_->items.forEach(func); }
+    
+    template<typename Func>
+    void forEachLoan(Func func) const { state_->loans.forEach(func); }
+    
+    std::vector<const ItemRow*> itemsById() const {
+        std::vector<const ItemRow*> rows;
+        rows.reserve(getItemCount());
+        forEachItem([&rows](const ItemRow& row) { rows.push_back(&row); });
+        std::sort(rows.begin(), rows.end(), [](const ItemRow* a, const ItemRow* b) { return a->id < b->id; });
+        return rows;
+    }
+    
+    // Loans due before the snapshot's day, earliest first
+    std::vector<const LoanRow*> overdueLoans() const {
+        std::vector<const LoanRow*> rows;
+        forEachLoan([&](const LoanRow& row) {
+            if (row.dueDay < asOf_) rows.push_back(&row);
+        });
+        std::sort(rows.begin(), rows.end(), [](const LoanRow* a, const LoanRow* b) {
+            if (a->dueDay != b->dueDay) return a->dueDay < b->dueDay;
+            return a->barcode < b->barcode;
+        });
+        return rows;
+    }
+    
+    void printInventory(std::ostream& out) const {
+        out << "\n=== LIBRARY INVENTORY ===\n";
+        for (const ItemRow* row : itemsById()) {
+            out << "ID: " << row->id << "\n"
+                << "Title: " << row->title << "\n"
+                << "Type: " << row->type << "\n"
+                << "Status: " << (row->availableCopies > 0 ? "Available" : "Checked Out");
+            if (row->copies > 1) {
+                out << " (" << row->availableCopies << " of " << row->copies << " copies available)";
+            }
+            out << "\n"
+                << "Details: " << row->details << "\n\n";
+        }
+    }
+    
+    void printOverdueItems(std::ostream& out) const {
+        out << "\n=== OVERDUE ITEMS ===\n";
+        std::vector<const LoanRow*> overdue = overdueLoans();
+        for (const LoanRow* row : overdue) {
+            out << "Item: " << row->title << "\n"
+                << "Patron: " << row->patronName << "\n"
+                << "Due Date: " << DateFormatter::formatDay(row->dueDay) << "\n"
+                << "Fine: $" << std::fixed << std::setprecision(2)
+                << row->fineAsOf(asOf_) << "\n\n";
+        }
+        if (overdue.empty()) {
+            out << "No overdue items.\n";
+        }
+    }
+};
+
+/**
+ * Keeps the latest LibrarySnapshot state up to date as items and loans
+ * change. It observes items (forwarding to the next observer) and is told
+ * about loans by Library. The first change after a snapshot is taken
+ * copies the state (chunk pointers only), so circulation never waits on a
+ * running report.
+ */
+class SnapshotPublisher : public LibraryObserver {
+private:
+    mutable std::recursive_mutex mutex_;
+    std::shared_ptr<LibrarySnapshot::State> state_ = std::make_shared<LibrarySnapshot::State>();
+    mutable bool published_ = false;  // state_ has been handed to a snapshot
+    LibraryObserver* next_;
+    std::unordered_map<const LibraryItem*, size_t> itemSlots_;
+    std::unordered_map<std::string, size_t> loanSlots_;  // keyed by copy barcode
+    
+    // Current state, copied first if a snapshot may be reading it; call
+    // with mutex_ held
+    LibrarySnapshot::State& writable() {
+        if (published_) {
+            state_ = std::make_shared<LibrarySnapshot::State>(*state_);
+            published_ = false;
+        }
+        ++state_->version;
+        return *state_;
+    }
+    
+    size_t loanSlot(const std::string& barcode) {
+        auto it = loanSlots_.find(barcode);
+        if (it != loanSlots_.end()) return it->second;
+        size_t slot = loanSlots_.size();
+        loanSlots_.emplace(barcode, slot);
+        return slot;
+    }
+    
+public:
+    explicit SnapshotPublisher(LibraryObserver* next) : next_(next) {}
+    
+    void onAvailabilityChanged(const LibraryItem& item, size_t availableBefore) override {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            auto slot = itemSlots_.find(&item);
+            if (slot != itemSlots_.end()) {
+                ItemRow row = *state_->items.get(slot->second);
+                row.copies = item.getCopyCount();
+                row.availableCopies = item.getAvailableCopies();
+                writable().items.set(slot->second, std::move(row));
+            }
+        }
+        if (next_) next_->onAvailabilityChanged(item, availableBefore);
+    }
+    
+    void onActiveChanged(const LibraryPatron& patron, bool wasActive) override {
+        if (next_) next_->onActiveChanged(patron, wasActive);
+    }
+    
+    void publishItem(const LibraryItem& item) {
+        ItemRow row{item.getId(), item.getTitle(), item.getItemType(), item.getDetails(),
+                    item.getCopyCount(), item.getAvailableCopies()};
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        size_t slot = itemSlots_.emplace(&item, itemSlots_.size()).first->second;
+        writable().items.set(slot, std::move(row));
+    }
+    
+    void publishLoan(const Checkout& checkout, const CompiledFinePolicy& policy) {
+        LoanRow row{checkout.getCopyBarcode(), checkout.getItem()->getId(), checkout.getItem()->getTitle(),
+                    checkout.getPatron()->getId(), checkout.getPatron()->getName(),
+                    checkout.getPatron()->getContactInfo(), checkout.getDueDay(),
+                    policy.termsFor(checkout)};
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        size_t slot = loanSlot(row.barcode);
+        writable().loans.set(slot, std::move(row));
+    }
+    
+    void removeLoan(const std::string& barcode) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        auto slot = loanSlots_.find(barcode);
+        if (slot != loanSlots_.end()) writable().loans.erase(slot->second);
+    }
+    
+    // Holds back snapshots until the returned lock is released, so changes
+    // made meanwhile by one operation become visible together
+    std::unique_lock<std::recursive_mutex> batch() {
+        return std::unique_lock<std::recursive_mutex>(mutex_);
+    }
+    
+    LibrarySnapshot snapshot(EpochDay asOf) const {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        published_ = true;
+        return LibrarySnapshot(state_, asOf);
+    }
+};
+
+/**
+ * Overdue notice text, compiled once from a template. Placeholders are
+ * written {{name}}; the part between {{#loans}} and {{/loans}} is repeated
+ * for each overdue loan. Patron fields: patron_name, patron_id, contact,
+ * as_of, loan_count, total_fine. Loan fields: title, item_id, barcode,
+ * due_date, days_overdue, fine.
+ */
+class NoticeTemplate {
+public:
+    enum class Field {
+        Literal, PatronName, PatronId, Contact, AsOf, LoanCount, TotalFine,
+        Title, ItemId, Barcode, DueDate, DaysOverdue, Fine
+    };
+    
+    struct Segment {
+        Field field;
+        std::string text;  // Literal only
+    };
+    
+    struct Notice {
+        const LoanRow* patron = nullptr;  // any of the patron's loans, for patron fields
+        std::vector<const LoanRow*> loans;
+    };
+    
+private:
+    std::vector<Segment> header_;
+    std::vector<Segment> loan_;
+    std::vector<Segment> footer_;
+    
+    static Field fieldNamed(const std::string& name, bool inLoans) {
+        static const std::pair<const char*, Field> kPatronFields[] = {
+            {"patron_name", Field::PatronName}, {"patron_id", Field::PatronId}, {"contact", Field::Contact},
+            {"as_of", Field::AsOf}, {"loan_count", Field::LoanCount}, {"total_fine", Field::TotalFine}};
+        static const std::pair<const char*, Field> kLoanFields[] = {
+            {"title", Field::Title}, {"item_id", Field::ItemId}, {"barcode", Field::Barcode},
+            {"due_date", Field::DueDate}, {"days_overdue", Field::DaysOverdue}, {"fine", Field::Fine}};
+        for (const auto& entry : kPatronFields) {
+            if (name == entry.first) return entry.second;
+        }
+        for (const auto& entry : kLoanFields) {
+            if (name == entry.first && inLoans) return entry.second;
+        }
+        throw LibraryException("Unknown notice template field: " + name);
+    }
+    
+    static void appendMoney(std::string& out, double amount) {
+        char text[32];
+        int length = std::snprintf(text, sizeof(text), "%.2f", amount);
+        out.append(text, static_cast<size_t>(length));
+    }
+    
+    static void appendField(std::string& out, Field field, const Notice& notice, const LoanRow* loan,
+                            EpochDay asOf, double totalFine) {
+        switch (field) {
+            case Field::Literal: break;
+            case Field::PatronName: out += notice.patron->patronName; break;
+            case Field::PatronId: out += notice.patron->patronId; break;
+            case Field::Contact: out += notice.patron->patronContact; break;
+            case Field::AsOf: DateFormatter::appendDay(out, asOf); break;
+            case Field::LoanCount: out += std::to_string(notice.loans.size()); break;
+            case Field::TotalFine: appendMoney(out, totalFine); break;
+            case Field::Title: out += loan->title; break;
+            case Field::ItemId: out += loan->itemId; break;
+            case Field::Barcode: out += loan->barcode; break;
+            case Field::DueDate: DateFormatter::appendDay(out, loan->dueDay); break;
+            case Field::DaysOverdue: out += std::to_string(asOf - loan->dueDay); break;
+            case Field::Fine: appendMoney(out, loan->fineAsOf(asOf)); break;
+        }
+    }
+    
+    void append(std::string& out, const std::vector<Segment>& segments, const Notice& notice,
+                const LoanRow* loan, EpochDay asOf, double totalFine) const {
+        for (const Segment& segment : segments) {
+            if (segment.field == Field::Literal) out += segment.text;
+            else appendField(out, segment.field, notice, loan, asOf, totalFine);
+        }
+    }
+    
+public:
+    explicit NoticeTemplate(const std::string& text) {
+        static const std::string kOpenLoans = "{{#loans}}", kCloseLoans = "{{/loans}}";
+        size_t open = text.find(kOpenLoans);
+        size_t close = text.find(kCloseLoans);
+        if ((open == std::string::npos) != (close == std::string::npos) || (open != std::string::npos && close < open)) {
+            throw LibraryException("Notice template has an unbalanced {{#loans}} section");
+        }
+        if (open == std::string::npos) {
+            header_ = compile(text, false);
+        } else {
+            header_ = compile(text.substr(0, open), false);
+            loan_ = compile(text.substr(open + kOpenLoans.size(), close - open - kOpenLoans.size()), true);
+            footer_ = compile(text.substr(close + kCloseLoans.size()), false);
+        }
+    }
+    
+    static std::vector<Segment> compile(const std::string& text, bool inLoans) {
+        std::vector<Segment> segments;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t start = text.find("{{", pos);
+            if (start != pos) {
+                segments.push_back({Field::Literal, text.substr(pos, start - pos)});
+                if (start == std::string::npos) break;
+            }
+            size_t end = text.find("}}", start);
+            if (end == std::string::npos) throw LibraryException("Unterminated notice template field");
+            segments.push_back({fieldNamed(text.substr(start + 2, end - start - 2), inLoans), ""});
+            pos = end + 2;
+        }
+        return segments;
+    }
+    
+    static const NoticeTemplate& standard() {
+        static const NoticeTemplate kStandard(
+            "To: {{contact}}\n"
+            "Subject: Overdue library items\n"
+            "\n"
+            "Dear {{patron_name}},\n"
+            "\n"
+            "As of {{as_of}} you have {{loan_count}} overdue item(s):\n"
+            "\n"
+            "{{#loans}}"
+            "- {{title}} ({{barcode}}), due {{due_date}}, {{days_overdue}} day(s) overdue, fine ${{fine}}\n"
+            "{{/loans}}"
+            "\n"
+            "Total fines to date: ${{total_fine}}\n"
+            "Please return these items as soon as possible.\n");
+        return kStandard;
+    }
+    
+    // Replaces out's contents with the rendered notice, reusing its capacity
+    void render(const Notice& notice, EpochDay asOf, std::string& out) const {
+        double totalFine = 0.0;
+        for (const LoanRow* loan : notice.loans) totalFine += loan->fineAsOf(asOf);
+        out.clear();
+        append(out, header_, notice, nullptr, asOf, totalFine);
+        for (const LoanRow* loan : notice.loans) append(out, loan_, notice, loan, asOf, totalFine);
+        append(out, footer_, notice, nullptr, asOf, totalFine);
+    }
+};
+
+/**
+ * Nightly overdue notice run: groups a snapshot's overdue loans by patron
+ * in one pass, then renders and writes one file per patron to a spool
+ * directory from several threads, each reusing a single buffer
+ */
+class OverdueNoticeSpool {
+public:
+    struct Result {
+        size_t notices = 0;
+        size_t loans = 0;
+        size_t bytes = 0;
+        std::vector<std::string> failures;  // patron IDs whose file could not be written
+    };
+    
+    // Spool file name for a patron. Characters other than letters, digits,
+    // '-' and '_' are percent-encoded, so distinct IDs never share a file.
+    static std::string fileNameFor(const std::string& patronId) {
+        static const char kHex[] = "0123456789ABCDEF";
+        std::string name;
+        name.reserve(patronId.size() + 4);
+        for (char c : patronId) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (std::isalnum(byte) || c == '-' || c == '_') {
+                name += c;
+            } else {
+                name += '%';
+                name += kHex[byte >> 4];
+                name += kHex[byte & 0xF];
+            }
+        }
+        return name + ".txt";
+    }
+    
+    static std::vector<NoticeTemplate::Notice> groupByPatron(const LibrarySnapshot& snapshot) {
+        std::vector<NoticeTemplate::Notice> notices;
+        std::unordered_map<std::string, size_t> byPatron;
+        EpochDay asOf = snapshot.getAsOf();
+        snapshot.forEachLoan([&](const LoanRow& row) {
+            if (row.dueDay >= asOf) return;
+            auto slot = byPatron.emplace(row.patronId, notices.size());
+            if (slot.second) notices.push_back({&row, {}});
+            notices[slot.first->second].loans.push_back(&row);
+        });
+        for (auto& notice : notices) {
+            std::sort(notice.loans.begin(), notice.loans.end(), [](const LoanRow* a, const LoanRow* b) {
+                return a->dueDay != b->dueDay ? a->dueDay < b->dueDay : a->barcode < b->barcode;
+            });
+        }
+        return notices;
+    }
+    
+    /**
+     * Writes notices for every patron with overdue loans into directory,
+     * which must exist. A file that cannot be written is reported in the
+     * result rather than stopping the run.
+     */
+    static Result write(const LibrarySnapshot& snapshot, const std::string& directory,
+                        const NoticeTemplate& noticeTemplate = NoticeTemplate::standard(),
+                        unsigned threads = std::thread::hardware_concurrency()) {
+        std::vector<NoticeTemplate::Notice> notices = groupByPatron(snapshot);
+        EpochDay asOf = snapshot.getAsOf();
+        
+        auto writeRange = [&](size_t begin, size_t end) {
+            Result partial;
+            std::string buffer;
+            std::string path = directory + "/";
+            size_t prefix = path.size();
+            for (size_t i = begin; i < end; ++i) {
+                const NoticeTemplate::Notice& notice = notices[i];
+                noticeTemplate.render(notice, asOf, buffer);
+                path.resize(prefix);
+                path += fileNameFor(notice.patron->patronId);
+                std::FILE* file = std::fopen(path.c_str(), "wb");
+                bool written = file && std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+                if (file && std::fclose(file) != 0) written = false;
+                if (!written) {
+                    partial.failures.push_back(notice.patron->patronId);
+                    continue;
+                }
+                ++partial.notices;
+                partial.loans += notice.loans.size();
+                partial.bytes += buffer.size();
+            }
+            return partial;
+        };
+        
+        // Small runs are not worth a thread
+        size_t workers = std::max<size_t>(1, std::min<size_t>(std::max(1u, threads), notices.size() / 256));
+        std::vector<std::future<Result>> partials;
+        for (size_t w = 0; w < workers; ++w) {
+            partials.push_back(std::async(workers == 1 ? std::launch::deferred : std::launch::async, writeRange,
+                                          notices.size() * w / workers, notices.size() * (w + 1) / workers));
+        }
+        Result result;
+        for (auto& future : partials) {
+            Result partial = future.get();
+            result.notices += partial.notices;
+            result.loans += partial.loans;
+            result.bytes += partial.bytes;
+            result.failures.insert(result.failures.end(), partial.failures.begin(), partial.failures.end());
+        }
+        return result;
+    }
+};
+
+/**
+ * Text encoding shared by the replication stream: one record per line,
+ * tab-separated fields with backslash escapes, and helpers that turn items
+ * and patrons into fields and back
+ */
+class LogCodec {
+public:
+    static std::string join(const std::vector<std::string>& fields) {
+        std::string line;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (i > 0) line += '\t';
+            for (char c : fields[i]) {
+                switch (c) {
+                    case '\\': line += "\\\\"; break;
+                    case '\t': line += "\\t"; break;
+                    case '\n': line += "\\n"; break;
+                    case '\r': line += "\\r"; break;
+                    default: line += c;
+                }
+            }
+        }
+        return line;
+    }
+    
+    static std::vector<std::string> split(const std::string& line) {
+        std::vector<std::string> fields(1);
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (c == '\t') {
+                fields.emplace_back();
+            } else if (c == '\\' && i + 1 < line.size()) {
+                char next = line[++i];
+                fields.back() += next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : next;
+            } else {
+                fields.back() += c;
+            }
+        }
+        return fields;
+    }
+    
+    // Type name, ID, then the registry's constructor fields
+    static std::vector<std::string> encodeItem(const LibraryItem& item) {
+        std::vector<std::string> fields = {item.getItemType(), item.getId()};
+        for (auto& value : itemFieldValues(item)) fields.push_back(std::move(value));
+        return fields;
+    }
+    
+    // Decodes fields[first..] as written by encodeItem
+    static std::unique_ptr<LibraryItem> decodeItem(const std::vector<std::string>& fields, size_t first) {
+        if (fields.size() < first + 2) throw LibraryException("Truncated item record");
+        const ItemTypeSpec* spec = findItemType(fields[first]);
+        if (!spec) throw LibraryException("Unknown item type in record: " + fields[first]);
+        auto values = fields.begin() + static_cast<std::ptrdiff_t>(first + 2);
+        if (static_cast<size_t>(fields.end() - values) < spec->fields.size()) throw LibraryException("Truncated item record");
+        return createItem(spec->kind, fields[first + 1], FieldValues(values, values + static_cast<std::ptrdiff_t>(spec->fields.size())));
+    }
+    
+    // Type name, ID, name, contact, the registry's fields, then the active flag
+    static std::vector<std::string> encodePatron(const LibraryPatron& patron) {
+        std::vector<std::string> fields = {patron.getPatronType(), patron.getId(), patron.getName(), patron.getContactInfo()};
+        for (auto& value : patronFieldValues(patron)) fields.push_back(std::move(value));
+        fields.push_back(patron.isActive() ? "1" : "0");
+        return fields;
+    }
+    
+    // Decodes fields[first..] as written by encodePatron
+    static std::unique_ptr<LibraryPatron> decodePatron(const std::vector<std::string>& fields, size_t first) {
+        if (fields.size() < first + 4) throw LibraryException("Truncated patron record");
+        const PatronTypeSpec* spec = findPatronType(fields[first]);
+        if (!spec) throw LibraryException("Unknown patron type in record: " + fields[first]);
+        size_t count = spec->fields.size();
+        if (fields.size() < first + 5 + count) throw LibraryException("Truncated patron record");
+        auto values = fields.begin() + static_cast<std::ptrdiff_t>(first + 4);
+        auto patron = createPatron(spec->kind, fields[first + 1], fields[first + 2], fields[first + 3],
+                                   FieldValues(values, values + static_cast<std::ptrdiff_t>(count)));
+        patron->setActive(fields[first + 4 + count] == "1");
+        return patron;
+    }
+    
+    // Nanoseconds since the epoch, so a replay sees the instant that was journaled
+    static std::string encodeTime(std::chrono::system_clock::time_point time) {
+        return std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count());
+    }
+    
+    static std::chrono::system_clock::time_point decodeTime(const std::string& text) {
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(std::stoll(text))));
+    }
+    
+    // Availability of every copy, e.g. "101" for copies 0 and 2 on the shelf
+    static std::string encodeCopyStatus(const LibraryItem& item) {
+        std::string status;
+        for (const auto& copy : item.getCopies()) status += copy.available ? '1' : '0';
+        return status;
+    }
+};
+
+/**
+ * One record of the primary's change stream
+ */
+struct ReplicationRecord {
+    // Synced closes the state image a late subscriber starts from
+    enum class Kind { Item, Copy, Patron, Active, CopyStatus, Synced };
+    
+    uint64_t sequence = 0;
+    int64_t appendedNs = 0;  // primary's steady clock when appended
+    Kind kind = Kind::Item;
+    std::vector<std::string> fields;
+    
+    static const char* kindName(Kind kind) {
+        switch (kind) {
+            case Kind::Item: return "item";
+            case Kind::Copy: return "copy";
+            case Kind::Patron: return "patron";
+            case Kind::Active: return "active";
+            case Kind::CopyStatus: return "status";
+            case Kind::Synced: return "synced";
+        }
+        return "";
+    }
+    
+    std::string encode() const {
+        std::vector<std::string> line = {std::to_string(sequence), std::to_string(appendedNs), kindName(kind)};
+        line.insert(line.end(), fields.begin(), fields.end());
+        return LogCodec::join(line);
+    }
+    
+    static ReplicationRecord decode(const std::string& line) {
+        std::vector<std::string> parts = LogCodec::split(line);
+        if (parts.size() < 3) throw LibraryException("Malformed replication record");
+        ReplicationRecord record;
+        record.sequence = std::stoull(parts[0]);
+        record.appendedNs = std::stoll(parts[1]);
+        bool known = false;
+        for (int k = 0; k <= static_cast<int>(Kind::Synced); ++k) {
+            if (parts[2] == kindName(static_cast<Kind>(k))) {
+                record.kind = static_cast<Kind>(k);
+                known = true;
+            }
+        }
+        if (!known) throw LibraryException("Unknown replication record kind: " + parts[2]);
+        record.fields.assign(parts.begin() + 3, parts.end());
+        return record;
+    }
+};
+
+/**
+ * Ordered, thread-safe stream of encoded records from a primary to one
+ * replica. It carries exactly the lines a pipe or socket would; the primary
+ * never blocks on it.
+ */
+class ReplicationChannel {
+private:
+    struct Entry {
+        uint64_t sequence;
+        int64_t appendedNs;
+        std::string line;
+    };
+    
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Entry> pending_;
+    uint64_t lastSequence_ = 0;
+    bool closed_ = false;
+    
+public:
+    void push(uint64_t sequence, int64_t appendedNs, std::string line) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_) return;
+            pending_.push_back({sequence, appendedNs, std::move(line)});
+            lastSequence_ = sequence;
+        }
+        ready_.notify_one();
+    }
+    
+    // Waits for the next line; false once the channel is closed and drained
+    bool pop(std::string& line) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return !pending_.empty() || closed_; });
+        if (pending_.empty()) return false;
+        line = std::move(pending_.front().line);
+        pending_.pop_front();
+        return true;
+    }
+    
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+    
+    uint64_t getLastSequence() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return lastSequence_;
+    }
+    
+    // Primary timestamp of the oldest record not yet taken, if any
+    bool oldestPending(int64_t& appendedNs) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_.empty()) return false;
+        appendedNs = pending_.front().appendedNs;
+        return true;
+    }
+};
+
+/**
+ * The primary's change log. Records are numbered and pushed to every
+ * subscribed channel; none are retained, so memory stays flat however long
+ * the primary runs. A replica subscribing late starts from an image of the
+ * primary's current state instead of the history (Library::subscribeReplica).
+ */
+class ReplicationLog {
+private:
+    mutable std::mutex mutex_;
+    uint64_t lastSequence_ = 0;
+    std::vector<std::shared_ptr<ReplicationChannel>> channels_;
+    
+public:
+    static int64_t steadyNowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    uint64_t append(ReplicationRecord::Kind kind, std::vector<std::string> fields) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ReplicationRecord record;
+        record.sequence = ++lastSequence_;
+        record.appendedNs = steadyNowNs();
+        record.kind = kind;
+        record.fields = std::move(fields);
+        std::string line = record.encode();
+        for (auto& channel : channels_) channel->push(record.sequence, record.appendedNs, line);
+        return record.sequence;
+    }
+    
+    /**
+     * A channel that starts with the given image of the primary's state,
+     * then follows the log. The image is closed by a Synced record taking
+     * the next sequence number, so waiting for getLastSequence() covers it;
+     * the other channels get the record too, to keep their numbering whole.
+     */
+    std::shared_ptr<ReplicationChannel> subscribe(const std::vector<ReplicationRecord>& image = {}) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto channel = std::make_shared<ReplicationChannel>();
+        int64_t now = steadyNowNs();
+        for (ReplicationRecord record : image) {
+            record.sequence = lastSequence_;
+            record.appendedNs = now;
+            channel->push(record.sequence, now, record.encode());
+        }
+        channels_.push_back(channel);
+        ReplicationRecord synced;
+        synced.sequence = ++lastSequence_;
+        synced.appendedNs = now;
+        synced.kind = ReplicationRecord::Kind::Synced;
+        std::string line = synced.encode();
+        for (auto& subscribed : channels_) subscribed->push(synced.sequence, now, line);
+        return channel;
+    }
+    
+    uint64_t getLastSequence() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return lastSequence_;
+    }
+    
+    ~ReplicationLog() {
+        for (auto& channel : channels_) channel->close();
+    }
+};
+
+/**
+ * Blocking reads and writes on a pipe or socket descriptor
+ */
+class PipeIO {
+public:
+    static bool writeAll(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+#ifdef _WIN32
+            int n = _write(fd, data.data() + written, static_cast<unsigned>(data.size() - written));
+#else
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+#endif
+            if (n <= 0) return false;
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+    
+    // Bytes read, 0 at end of stream, negative on error
+    static long readSome(int fd, char* buffer, size_t size) {
+#ifdef _WIN32
+        return _read(fd, buffer, static_cast<unsigned>(size));
+#else
+        ssize_t n;
+        do {
+            n = ::read(fd, buffer, size);
+        } while (n < 0 && errno == EINTR);
+        return static_cast<long>(n);
+#endif
+    }
+    
+    static void close(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+};
+
+/**
+ * Writes a replication channel to a pipe or socket, one encoded record per
+ * line, so the replica can run in another process. Takes ownership of the
+ * descriptor. If the reader goes away the stream is drained and dropped;
+ * callers writing to a pipe should ignore SIGPIPE.
+ */
+class ReplicationSender {
+private:
+    std::shared_ptr<ReplicationChannel> channel_;
+    int fd_;
+    std::thread pump_;
+    
+    void run() {
+        std::string line;
+        bool connected = true;
+        while (channel_->pop(line)) {
+            line += '\n';
+            if (connected) connected = PipeIO::writeAll(fd_, line);
+        }
+        PipeIO::close(fd_);
+    }
+    
+public:
+    ReplicationSender(std::shared_ptr<ReplicationChannel> channel, int fd)
+        : channel_(std::move(channel)), fd_(fd)
+    {
+        pump_ = std::thread([this]() { run(); });
+    }
+    
+    // Sends what is already queued, then closes the descriptor
+    ~ReplicationSender() {
+        channel_->close();
+        pump_.join();
+    }
+    
+    ReplicationSender(const ReplicationSender&) = delete;
+    ReplicationSender& operator=(const ReplicationSender&) = delete;
+};
+
+/**
+ * Reads the lines a ReplicationSender writes back into a local channel for
+ * a LibraryReplica. The channel closes at end of stream. Lag ages compare
+ * the primary's steady clock with this process's, so both must run on the
+ * same host.
+ */
+class ReplicationReceiver {
+private:
+    int fd_;
+    std::shared_ptr<ReplicationChannel> channel_ = std::make_shared<ReplicationChannel>();
+    std::thread reader_;
+    
+    void deliver(std::string line) {
+        uint64_t sequence = channel_->getLastSequence();
+        int64_t appendedNs = ReplicationLog::steadyNowNs();
+        try {
+            ReplicationRecord record = ReplicationRecord::decode(line);
+            sequence = record.sequence;
+            appendedNs = record.appendedNs;
+        } catch (const std::exception&) {
+            // Passed on as is; the replica counts it as an apply error
+        }
+        channel_->push(sequence, appendedNs, std::move(line));
+    }
+    
+    void run() {
+        std::string pending;
+        char buffer[4096];
+        long n;
+        while ((n = PipeIO::readSome(fd_, buffer, sizeof(buffer))) > 0) {
+            pending.append(buffer, static_cast<size_t>(n));
+            size_t start = 0;
+            size_t end;
+            while ((end = pending.find('\n', start)) != std::string::npos) {
+                deliver(pending.substr(start, end - start));
+                start = end + 1;
+            }
+            pending.erase(0, start);
+        }
+        PipeIO::close(fd_);
+        channel_->close();
+    }
+    
+public:
+    explicit ReplicationReceiver(int fd) : fd_(fd) {
+        reader_ = std::thread([this]() { run(); });
+    }
+    
+    ~ReplicationReceiver() { wait(); }
+    
+    ReplicationReceiver(const ReplicationReceiver&) = delete;
+    ReplicationReceiver& operator=(const ReplicationReceiver&) = delete;
+    
+    std::shared_ptr<ReplicationChannel> getChannel() const { return channel_; }
+    
+    // Blocks until the sender closes its end and every line has been queued
+    void wait() {
+        if (reader_.joinable()) reader_.join();
+    }
+};
+
+/**
+ * Sits in the item and patron observer chain and writes availability and
+ * active-state changes to the replication log, if one is attached
+ */
+class ReplicationTap : public LibraryObserver {
+private:
+    ReplicationLog* log_ = nullptr;
+    LibraryObserver* next_;
+    
+public:
+    explicit ReplicationTap(LibraryObserver* next) : next_(next) {}
+    
+    void setLog(ReplicationLog* log) { log_ = log; }
+    ReplicationLog* getLog() const { return log_; }
+    
+    void append(ReplicationRecord::Kind kind, std::vector<std::string> fields) {
+        if (log_) log_->append(kind, std::move(fields));
+    }
+    
+    void onAvailabilityChanged(const LibraryItem& item, size_t availableBefore) override {
+        append(ReplicationRecord::Kind::CopyStatus, {item.getId(), LogCodec::encodeCopyStatus(item)});
+        if (next_) next_->onAvailabilityChanged(item, availableBefore);
+    }
+    
+    void onActiveChanged(const LibraryPatron& patron, bool wasActive) override {
+        append(ReplicationRecord::Kind::Active, {patron.getId(), patron.isActive() ? "1" : "0"});
+        if (next_) next_->onActiveChanged(patron, wasActive);
+    }
+};
+
+/**
+ * In-memory transaction log, kept as fixed-size segments of encoded lines.
+ * Full segments are sealed and handed to the checkpointer, which archives
+ * them and frees their memory, so only the open segment and any sealed
+ * segments not yet checkpointed stay resident.
+ */
+class TransactionJournal {
+public:
+    struct Segment {
+        uint64_t firstSequence = 0;
+        std::vector<std::string> lines;
+    };
+    
+private:
+    std::deque<Segment> sealed_;
+    Segment open_;
+    size_t segmentRecords_;
+    uint64_t nextSequence_ = 1;
+    uint64_t sinceCheckpoint_ = 0;
+    
+public:
+    explicit TransactionJournal(size_t segmentRecords = 1024) : segmentRecords_(segmentRecords) {
+        open_.firstSequence = nextSequence_;
+    }
+    
+    // Takes a record already joined with LogCodec::join
+    uint64_t append(std::string line) {
+        if (open_.lines.size() >= segmentRecords_) {
+            sealed_.push_back(std::move(open_));
+            open_ = Segment();
+            open_.firstSequence = nextSequence_;
+        }
+        open_.lines.push_back(std::move(line));
+        ++sinceCheckpoint_;
+        return nextSequence_++;
+    }
+    
+    void setSegmentRecords(size_t segmentRecords) {
+        if (segmentRecords == 0) throw LibraryException("Journal segments must hold at least one record");
+        segmentRecords_ = segmentRecords;
+    }
+    
+    // Closes the open segment early, e.g. so a checkpoint can archive it
+    void seal() {
+        if (open_.lines.empty()) return;
+        sealed_.push_back(std::move(open_));
+        open_ = Segment();
+        open_.firstSequence = nextSequence_;
+    }
+    
+    // Moves the sealed segments out and starts counting toward the next checkpoint
+    std::vector<Segment> takeSealed() {
+        std::vector<Segment> taken(std::make_move_iterator(sealed_.begin()), std::make_move_iterator(sealed_.end()));
+        sealed_.clear();
+        sinceCheckpoint_ = 0;
+        return taken;
+    }
+    
+    // Visits the resident records, oldest first
+    template<typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const Segment& segment : sealed_) {
+            for (const std::string& line : segment.lines) visit(LogCodec::split(line));
+        }
+        for (const std::string& line : open_.lines) visit(LogCodec::split(line));
+    }
+    
+    // Continues numbering after a checkpoint's last sequence, so archives
+    // and transaction IDs from before a restart are not reused
+    void resumeAfter(uint64_t sequence) {
+        if (getResidentRecordCount() > 0) throw LibraryException("Journal already has records");
+        nextSequence_ = sequence + 1;
+        open_.firstSequence = nextSequence_;
+    }
+    
+    uint64_t getLastSequence() const { return nextSequence_ - 1; }
+    uint64_t getRecordsSinceCheckpoint() const { return sinceCheckpoint_; }
+    size_t getSealedSegmentCount() const { return sealed_.size(); }
+    
+    size_t getResidentRecordCount() const {
+        size_t count = open_.lines.size();
+        for (const Segment& segment : sealed_) count += segment.lines.size();
+        return count;
+    }
+};
+
+/**
+ * Writes checkpoints on a background thread. Each job carries a complete
+ * state image, which atomically replaces checkpoint.img in the directory,
+ * and the journal segments it supersedes, which are appended to
+ * journal-<first>-<last>.log archives and then freed. A job that fails
+ * keeps its segments, and they are written with the next job.
+ *
+ * Records journaled between checkpoints also go straight to a live tail,
+ * tail-<first>.log, flushed per record so a crash loses none of them. A
+ * tail is deleted once an image covering it is in place.
+ */
+class Checkpointer {
+public:
+    struct Job {
+        std::vector<std::string> image;
+        std::vector<TransactionJournal::Segment> segments;
+        std::vector<std::string> tails;  // deleted once the image is written
+    };
+    
+private:
+    std::string directory_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Job> jobs_;
+    bool busy_ = false;
+    bool stopping_ = false;
+    uint64_t checkpoints_ = 0;
+    uint64_t failures_ = 0;
+    std::string lastError_;
+    // Segments and tails of failed jobs, oldest first, waiting for the next job
+    std::vector<TransactionJournal::Segment> unwritten_;
+    std::vector<std::string> unwrittenTails_;
+    // Written by the journaling thread only
+    std::ofstream tail_;
+    std::vector<std::string> tails_;
+    std::thread worker_;
+    
+    void write(const Job& job) {
+        for (const auto& segment : job.segments) {
+            if (segment.lines.empty()) continue;
+            std::string path = directory_ + "/journal-" + std::to_string(segment.firstSequence) + "-" +
+                               std::to_string(segment.firstSequence + segment.lines.size() - 1) + ".log";
+            std::ofstream out(path, std::ios::trunc);
+            for (const std::string& line : segment.lines) out << line << '\n';
+            if (!out) throw LibraryException("Cannot write journal archive: " + path);
+        }
+        
+        std::string path = checkpointPath(directory_);
+        std::string temp = path + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            for (const std::string& line : job.image) out << line << '\n';
+            out.flush();
+            if (!out) throw LibraryException("Cannot write checkpoint: " + temp);
+        }
+        if (std::rename(temp.c_str(), path.c_str()) != 0) {
+            throw LibraryException("Cannot replace checkpoint: " + path);
+        }
+        std::error_code error;
+        for (const std::string& tail : job.tails) std::filesystem::remove(tail, error);
+    }
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            changed_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            if (!unwritten_.empty()) {
+                job.segments.insert(job.segments.begin(), std::make_move_iterator(unwritten_.begin()),
+                                    std::make_move_iterator(unwritten_.end()));
+                unwritten_.clear();
+            }
+            job.tails.insert(job.tails.begin(), unwrittenTails_.begin(), unwrittenTails_.end());
+            unwrittenTails_.clear();
+            busy_ = true;
+            lock.unlock();
+            std::string error;
+            try {
+                write(job);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            // The next job's image supersedes this one's, but not its history
+            std::vector<TransactionJournal::Segment> unwritten;
+            std::vector<std::string> unwrittenTails;
+            if (!error.empty()) {
+                unwritten = std::move(job.segments);
+                unwrittenTails = std::move(job.tails);
+            }
+            // Drop the image and archived segments before reporting progress
+            job = Job();
+            lock.lock();
+            busy_ = false;
+            if (error.empty()) {
+                ++checkpoints_;
+            } else {
+                unwritten_ = std::move(unwritten);
+                unwrittenTails_ = std::move(unwrittenTails);
+                ++failures_;
+                lastError_ = error;
+            }
+            changed_.notify_all();
+        }
+    }
+    
+public:
+    // Tails left in directory by an earlier run are deleted with the next image
+    explicit Checkpointer(std::string directory) : directory_(std::move(directory)) {
+        for (const auto& tail : listSequenceFiles(directory_, "tail-")) tails_.push_back(tail.second.string());
+        worker_ = std::thread([this]() { run(); });
+    }
+    
+    // Finishes queued jobs before returning
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        worker_.join();
+    }
+    
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+    
+    static std::string checkpointPath(const std::string& directory) {
+        return directory + "/checkpoint.img";
+    }
+    
+    // <prefix><first sequence>...log files in directory, ordered by first sequence
+    static std::vector<std::pair<uint64_t, std::filesystem::path>> listSequenceFiles(const std::string& directory,
+                                                                                     const std::string& prefix) {
+        std::vector<std::pair<uint64_t, std::filesystem::path>> files;
+        std::error_code error;
+        for (std::filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+            std::string name = it->path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0 || it->path().extension() != ".log") continue;
+            files.emplace_back(std::strtoull(name.c_str() + prefix.size(), nullptr, 10), it->path());
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+    
+    /**
+     * Appends a journaled record to the live tail and flushes it. A failed
+     * write is counted like a failed checkpoint; the record is still
+     * archived with the next checkpoint.
+     */
+    void appendTail(uint64_t sequence, const std::string& line) {
+        if (!tail_.is_open()) {
+            tails_.push_back(directory_ + "/tail-" + std::to_string(sequence) + ".log");
+            tail_.open(tails_.back(), std::ios::trunc);
+        }
+        tail_ << line << '\n';
+        tail_.flush();
+        if (tail_) return;
+        tail_.close();
+        tail_.clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++failures_;
+        lastError_ = "Cannot write journal tail: " + tails_.back();
+    }
+    
+    // Closes the live tail and returns every tail an image taken now covers
+    std::vector<std::string> rotateTails() {
+        tail_.close();
+        tail_.clear();
+        std::vector<std::string> tails = std::move(tails_);
+        tails_.clear();
+        return tails;
+    }
+    
+    const std::string& getDirectory() const { return directory_; }
+    
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        changed_.notify_all();
+    }
+    
+    // Blocks until every submitted job has been written or has failed
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() { return jobs_.empty() && !busy_; });
+    }
+    
+    uint64_t getCheckpointCount() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return checkpoints_;
+    }
+    
+    uint64_t getFailureCount() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return failures_;
+    }
+    
+    std::string getLastError() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return lastError_;
+    }
+    
+    // Calls visit with each record of failed jobs not yet archived, oldest first
+    template<typename Visitor>
+    void forEachUnwritten(Visitor visit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& segment : unwritten_) {
+            for (const std::string& line : segment.lines) visit(LogCodec::split(line));
+        }
+    }
+};
+
+/**
+ * "Patrons who borrowed this also borrowed" model. Counts, for each pair
+ * of items, the patrons who have borrowed both, and keeps every item's
+ * strongest neighbours in a fixed-size array ordered by count, so a
+ * recommendation is a single array read. Updated on each checkout.
+ */
+class CoBorrowIndex {
+public:
+    static constexpr size_t kNeighbors = 8;
+    static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+    
+    struct Neighbor {
+        uint32_t item = kNone;
+        uint32_t count = 0;
+    };
+    using Neighbors = std::array<Neighbor, kNeighbors>;
+    
+private:
+    std::unordered_map<std::string, uint32_t> ids_;
+    std::vector<std::string> names_;
+    std::vector<Neighbors> top_;
+    // Co-borrow count per unordered item pair, keyed (low << 32) | high
+    std::unordered_map<uint64_t, uint32_t> pairCounts_;
+    // Patron -> distinct items borrowed, sorted
+    std::unordered_map<std::string, std::vector<uint32_t>> borrowed_;
+    
+    uint32_t intern(const std::string& itemId) {
+        auto result = ids_.emplace(itemId, static_cast<uint32_t>(names_.size()));
+        if (result.second) {
+            names_.push_back(itemId);
+            top_.emplace_back();
+        }
+        return result.first->second;
+    }
+    
+    static uint64_t pairKey(uint32_t a, uint32_t b) {
+        if (a > b) std::swap(a, b);
+        return (static_cast<uint64_t>(a) << 32) | b;
+    }
+    
+    static bool ranksAbove(const Neighbor& a, const Neighbor& b) {
+        return a.count != b.count ? a.count > b.count : a.item < b.item;
+    }
+    
+    // Counts only grow, so checking an item whenever its count changes
+    // keeps each array exactly the top kNeighbors
+    static void offer(Neighbors& neighbors, uint32_t item, uint32_t count) {
+        size_t slot = kNeighbors;
+        for (size_t i = 0; i < kNeighbors; ++i) {
+            if (neighbors[i].item == item) {
+                slot = i;
+                break;
+            }
+        }
+        Neighbor candidate{item, count};
+        if (slot == kNeighbors) {
+            if (!ranksAbove(candidate, neighbors[kNeighbors - 1])) return;
+            slot = kNeighbors - 1;
+        }
+        neighbors[slot] = candidate;
+        while (slot > 0 && ranksAbove(neighbors[slot], neighbors[slot - 1])) {
+            std::swap(neighbors[slot], neighbors[slot - 1]);
+            --slot;
+        }
+    }
+    
+public:
+    void recordBorrow(const std::string& patronId, const std::string& itemId) {
+        uint32_t item = intern(itemId);
+        std::vector<uint32_t>& items = borrowed_[patronId];
+        auto pos = std::lower_bound(items.begin(), items.end(), item);
+        if (pos != items.end() && *pos == item) return;
+        for (uint32_t other : items) {
+            uint32_t count = ++pairCounts_[pairKey(item, other)];
+            offer(top_[item], other, count);
+            offer(top_[other], item, count);
+        }
+        items.insert(pos, item);
+    }
+    
+    // Up to limit (itemId, co-borrow count) pairs, strongest first
+    std::vector<std::pair<std::string, uint32_t>> recommend(const std::string& itemId, size_t limit) const {
+        std::vector<std::pair<std::string, uint32_t>> results;
+        auto it = ids_.find(itemId);
+        if (it == ids_.end()) return results;
+        for (const Neighbor& neighbor : top_[it->second]) {
+            if (neighbor.item == kNone || results.size() >= limit) break;
+            results.emplace_back(names_[neighbor.item], neighbor.count);
+        }
+        return results;
+    }
+    
+    /**
+     * Replaces the model with one built from (patronId, itemId) borrows.
+     * Pair counting is split across threads by patron; the per-thread
+     * counts are then merged and ranked.
+     */
+    void rebuild(const std::vector<std::pair<std::string, std::string>>& borrows, unsigned threads) {
+        *this = CoBorrowIndex();
+        for (const auto& borrow : borrows) {
+            uint32_t item = intern(borrow.second);
+            std::vector<uint32_t>& items = borrowed_[borrow.first];
+            auto pos = std::lower_bound(items.begin(), items.end(), item);
+            if (pos == items.end() || *pos != item) items.insert(pos, item);
+        }
+        
+        std::vector<const std::vector<uint32_t>*> lists;
+        lists.reserve(borrowed_.size());
+        for (const auto& pair : borrowed_) lists.push_back(&pair.second);
+        size_t shards = std::max<size_t>(1, std::min<size_t>(threads, lists.size()));
+        std::vector<std::future<std::unordered_map<uint64_t, uint32_t>>> counted;
+        for (size_t shard = 0; shard < shards; ++shard) {
+            counted.push_back(std::async(std::launch::async, [&lists, shard, shards]() {
+                std::unordered_map<uint64_t, uint32_t> counts;
+                for (size_t p = shard; p < lists.size(); p += shards) {
+                    const std::vector<uint32_t>& items = *lists[p];
+                    for (size_t i = 0; i < items.size(); ++i) {
+                        for (size_t j = i + 1; j < items.size(); ++j) ++counts[pairKey(items[i], items[j])];
+                    }
+                }
+                return counts;
+            }));
+        }
+        for (auto& future : counted) {
+            for (const auto& pair : future.get()) pairCounts_[pair.first] += pair.second;
+        }
+        for (const auto& pair : pairCounts_) {
+            uint32_t low = static_cast<uint32_t>(pair.first >> 32);
+            uint32_t high = static_cast<uint32_t>(pair.first);
+            offer(top_[low], high, pair.second);
+            offer(top_[high], low, pair.second);
+        }
+    }
+    
+    size_t getPairCount() const { return pairCounts_.size(); }
+};
+
+/**
+ * Column store of every loan for circulation reports. Each checkout adds a
+ * row of small integer codes (dictionary-encoded item, genre, item type and
+ * patron type, plus checkout day and month); the return fills in the loan
+ * length and fine. Reports scan the columns in parallel chunks, aggregating
+ * into per-thread tables keyed by a packed 64-bit group code.
+ */
+class CirculationHistory {
+public:
+    enum GroupBy : unsigned {
+        ByItemType = 1,
+        ByGenre = 2,
+        ByPatronType = 4,
+        ByItem = 8,
+        ByMonth = 16,
+        ByYear = 32
+    };
+    
+    struct Query {
+        unsigned groupBy = 0;
+        EpochDay fromDay = std::numeric_limits<EpochDay>::min();  // inclusive
+        EpochDay toDay = std::numeric_limits<EpochDay>::max();    // inclusive
+        std::string itemType;                                     // empty for all
+        size_t limit = std::numeric_limits<size_t>::max();
+    };
+    
+    struct Group {
+        std::vector<std::string> key;   // one label per GroupBy flag, in flag order
+        uint64_t checkouts = 0;
+        uint64_t returned = 0;
+        double averageLoanDays = 0.0;   // over returned loans
+        double totalFines = 0.0;
+    };
+    
+    static constexpr int32_t kOpen = -1;
+    
+private:
+    // Columns, one entry per loan
+    std::vector<int32_t> day_;
+    std::vector<uint16_t> month_;       // months since 1970-01, earlier days in 0
+    std::vector<uint32_t> item_;
+    std::vector<uint8_t> itemType_;     // ItemKind
+    std::vector<uint8_t> patronType_;   // PatronKind
+    std::vector<int32_t> loanDays_;     // kOpen until returned
+    std::vector<int32_t> fineCents_;
+    
+    // Dictionaries; genre is a property of the item
+    std::unordered_map<std::string, uint32_t> itemCodes_;
+    std::vector<std::string> itemNames_;
+    std::vector<uint16_t> itemGenre_;
+    std::vector<std::string> genreNames_;
+    std::unordered_map<std::string, uint32_t> openRows_;  // copy barcode -> row
+    
+    struct Accumulator {
+        uint64_t checkouts = 0;
+        uint64_t returned = 0;
+        int64_t loanDays = 0;
+        int64_t fineCents = 0;
+        
+        void merge(const Accumulator& other) {
+            checkouts += other.checkouts;
+            returned += other.returned;
+            loanDays += other.loanDays;
+            fineCents += other.fineCents;
+        }
+    };
+    
+    template<typename Code>
+    static Code encode(std::vector<std::string>& names, const std::string& name) {
+        auto it = std::find(names.begin(), names.end(), name);
+        if (it != names.end()) return static_cast<Code>(it - names.begin());
+        names.push_back(name);
+        return static_cast<Code>(names.size() - 1);
+    }
+    
+    static uint16_t monthOf(EpochDay day) {
+        int year, month, dayOfMonth;
+        DateFormatter::civilFromDays(day, year, month, dayOfMonth);
+        return static_cast<uint16_t>(std::max(0, (year - 1970) * 12 + month - 1));
+    }
+    
+    // Layout: item or genre code (32) | month (16) | item type (8) | patron type (8)
+    uint64_t groupKey(size_t row, unsigned groupBy) const {
+        uint64_t key = 0;
+        if (groupBy & ByItem) key = item_[row];
+        else if (groupBy & ByGenre) key = itemGenre_[item_[row]];
+        key <<= 16;
+        if (groupBy & ByMonth) key |= month_[row];
+        else if (groupBy & ByYear) key |= month_[row] / 12;
+        key <<= 8;
+        if (groupBy & ByItemType) key |= itemType_[row];
+        key <<= 8;
+        if (groupBy & ByPatronType) key |= patronType_[row];
+        return key;
+    }
+    
+    std::vector<std::string> labels(uint64_t code, unsigned groupBy) const {
+        uint32_t patronType = code & 0xFF;
+        uint32_t itemType = (code >> 8) & 0xFF;
+        uint32_t period = (code >> 16) & 0xFFFF;
+        uint32_t itemOrGenre = static_cast<uint32_t>(code >> 32);
+        std::vector<std::string> key;
+        char text[16];
+        if (groupBy & ByItemType) key.push_back(kItemTypes[itemType].name);
+        if (groupBy & ByGenre) {
+            key.push_back(genreNames_[groupBy & ByItem ? itemGenre_[itemOrGenre] : itemOrGenre]);
+        }
+        if (groupBy & ByPatronType) key.push_back(kPatronTypes[patronType].name);
+        if (groupBy & ByItem) key.push_back(itemNames_[itemOrGenre]);
+        if (groupBy & ByMonth) {
+            std::snprintf(text, sizeof(text), "%04u-%02u", 1970 + period / 12, period % 12 + 1);
+            key.push_back(text);
+        } else if (groupBy & ByYear) {
+            key.push_back(std::to_string(1970 + period));
+        }
+        return key;
+    }
+    
+public:
+    // genre is only read the first time an item is seen
+    void recordCheckout(const std::string& barcode, const std::string& itemId, ItemKind itemType,
+                        const std::string& genre, PatronKind patronType, EpochDay day) {
+        auto code = itemCodes_.emplace(itemId, static_cast<uint32_t>(itemNames_.size()));
+        if (code.second) {
+            itemNames_.push_back(itemId);
+            itemGenre_.push_back(encode<uint16_t>(genreNames_, genre));
+        }
+        openRows_[barcode] = static_cast<uint32_t>(day_.size());
+        day_.push_back(static_cast<int32_t>(day));
+        month_.push_back(monthOf(day));
+        item_.push_back(code.first->second);
+        itemType_.push_back(static_cast<uint8_t>(itemType));
+        patronType_.push_back(static_cast<uint8_t>(patronType));
+        loanDays_.push_back(kOpen);
+        fineCents_.push_back(0);
+    }
+    
+    void recordReturn(const std::string& barcode, EpochDay day, double fine) {
+        auto it = openRows_.find(barcode);
+        if (it == openRows_.end()) return;
+        uint32_t row = it->second;
+        loanDays_[row] = static_cast<int32_t>(day - day_[row]);
+        fineCents_[row] = static_cast<int32_t>(std::llround(fine * 100.0));
+        openRows_.erase(it);
+    }
+    
+    size_t size() const { return day_.size(); }
+    
+    bool hasItem(const std::string& itemId) const { return itemCodes_.count(itemId) != 0; }
+    
+    // True while the copy's latest loan has a row awaiting its return
+    bool isOpen(const std::string& barcode) const { return openRows_.count(barcode) != 0; }
+    
+    void reserve(size_t rows) {
+        day_.reserve(rows);
+        month_.reserve(rows);
+        item_.reserve(rows);
+        itemType_.reserve(rows);
+        patronType_.reserve(rows);
+        loanDays_.reserve(rows);
+        fineCents_.reserve(rows);
+    }
+    
+    /**
+     * Groups loans checked out in the query's date range. Groups come back
+     * by checkouts, most first, then by key; limit applies after sorting.
+     */
+    std::vector<Group> aggregate(const Query& query, unsigned threads = std::thread::hardware_concurrency()) const {
+        int typeFilter = -1;
+        if (!query.itemType.empty()) {
+            const ItemTypeSpec* spec = findItemType(query.itemType);
+            if (!spec) return {};
+            typeFilter = static_cast<int>(spec->kind);
+        }
+        int32_t from = static_cast<int32_t>(std::max<EpochDay>(query.fromDay, std::numeric_limits<int32_t>::min()));
+        int32_t to = static_cast<int32_t>(std::min<EpochDay>(query.toDay, std::numeric_limits<int32_t>::max()));
+        
+        using Table = std::unordered_map<uint64_t, Accumulator>;
+        auto scan = [&](size_t begin, size_t end) {
+            Table table;
+            for (size_t row = begin; row < end; ++row) {
+                if (day_[row] < from || day_[row] > to) continue;
+                if (typeFilter >= 0 && itemType_[row] != typeFilter) continue;
+                Accumulator& acc = table[groupKey(row, query.groupBy)];
+                ++acc.checkouts;
+                if (loanDays_[row] != kOpen) {
+                    ++acc.returned;
+                    acc.loanDays += loanDays_[row];
+                    acc.fineCents += fineCents_[row];
+                }
+            }
+            return table;
+        };
+        
+        // Chunks under ~64K rows are not worth a thread
+        size_t rows = size();
+        size_t chunks = std::max<size_t>(1, std::min<size_t>(std::max(1u, threads), rows / 65536));
+        Table merged;
+        if (chunks == 1) {
+            merged = scan(0, rows);
+        } else {
+            std::vector<std::future<Table>> partials;
+            for (size_t c = 0; c < chunks; ++c) {
+                partials.push_back(std::async(std::launch::async, scan, rows * c / chunks, rows * (c + 1) / chunks));
+            }
+            for (auto& partial : partials) {
+                for (const auto& pair : partial.get()) merged[pair.first].merge(pair.second);
+            }
+        }
+        
+        std::vector<Group> groups;
+        groups.reserve(merged.size());
+        for (const auto& pair : merged) {
+            Group group;
+            group.key = labels(pair.first, query.groupBy);
+            group.checkouts = pair.second.checkouts;
+            group.returned = pair.second.returned;
+            if (group.returned > 0) group.averageLoanDays = static_cast<double>(pair.second.loanDays) / group.returned;
+            group.totalFines = pair.second.fineCents / 100.0;
+            groups.push_back(std::move(group));
+        }
+        std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b) {
+            return a.checkouts != b.checkouts ? a.checkouts > b.checkouts : a.key < b.key;
+        });
+        if (groups.size() > query.limit) groups.resize(query.limit);
+        return groups;
+    }
+};
+
+/**
+ * Library operations captured by TraceRecorder, with their arguments
+ */
+enum class TraceOp : uint8_t {
+    AddItem,            // LogCodec::encodeItem fields
+    AddCopy,            // itemId, barcode (empty to generate)
+    AddPatron,          // LogCodec::encodePatron fields
+    SetPatronActive,    // patronId, "1" or "0"
+    RestoreLoan,        // barcode, patronId, checkoutDay, dueDay, renewals
+    Checkout,           // itemId, patronId
+    Return,             // itemId
+    Renew,              // itemId
+    RenewAll,           // patronId
+    PlaceHold,          // itemId, patronId
+    CancelHold,         // holdId
+    ProcessExpiredHolds,
+    PayFine,            // patronId, amount
+    SearchByTitle,      // text
+    SearchByAuthor,     // text
+    SearchByGenre,      // text
+    SearchByType,       // type name
+    TitlePage,          // text, pageSize, token
+    AuthorPage,         // text, pageSize, token
+    GenrePage,          // text, pageSize, token
+    TypePage,           // type name, pageSize, token
+    FindByIsbn,         // isbn
+    FuzzySearch,        // text, maxDistance, limit, fields
+    FindPatronByCard,   // cardId
+    FindPatronsByName,  // prefix, limit
+    Recommend,          // itemId, limit
+    Count
+};
+
+// Operations that leave the library unchanged, which replays may run concurrently
+constexpr bool isReadOnly(TraceOp op) {
+    return op >= TraceOp::SearchByTitle && op < TraceOp::Count;
+}
+
+/**
+ * One captured operation. offsetUs is wall time since recording began and
+ * clockMs the library clock, in milliseconds since the epoch.
+ */
+struct TraceRecord {
+    int64_t offsetUs = 0;
+    int64_t clockMs = 0;
+    TraceOp op = TraceOp::Count;
+    std::vector<std::string> args;
+};
+
+/**
+ * Appends operations to a compact binary trace file. After an 8-byte
+ * magic and a version byte, each record is the varint wall-time delta, the
+ * zigzag varint library-clock delta, the op byte, a varint argument count
+ * and varint-length-prefixed arguments. Thread-safe.
+ */
+class TraceRecorder {
+public:
+    static constexpr char kMagic[9] = "LMSTRACE";
+    static constexpr uint8_t kVersion = 1;
+    
+private:
+    static constexpr size_t kFlushBytes = 64 * 1024;
+    
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    int64_t lastOffsetUs_ = 0;
+    int64_t lastClockMs_ = 0;
+    uint64_t records_ = 0;
+    
+    static void putVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+    
+    void writeBuffer() {
+        out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        buffer_.clear();
+        if (!out_) throw LibraryException("Cannot write trace");
+    }
+    
+public:
+    explicit TraceRecorder(const std::string& path) : out_(path, std::ios::binary | std::ios::trunc) {
+        if (!out_) throw LibraryException("Cannot create trace: " + path);
+        buffer_.append(kMagic, 8);
+        buffer_ += static_cast<char>(kVersion);
+    }
+    
+    ~TraceRecorder() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+        }
+    }
+    
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    
+    void record(std::chrono::system_clock::time_point clock, TraceOp op, const std::vector<std::string>& args) {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        int64_t offsetUs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        int64_t clockMs = std::chrono::duration_cast<std::chrono::milliseconds>(clock.time_since_epoch()).count();
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Concurrent readers may arrive out of order; keep offsets monotonic
+        offsetUs = std::max(offsetUs, lastOffsetUs_);
+        putVarint(buffer_, static_cast<uint64_t>(offsetUs - lastOffsetUs_));
+        int64_t clockDelta = clockMs - lastClockMs_;
+        putVarint(buffer_, (static_cast<uint64_t>(clockDelta) << 1) ^ static_cast<uint64_t>(clockDelta >> 63));
+        buffer_ += static_cast<char>(op);
+        putVarint(buffer_, args.size());
+        for (const auto& arg : args) {
+            putVarint(buffer_, arg.size());
+            buffer_ += arg;
+        }
+        lastOffsetUs_ = offsetUs;
+        lastClockMs_ = clockMs;
+        ++records_;
+        if (buffer_.size() >= kFlushBytes) writeBuffer();
+    }
+    
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writeBuffer();
+        out_.flush();
+    }
+    
+    uint64_t getRecordCount() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return records_;
+    }
+    
+    // Reads a whole trace; throws on a foreign or truncated file
+    static std::vector<TraceRecord> load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw LibraryException("Cannot open trace: " + path);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (data.size() < 9 || data.compare(0, 8, kMagic) != 0) throw LibraryException("Not a trace file: " + path);
+        if (static_cast<uint8_t>(data[8]) != kVersion) throw LibraryException("Unsupported trace version in " + path);
+        
+        size_t pos = 9;
+        auto varint = [&]() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (pos >= data.size()) throw LibraryException("Truncated trace: " + path);
+                uint8_t byte = static_cast<uint8_t>(data[pos++]);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            throw LibraryException("Corrupt trace: " + path);
+        };
+        
+        std::vector<TraceRecord> records;
+        int64_t offsetUs = 0;
+        int64_t clockMs = 0;
+        while (pos < data.size()) {
+            TraceRecord record;
+            offsetUs += static_cast<int64_t>(varint());
+            uint64_t zigzag = varint();
+            clockMs += static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            record.offsetUs = offsetUs;
+            record.clockMs = clockMs;
+            if (pos >= data.size()) throw LibraryException("Truncated trace: " + path);
+            uint8_t op = static_cast<uint8_t>(data[pos++]);
+            if (op >= static_cast<uint8_t>(TraceOp::Count)) throw LibraryException("Unknown operation in trace: " + path);
+            record.op = static_cast<TraceOp>(op);
+            // Each argument takes at least its length byte
+            uint64_t count = varint();
+            if (count > data.size() - pos) throw LibraryException("Corrupt trace: " + path);
+            record.args.resize(count);
+            for (auto& arg : record.args) {
+                uint64_t length = varint();
+                if (length > data.size() - pos) throw LibraryException("Truncated trace: " + path);
+                arg.assign(data, pos, length);
+                pos += length;
+            }
+            records.push_back(std::move(record));
+        }
+        return records;
+    }
+};
+
+/**
+ * Library class to manage the entire system
+ */
+class Library {
+private:
+    // Items and patrons are held by shared_ptr so Checkout can share ownership
+    // through shared_from_this()
+    std::map<std::string, std::shared_ptr<LibraryItem>> items_;
+    std::map<std::string, std::shared_ptr<LibraryPatron>> patrons_;
+    PatronDirectory directory_;
+    // Patrons registered here on behalf of another library; not in directory_
+    std::set<std::string> guests_;
+    TraceRecorder* traceRecorder_ = nullptr;
+    // Every state change since the last checkpoint; returned loans are not
+    // otherwise retained
+    TransactionJournal journal_;
+    std::unique_ptr<Checkpointer> checkpointer_;
+    uint64_t checkpointEvery_ = 0;
+    // Set while loadCheckpoint rebuilds state, which is not journaled again
+    bool restoring_ = false;
+    CoBorrowIndex recommendations_;
+    CirculationHistory circulation_;
+    std::map<std::string, std::shared_ptr<Checkout>> activeCheckouts_;  // keyed by copy barcode
+    // Active loans ordered by due date, and each patron's active loans
+    std::set<std::pair<EpochDay, std::string>> dueIndex_;
+    std::unordered_map<std::string, std::set<std::string>> patronLoans_;
+    int maxRenewals_ = 2;
+    // Copy barcode -> owning item and copy index
+    std::unordered_map<std::string, std::pair<LibraryItem*, size_t>> copies_;
+    CompiledFinePolicy finePolicy_;
+    // Shared by the branches of a BranchRouter, so fines follow the patron
+    std::shared_ptr<FineLedger> ledger_ = std::make_shared<FineLedger>();
+    HoldManager holds_;
+    std::shared_ptr<LibraryClock> clock_ = std::make_shared<SystemClock>();
+    StatsCollector stats_;
+    // Observer chain for items: snapshots_ -> replicationTap_ -> stats_;
+    // patrons report to replicationTap_
+    ReplicationTap replicationTap_{&stats_};
+    SnapshotPublisher snapshots_{&replicationTap_};
+    mutable LibraryMetrics metrics_;
+    // Items of each kind ordered by ID; backs typeIs queries
+    std::array<std::map<std::string, const LibraryItem*>, kItemKindCount> typeIndex_;
+    // Title key (see titleKey) -> item; backs title-ordered queries and paging
+    std::map<std::string, const LibraryItem*> titleIndex_;
+    // The same per kind, so a title-ordered typeIs page reads only its kind
+    std::array<std::map<std::string, const LibraryItem*>, kItemKindCount> typeTitleIndex_;
+    FuzzyIndex fuzzyIndex_;
+    // Packed ISBN-13 -> items with that ISBN (several editions or records)
+    std::unordered_map<uint64_t, std::vector<const LibraryItem*>> isbnIndex_;
+    // Sorted secondary indexes for range queries; items with unknown dates
+    // are left out
+    std::multimap<int64_t, const LibraryItem*> releaseIndex_;
+    std::multimap<int64_t, const LibraryItem*> durationIndex_;
+    std::multimap<int64_t, const LibraryItem*> publicationIndex_;
+    
+    // Scan specialised on the predicate type, so simple searches avoid an
+    // indirect call per item
+    template<typename Predicate>
+    std::vector<const LibraryItem*> scanItems(const Predicate& predicate) const {
+        std::vector<const LibraryItem*> results;
+        for (const auto& pair : items_) {
+            if (predicate(*pair.second)) {
+                results.push_back(pair.second.get());
+            }
+        }
+        return results;
+    }
+    
+    // Plans and runs a query, starting after afterKey (an ID, or a title key
+    // when sorted by title) if it is non-empty
+    QueryResult runQuery(const ItemQuery& itemQuery, const std::string& afterKey) const {
+        auto predicate = std::make_shared<const CompiledItemPredicate>(itemQuery);
+        const ItemQuery::Node& root = itemQuery.getRoot();
+        size_t limit = itemQuery.getLimit();
+        
+        if (root.op == ItemQuery::Op::Equals && root.field == ItemField::Id) {
+            std::vector<const LibraryItem*> match;
+            auto it = items_.find(root.value);
+            if (it != items_.end() && limit > 0 && afterKey.empty()) match.push_back(it->second.get());
+            return QueryResult(std::move(match), "point lookup on ID");
+        }
+        
+        std::vector<const ItemQuery::Node*> ranges;
+        findRangeConstraints(root, ranges);
+        if (!ranges.empty()) {
+            return runRangeQuery(itemQuery, *predicate, ranges, afterKey);
+        }
+        
+        bool byTitle = itemQuery.getSortKey() == ItemQuery::SortKey::Title;
+        if (const ItemQuery::Node* type = findTypeConstraint(root)) {
+            static const std::map<std::string, const LibraryItem*> kNoItems;
+            const ItemTypeSpec* spec = findItemType(type->value);
+            const auto& indexes = byTitle ? typeTitleIndex_ : typeIndex_;
+            const auto& bucket = spec ? indexes[static_cast<size_t>(spec->kind)] : kNoItems;
+            auto first = afterKey.empty() ? bucket.begin() : bucket.upper_bound(afterKey);
+            return QueryResult(QueryResult::Range<QueryResult::IndexIterator>{first, bucket.end()},
+                               std::move(predicate), limit,
+                               (byTitle ? "type title index on " : "type index on ") + type->value);
+        }
+        
+        if (byTitle) {
+            auto first = afterKey.empty() ? titleIndex_.begin() : titleIndex_.upper_bound(afterKey);
+            return QueryResult(QueryResult::Range<QueryResult::IndexIterator>{first, titleIndex_.end()},
+                               std::move(predicate), limit, "title index scan");
+        }
+        
+        auto first = afterKey.empty() ? items_.begin() : items_.upper_bound(afterKey);
+        return QueryResult(QueryResult::Range<QueryResult::CatalogIterator>{first, items_.end()},
+                           std::move(predicate), limit, "catalog scan");
+    }
+    
+    const std::multimap<int64_t, const LibraryItem*>& rangeIndex(ItemField field) const {
+        switch (field) {
+            case ItemField::ReleaseDay: return releaseIndex_;
+            case ItemField::PublicationDay: return publicationIndex_;
+            default: return durationIndex_;
+        }
+    }
+    
+    std::multimap<int64_t, const LibraryItem*>& rangeIndex(ItemField field) {
+        switch (field) {
+            case ItemField::ReleaseDay: return releaseIndex_;
+            case ItemField::PublicationDay: return publicationIndex_;
+            default: return durationIndex_;
+        }
+    }
+    
+    /**
+     * Range-index access path: scans the narrowest indexed range, filters it,
+     * then orders the matches by ID or title so paging tokens still apply.
+     * Costs O(log n + k log k) for k items in the range.
+     */
+    QueryResult runRangeQuery(const ItemQuery& itemQuery, const CompiledItemPredicate& predicate,
+                              const std::vector<const ItemQuery::Node*>& ranges, const std::string& afterKey) const {
+        using IndexIterator = std::multimap<int64_t, const LibraryItem*>::const_iterator;
+        IndexIterator first, last;
+        const ItemQuery::Node* chosen = nullptr;
+        size_t narrowest = std::numeric_limits<size_t>::max();
+        for (const ItemQuery::Node* range : ranges) {
+            const auto& index = rangeIndex(range->field);
+            IndexIterator lower = index.lower_bound(range->low);
+            IndexIterator upper = index.upper_bound(range->high);
+            if (range->low > range->high) upper = lower;
+            // Stop counting once the range is wider than the best so far
+            size_t count = 0;
+            for (IndexIterator it = lower; it != upper && count < narrowest; ++it) ++count;
+            if (count < narrowest) {
+                narrowest = count;
+                first = lower;
+                last = upper;
+                chosen = range;
+            }
+        }
+        
+        bool byTitle = itemQuery.getSortKey() == ItemQuery::SortKey::Title;
+        std::vector<std::pair<std::string, const LibraryItem*>> matches;
+        for (IndexIterator it = first; it != last; ++it) {
+            if (!predicate(*it->second)) continue;
+            std::string key = byTitle ? titleKey(*it->second) : it->second->getId();
+            if (!afterKey.empty() && key <= afterKey) continue;
+            matches.emplace_back(std::move(key), it->second);
+        }
+        
+        size_t keep = std::min(itemQuery.getLimit(), matches.size());
+        std::partial_sort(matches.begin(), matches.begin() + keep, matches.end());
+        std::vector<const LibraryItem*> items;
+        items.reserve(keep);
+        for (size_t i = 0; i < keep; ++i) items.push_back(matches[i].second);
+        
+        const char* name = chosen->field == ItemField::ReleaseDay ? "release date"
+                         : chosen->field == ItemField::PublicationDay ? "publication date" : "duration";
+        return QueryResult(std::move(items), std::string("range index on ") + name);
+    }
+    
+    // Range constraints reachable from the root through ANDs only
+    static void findRangeConstraints(const ItemQuery::Node& node, std::vector<const ItemQuery::Node*>& out) {
+        if (node.op == ItemQuery::Op::Between) {
+            out.push_back(&node);
+        } else if (node.op == ItemQuery::Op::And) {
+            for (const auto& child : node.children) findRangeConstraints(*child, out);
+        }
+    }
+    
+    // Type equality reachable from the root through ANDs only, or nullptr
+    static const ItemQuery::Node* findTypeConstraint(const ItemQuery::Node& node) {
+        if (node.op == ItemQuery::Op::Equals && node.field == ItemField::Type) return &node;
+        if (node.op != ItemQuery::Op::And) return nullptr;
+        for (const auto& child : node.children) {
+            if (const ItemQuery::Node* found = findTypeConstraint(*child)) return found;
+        }
+        return nullptr;
+    }
+    
+    LibraryItem* findItemById(const std::string& id) {
+        auto it = items_.find(id);
+        if (it != items_.end()) {
+            return it->second.get();
+        }
+        return nullptr;
+    }
+    
+    LibraryPatron* findPatronById(const std::string& id) {
+        auto it = patrons_.find(id);
+        if (it != patrons_.end()) {
+            return it->second.get();
+        }
+        return nullptr;
+    }
+    
+    // Why a loan cannot be renewed right now, or nullptr if it can
+    const char* renewalBlocker(const Checkout& checkout, EpochDay today) const {
+        if (checkout.isOverdue(today)) return "Loan is overdue";
+        if (checkout.getRenewalCount() >= maxRenewals_) return "Renewal limit reached";
+        if (holds_.hasWaitingHolds(checkout.getItem()->getId())) return "Other patrons are waiting for this item";
+        if (ledger_->isBlocked(checkout.getPatron()->getId())) return "Patron has outstanding fines";
+        return nullptr;
+    }
+    
+    // Indexes a loan whose copy has just been checked out
+    void openLoan(const std::shared_ptr<Checkout>& checkout) {
+        const std::string& patronId = checkout->getPatron()->getId();
+        activeCheckouts_[checkout->getCopyBarcode()] = checkout;
+        dueIndex_.emplace(checkout->getDueDay(), checkout->getCopyBarcode());
+        patronLoans_[patronId].insert(checkout->getCopyBarcode());
+        stats_.onLoanOpened(*checkout);
+        snapshots_.publishLoan(*checkout, finePolicy_);
+    }
+    
+    // Adds the circulation report row for a loan of item's copy
+    void recordCirculation(const std::string& barcode, const LibraryItem& item, const LibraryPatron& patron, EpochDay day) {
+        // The history keeps one genre per item, so only look it up once
+        std::string genre = circulation_.hasItem(item.getId()) ? std::string() : itemGenre(item);
+        circulation_.recordCheckout(barcode, item.getId(), item.getKind(), genre, patron.getKind(), day);
+    }
+    
+    // Items of the registry types select accepts whose search key contains needle, in ID order
+    template<typename Select>
+    std::vector<const LibraryItem*> scanKinds(Select select, SearchKeys::Field field, const std::string& needle) const {
+        std::vector<const LibraryItem*> results;
+        size_t kinds = 0;
+        for (const auto& spec : kItemTypes) {
+            if (!select(spec)) continue;
+            ++kinds;
+            for (const auto& pair : typeIndex_[static_cast<size_t>(spec.kind)]) {
+                if (pair.second->getSearchKeys().contains(field, needle)) results.push_back(pair.second);
+            }
+        }
+        // Each type's bucket is already in ID order
+        if (kinds > 1) {
+            std::sort(results.begin(), results.end(),
+                      [](const LibraryItem* a, const LibraryItem* b) { return a->getId() < b->getId(); });
+        }
+        return results;
+    }
+    
+    // Calls func with every journaled record once, oldest first: archived
+    // segments, then those of failed checkpoints, then the resident journal
+    template<typename Func>
+    void forEachJournaled(Func func) const {
+        // A failed checkpoint may have archived some of its segments before
+        // failing, so the same record can be read from two places
+        uint64_t last = 0;
+        auto visit = [&func, &last](const std::vector<std::string>& record) {
+            uint64_t sequence = journalSequence(record);
+            if (sequence <= last) return;
+            last = sequence;
+            func(record);
+        };
+        if (checkpointer_) {
+            // Segments handed to the checkpointer are in neither place until written
+            checkpointer_->flush();
+            for (const auto& archive : Checkpointer::listSequenceFiles(checkpointer_->getDirectory(), "journal-")) {
+                std::ifstream in(archive.second);
+                std::string line;
+                while (std::getline(in, line)) visit(LogCodec::split(line));
+            }
+            checkpointer_->forEachUnwritten(visit);
+        }
+        journal_.forEach(visit);
+    }
+    
+    // Sequence number of a journal record, from its "TXN<n>" ID
+    static uint64_t journalSequence(const std::vector<std::string>& record) {
+        return record[0].size() > 3 ? std::strtoull(record[0].c_str() + 3, nullptr, 10) : 0;
+    }
+    
+    void registerPatron(std::unique_ptr<LibraryPatron> patron, bool guest) {
+        auto existing = patrons_.find(patron->getId());
+        if (existing != patrons_.end()) {
+            // Re-registering replaces the old record
+            existing->second->setObserver(nullptr);
+            stats_.onPatronRemoved(*existing->second);
+            directory_.remove(*existing->second);
+        }
+        stats_.onPatronAdded(*patron);
+        replicationTap_.append(ReplicationRecord::Kind::Patron, LogCodec::encodePatron(*patron));
+        patron->setObserver(&replicationTap_);
+        if (guest) {
+            guests_.insert(patron->getId());
+        } else {
+            guests_.erase(patron->getId());
+            directory_.add(*patron);
+        }
+        journal(clock_->now(), guest ? "AddGuestPatron" : "AddPatron", LogCodec::encodePatron(*patron));
+        patrons_[patron->getId()] = std::move(patron);
+    }
+    
+    /**
+     * Journals one state change as transactionId, time, type, then fields,
+     * and appends it to the checkpointer's live tail. Returns the sequence
+     * number, or 0 while a checkpoint is being loaded.
+     */
+    uint64_t journal(std::chrono::system_clock::time_point at, const std::string& type, std::vector<std::string> fields) {
+        if (restoring_) return 0;
+        uint64_t sequence = journal_.getLastSequence() + 1;
+        fields.insert(fields.begin(), {"TXN" + std::to_string(sequence), LogCodec::encodeTime(at), type});
+        std::string line = LogCodec::join(fields);
+        if (checkpointer_) checkpointer_->appendTail(sequence, line);
+        return journal_.append(std::move(line));
+    }
+    
+    // Checkouts, returns and renewals: barcode, itemId, title, patronId, patronName, detail
+    void journal(Transaction& transaction, const Checkout& checkout, const std::string& detail) {
+        uint64_t sequence = journal(transaction.getTimestamp(), transaction.getTransactionType(), loanFields(checkout, detail));
+        if (sequence != 0) transaction.assignTransactionId(sequence);
+    }
+    
+    static std::vector<std::string> loanFields(const Checkout& checkout, const std::string& detail) {
+        return {checkout.getCopyBarcode(), checkout.getItem()->getId(), checkout.getItem()->getTitle(),
+                checkout.getPatron()->getId(), checkout.getPatron()->getName(), detail};
+    }
+    
+    // Operations expire holds lazily before they run. Expiry is journaled on
+    // its own, as it stands even if the operation then fails.
+    size_t expireHolds(std::chrono::system_clock::time_point now) {
+        size_t expired = holds_.expire(now);
+        if (expired > 0) journal(now, "ExpireHolds", {std::to_string(expired)});
+        return expired;
+    }
+    
+    // Arguments are only converted when a recorder is attached
+    template<typename... Args>
+    void trace(TraceOp op, const Args&... args) const {
+        if (traceRecorder_) traceRecorder_->record(clock_->now(), op, {traceField(args)...});
+    }
+    
+    static const std::string& traceField(const std::string& text) { return text; }
+    static std::string traceField(const char* text) { return text; }
+    template<typename Number, typename = std::enable_if_t<std::is_arithmetic<Number>::value>>
+    static std::string traceField(Number value) { return std::to_string(value); }
+    
+    // Called once an operation has finished updating state
+    void maybeCheckpoint() {
+        if (checkpointer_ && !restoring_ && checkpointEvery_ > 0 && journal_.getRecordsSinceCheckpoint() >= checkpointEvery_) {
+            checkpoint();
+        }
+    }
+    
+    // Full state as checkpoint lines: catalog, copies, patrons, open loans,
+    // fine accounts and holds, then the order free copies are handed out in
+    std::vector<std::string> buildCheckpointImage() const {
+        std::vector<std::string> image;
+        image.push_back(LogCodec::join({"checkpoint", std::to_string(journal_.getLastSequence())}));
+        for (const auto& pair : items_) {
+            const LibraryItem& item = *pair.second;
+            std::vector<std::string> fields = LogCodec::encodeItem(item);
+            fields.insert(fields.begin(), "item");
+            image.push_back(LogCodec::join(fields));
+            for (size_t i = 1; i < item.getCopyCount(); ++i) {
+                image.push_back(LogCodec::join({"copy", item.getId(), item.getCopyBarcode(i)}));
+            }
+        }
+        for (const auto& pair : patrons_) {
+            std::vector<std::string> fields = LogCodec::encodePatron(*pair.second);
+            fields.insert(fields.begin(), isGuest(pair.first) ? "guest" : "patron");
+            image.push_back(LogCodec::join(fields));
+        }
+        for (const auto& pair : activeCheckouts_) {
+            const Checkout& checkout = *pair.second;
+            image.push_back(LogCodec::join({"loan", pair.first, checkout.getPatron()->getId(),
+                                            std::to_string(checkout.getCheckoutDay()), std::to_string(checkout.getDueDay()),
+                                            std::to_string(checkout.getRenewalCount())}));
+        }
+        ledger_->forEachAccount([&image](const std::string& patronId, int64_t chargedCents, int64_t paidCents) {
+            image.push_back(LogCodec::join({"account", patronId, std::to_string(chargedCents), std::to_string(paidCents)}));
+        });
+        for (const auto& pair : items_) {
+            for (const HoldManager::Hold* hold : holds_.getHolds(*pair.second)) {
+                image.push_back(LogCodec::join({"hold", std::to_string(hold->holdId), pair.first, hold->patron->getId(),
+                                                LogCodec::encodeTime(hold->placedAt), LogCodec::encodeTime(hold->expiresAt),
+                                                hold->ready ? "1" : "0", std::to_string(hold->copyIndex)}));
+            }
+        }
+        image.push_back(LogCodec::join({"holds", std::to_string(holds_.getNextHoldId())}));
+        for (const auto& pair : items_) {
+            const std::vector<size_t>& free = pair.second->getFreeCopies();
+            if (free.size() < 2) continue;
+            std::vector<std::string> fields = {"free", pair.first};
+            for (size_t copyIndex : free) fields.push_back(std::to_string(copyIndex));
+            image.push_back(LogCodec::join(fields));
+        }
+        return image;
+    }
+    
+    void renewLoan(const std::shared_ptr<Checkout>& checkout) {
+        EpochDay oldDueDay = checkout->getDueDay();
+        dueIndex_.erase({oldDueDay, checkout->getCopyBarcode()});
+        checkout->renew(checkout->getPatron()->getLoanExtensionDays());
+        dueIndex_.emplace(checkout->getDueDay(), checkout->getCopyBarcode());
+        stats_.onLoanDueChanged(oldDueDay, checkout->getDueDay());
+        snapshots_.publishLoan(*checkout, finePolicy_);
+    }
+    
+public:
+    Library() = default;
+    
+    ~Library() {
+        // Checkouts handed out to callers may outlive the library
+        for (auto& pair : items_) pair.second->setObserver(nullptr);
+        for (auto& pair : patrons_) pair.second->setObserver(nullptr);
+    }
+    
+    void addItem(std::unique_ptr<LibraryItem> item) {
+        if (!item) {
+            throw LibraryException("Cannot add null item");
+        }
+        if (traceRecorder_) traceRecorder_->record(clock_->now(), TraceOp::AddItem, LogCodec::encodeItem(*item));
+        if (items_.count(item->getId()) || copies_.count(item->getId())) {
+            throw LibraryException("Item ID already in use: " + item->getId());
+        }
+        // Items constructed directly rather than through createItem are checked here
+        const ItemTypeSpec& spec = itemTypeSpec(item->getKind());
+        FieldValues fields = itemFieldValues(*item);
+        checkFields(spec.name, spec.fields, fields);
+        for (size_t i = 0; i < item->getCopyCount(); ++i) {
+            copies_[item->getCopyBarcode(i)] = {item.get(), i};
+        }
+        item->setSearchKeys(buildSearchKeys(*item));
+        stats_.onItemAdded(*item);
+        snapshots_.publishItem(*item);
+        replicationTap_.append(ReplicationRecord::Kind::Item, LogCodec::encodeItem(*item));
+        item->setObserver(&snapshots_);
+        typeIndex_[static_cast<size_t>(item->getKind())][item->getId()] = item.get();
+        titleIndex_[titleKey(*item)] = item.get();
+        typeTitleIndex_[static_cast<size_t>(item->getKind())][titleKey(*item)] = item.get();
+        fuzzyIndex_.add(*item);
+        // ISBN and range fields are indexed as the registry declares them;
+        // values that are blank or unknown are left out
+        for (size_t i = 0; i < spec.fields.size(); ++i) {
+            const FieldSpec& field = spec.fields[i];
+            if (field.input == FieldInput::Isbn) {
+                uint64_t key = Isbn::parse(fields[i]);
+                if (key != Isbn::kInvalid) isbnIndex_[key].push_back(item.get());
+            } else if (field.rangeField != ItemField::Id) {
+                int64_t value = rangeFieldValue(field, fields[i]);
+                if (value != kUnknownDay) rangeIndex(field.rangeField).emplace(value, item.get());
+            }
+        }
+        journal(clock_->now(), "AddItem", LogCodec::encodeItem(*item));
+        items_[item->getId()] = std::move(item);
+        maybeCheckpoint();
+    }
+    
+    /**
+     * Streams catalog, copy availability and patron changes to the log
+     * (nullptr detaches). Loans are not replicated; replicas serve searches.
+     */
+    void setReplicationLog(ReplicationLog* log) {
+        replicationTap_.setLog(log);
+    }
+    
+    // Current catalog, copies and patrons as replication records
+    std::vector<ReplicationRecord> replicationImage() const {
+        std::vector<ReplicationRecord> image;
+        auto add = [&image](ReplicationRecord::Kind kind, std::vector<std::string> fields) {
+            image.emplace_back();
+            image.back().kind = kind;
+            image.back().fields = std::move(fields);
+        };
+        for (const auto& pair : items_) {
+            const LibraryItem& item = *pair.second;
+            add(ReplicationRecord::Kind::Item, LogCodec::encodeItem(item));
+            for (size_t i = 1; i < item.getCopyCount(); ++i) add(ReplicationRecord::Kind::Copy, {item.getId(), item.getCopyBarcode(i)});
+            add(ReplicationRecord::Kind::CopyStatus, {item.getId(), LogCodec::encodeCopyStatus(item)});
+        }
+        for (const auto& pair : patrons_) add(ReplicationRecord::Kind::Patron, LogCodec::encodePatron(*pair.second));
+        return image;
+    }
+    
+    /**
+     * A channel for a new replica: an image of the current state, then every
+     * later change. Call from the thread that mutates the library, so no
+     * change falls between the image and the subscription.
+     */
+    std::shared_ptr<ReplicationChannel> subscribeReplica() const {
+        ReplicationLog* log = replicationTap_.getLog();
+        if (!log) throw LibraryException("No replication log attached");
+        return log->subscribe(replicationImage());
+    }
+    
+    /**
+     * Records every later operation to the trace (nullptr detaches).
+     * Attaching first records the current catalog, copies, patrons and open
+     * loans, so a replay into an empty library starts from the same state;
+     * fine balances and holds are not carried over.
+     */
+    void setTraceRecorder(TraceRecorder* recorder) {
+        traceRecorder_ = recorder;
+        if (!recorder) return;
+        for (const auto& pair : items_) {
+            const LibraryItem& item = *pair.second;
+            recorder->record(clock_->now(), TraceOp::AddItem, LogCodec::encodeItem(item));
+            for (size_t i = 1; i < item.getCopyCount(); ++i) trace(TraceOp::AddCopy, item.getId(), item.getCopyBarcode(i));
+        }
+        // Loans are reopened below, which needs the patron active
+        for (const auto& pair : patrons_) {
+            std::vector<std::string> fields = LogCodec::encodePatron(*pair.second);
+            fields.back() = "1";
+            recorder->record(clock_->now(), TraceOp::AddPatron, fields);
+        }
+        for (const auto& pair : activeCheckouts_) {
+            const Checkout& checkout = *pair.second;
+            trace(TraceOp::RestoreLoan, pair.first, checkout.getPatron()->getId(), checkout.getCheckoutDay(),
+                  checkout.getDueDay(), checkout.getRenewalCount());
+        }
+        for (const auto& pair : patrons_) {
+            if (!pair.second->isActive()) trace(TraceOp::SetPatronActive, pair.first, "0");
+        }
+    }
+    
+    /**
+     * Sets each copy's availability from a status string ("1" on the shelf,
+     * "0" out). For replicas applying a primary's log; bypasses circulation.
+     */
+    void applyCopyStatus(const std::string& itemId, const std::string& status) {
+        LibraryItem* item = findItemById(itemId);
+        if (!item) throw ItemNotFoundException(itemId);
+        for (size_t i = 0; i < item->getCopyCount() && i < status.size(); ++i) {
+            bool available = status[i] == '1';
+            if (available == item->getCopies()[i].available) continue;
+            if (available) item->returnItem(i);
+            else item->checkOut(i);
+        }
+    }
+    
+    // Adds a physical copy of an existing item; generates a barcode if none is given
+    std::string addCopy(const std::string& itemId, std::string barcode = "") {
+        trace(TraceOp::AddCopy, itemId, barcode);
+        LibraryItem* item = findItemById(itemId);
+        if (!item) throw ItemNotFoundException(itemId);
+        
+        if (barcode.empty()) {
+            size_t n = item->getCopyCount() + 1;
+            do {
+                barcode = itemId + "-" + std::to_string(n++);
+            } while (copies_.count(barcode) || items_.count(barcode));
+        } else if (copies_.count(barcode) || items_.count(barcode)) {
+            throw LibraryException("Barcode already in use: " + barcode);
+        }
+        
+        stats_.onCopyAdded();
+        replicationTap_.append(ReplicationRecord::Kind::Copy, {itemId, barcode});
+        size_t copyIndex = item->addCopy(barcode);
+        copies_[barcode] = {item, copyIndex};
+        auto now = clock_->now();
+        holds_.allocate(*item, now);
+        journal(now, "AddCopy", {itemId, barcode});
+        maybeCheckpoint();
+        return barcode;
+    }
+    
+    void addPatron(std::unique_ptr<LibraryPatron> patron) {
+        if (!patron) {
+            throw LibraryException("Cannot add null patron");
+        }
+        if (traceRecorder_) traceRecorder_->record(clock_->now(), TraceOp::AddPatron, LogCodec::encodePatron(*patron));
+        const LibraryPatron* cardHolder = directory_.findByCard(PatronDirectory::cardOf(*patron));
+        if (cardHolder && cardHolder->getId() != patron->getId()) {
+            throw LibraryException("Card " + PatronDirectory::cardOf(*patron) +
+                                   " already belongs to patron " + cardHolder->getId());
+        }
+        registerPatron(std::move(patron), false);
+        maybeCheckpoint();
+    }
+    
+    /**
+     * Registers a patron whose home is another library, so they can borrow
+     * and place holds here. Card and name lookups only cover this library's
+     * own patrons, so a guest's card is not checked or indexed. Adding the
+     * same ID again replaces the guest record.
+     */
+    void addGuestPatron(std::unique_ptr<LibraryPatron> patron) {
+        if (!patron) {
+            throw LibraryException("Cannot add null patron");
+        }
+        if (traceRecorder_) traceRecorder_->record(clock_->now(), TraceOp::AddPatron, LogCodec::encodePatron(*patron));
+        registerPatron(std::move(patron), true);
+        maybeCheckpoint();
+    }
+    
+    bool isGuest(const std::string& patronId) const { return guests_.count(patronId) != 0; }
+    
+    const LibraryItem* findItem(const std::string& id) const {
+        auto it = items_.find(id);
+        if (it != items_.end()) {
+            return it->second.get();
+        }
+        throw ItemNotFoundException(id);
+    }
+    
+    const LibraryPatron* findPatron(const std::string& id) const {
+        auto it = patrons_.find(id);
+        if (it != patrons_.end()) {
+            return it->second.get();
+        }
+        throw PatronNotFoundException(id);
+    }
+    
+    // Patron holding a student or employee ID card; case and surrounding spaces are ignored
+    const LibraryPatron* findPatronByCard(const std::string& cardId) const {
+        trace(TraceOp::FindPatronByCard, cardId);
+        ScopedLatency timer(metrics_, LibraryOperation::FindPatronByCard);
+        const LibraryPatron* patron = directory_.findByCard(cardId);
+        if (!patron) throw PatronNotFoundException(cardId);
+        return patron;
+    }
+    
+    // Patrons with a name word starting with prefix, for autocompletion
+    std::vector<const LibraryPatron*> findPatronsByName(const std::string& prefix, size_t limit = 10) const {
+        trace(TraceOp::FindPatronsByName, prefix, limit);
+        ScopedLatency timer(metrics_, LibraryOperation::FindPatronsByName);
+        return directory_.findByNamePrefix(prefix, limit);
+    }
+    
+    // Accepts an item ID (any available copy) or a copy barcode (that copy)
+    std::shared_ptr<Checkout> checkoutItem(const std::string& itemId, const std::string& patronId) {
+        trace(TraceOp::Checkout, itemId, patronId);
+        ScopedLatency timer(metrics_, LibraryOperation::Checkout);
+        LibraryItem* itemPtr = findItemById(itemId);
+        LibraryPatron* patronPtr = findPatronById(patronId);
+        size_t copyIndex = LibraryItem::kAnyCopy;
+        if (!itemPtr) {
+            auto copy = copies_.find(itemId);
+            if (copy != copies_.end()) {
+                itemPtr = copy->second.first;
+                copyIndex = copy->second.second;
+            }
+        }
+        
+        if (!itemPtr) throw ItemNotFoundException(itemId);
+        if (!patronPtr) throw PatronNotFoundException(patronId);
+        if (!patronPtr->isActive()) throw CheckoutException("Patron is not active");
+        if (ledger_->isBlocked(patronId)) {
+            std::stringstream ss;
+            ss << "Patron owes $" << std::fixed << std::setprecision(2) << ledger_->getBalance(patronId)
+               << " in fines (limit $" << ledger_->getBlockThreshold() << ")";
+            throw CheckoutException(ss.str());
+        }
+        auto loans = patronLoans_.find(patronId);
+        if (loans != patronLoans_.end() && loans->second.size() >= static_cast<size_t>(patronPtr->getMaxBorrowItems())) {
+            throw CheckoutException("Patron has reached the limit of " +
+                                    std::to_string(patronPtr->getMaxBorrowItems()) + " items");
+        }
+        
+        auto checkout = checkoutCopy(*itemPtr, copyIndex, *patronPtr);
+        maybeCheckpoint();
+        return checkout;
+    }
+    
+private:
+    // checkoutItem once the patron may borrow; journal replays start here
+    // with the copy the original checkout took
+    std::shared_ptr<Checkout> checkoutCopy(LibraryItem& item, size_t copyIndex, LibraryPatron& patron) {
+        const std::string& patronId = patron.getId();
+        auto now = clock_->now();
+        // Snapshots see the hold hand-over, copy and loan change together
+        auto batch = snapshots_.batch();
+        expireHolds(now);
+        
+        // A copy waiting on the hold shelf for this patron is handed over.
+        // A different copy asked for by barcode must be on the shelf before
+        // the hold is given up, or the patron would lose both.
+        size_t heldCopy = holds_.heldCopy(item.getId(), patronId);
+        if (copyIndex != LibraryItem::kAnyCopy && copyIndex != heldCopy &&
+            !item.getCopies()[copyIndex].available) {
+            throw CheckoutException("Item is not available");
+        }
+        if (heldCopy != LibraryItem::kAnyCopy) {
+            holds_.claim(item.getId(), patronId);
+            if (copyIndex == LibraryItem::kAnyCopy) {
+                copyIndex = heldCopy;
+            } else if (copyIndex != heldCopy) {
+                holds_.allocate(item, now);
+            }
+        }
+        
+        auto sharedItem = item.shared_from_this();
+        auto sharedPatron = patron.shared_from_this();
+        
+        auto checkout = std::make_shared<Checkout>(sharedItem, sharedPatron, item.getMaxLoanDays(), copyIndex, now);
+        openLoan(checkout);
+        recommendations_.recordBorrow(patronId, item.getId());
+        recordCirculation(checkout->getCopyBarcode(), item, patron, checkout->getCheckoutDay());
+        journal(*checkout, *checkout, std::to_string(checkout->getDueDay()));
+        
+        return checkout;
+    }
+    
+public:
+    
+    // Accepts a copy barcode, or an item ID when any copy of it is out
+    std::shared_ptr<Return> returnItem(const std::string& itemId) {
+        trace(TraceOp::Return, itemId);
+        ScopedLatency timer(metrics_, LibraryOperation::Return);
+        auto it = activeCheckouts_.find(itemId);
+        if (it == activeCheckouts_.end()) {
+            if (const LibraryItem* item = findItemById(itemId)) {
+                for (const auto& copy : item->getCopies()) {
+                    if (!copy.available) {
+                        it = activeCheckouts_.find(copy.barcode);
+                        if (it != activeCheckouts_.end()) break;
+                    }
+                }
+            }
+        }
+        if (it == activeCheckouts_.end()) {
+            throw ReturnException("No active checkout for item: " + itemId);
+        }
+        
+        auto now = clock_->now();
+        auto batch = snapshots_.batch();
+        double fine = finePolicy_.fineFor(*it->second, LibraryClock::toEpochDay(now));
+        auto ret = std::make_shared<Return>(it->second, fine, now);
+        ledger_->charge(it->second->getPatron()->getId(), fine);
+        journal(*ret, *it->second, std::to_string(fine));
+        circulation_.recordReturn(it->first, LibraryClock::toEpochDay(now), fine);
+        dueIndex_.erase({it->second->getDueDay(), it->first});
+        auto loans = patronLoans_.find(it->second->getPatron()->getId());
+        loans->second.erase(it->first);
+        if (loans->second.empty()) patronLoans_.erase(loans);
+        stats_.onLoanClosed(*it->second);
+        snapshots_.removeLoan(it->first);
+        activeCheckouts_.erase(it);
+        
+        expireHolds(now);
+        holds_.allocate(*ret->getCheckout()->getItem(), now);
+        maybeCheckpoint();
+        
+        return ret;
+    }
+    
+    std::vector<const LibraryItem*> searchItemsByTitle(const std::string& title) const {
+        trace(TraceOp::SearchByTitle, title);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByTitle);
+        std::string needle = TextNormalizer::normalize(title);
+        return scanItems([&needle](const LibraryItem& item) {
+            return item.getSearchKeys().contains(SearchKeys::Title, needle);
+        });
+    }
+    
+    // Types whose creator is an author
+    std::vector<const LibraryItem*> searchItemsByAuthor(const std::string& author) const {
+        trace(TraceOp::SearchByAuthor, author);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByAuthor);
+        return scanKinds([](const ItemTypeSpec& spec) { return spec.creator == CreatorRole::Author; },
+                         SearchKeys::Creator, TextNormalizer::normalize(author));
+    }
+    
+    // Types with a genre field
+    std::vector<const LibraryItem*> searchItemsByGenre(const std::string& genre) const {
+        trace(TraceOp::SearchByGenre, genre);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByGenre);
+        return scanKinds([](const ItemTypeSpec& spec) { return spec.genreField >= 0; },
+                         SearchKeys::Genre, TextNormalizer::normalize(genre));
+    }
+    
+    std::vector<const LibraryItem*> searchItemsByType(const std::string& type) const {
+        trace(TraceOp::SearchByType, type);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByType);
+        std::vector<const LibraryItem*> results;
+        const ItemTypeSpec* spec = findItemType(type);
+        if (!spec) return results;
+        const auto& bucket = typeIndex_[static_cast<size_t>(spec->kind)];
+        results.reserve(bucket.size());
+        for (const auto& pair : bucket) {
+            results.push_back(pair.second);
+        }
+        return results;
+    }
+    
+    std::vector<const LibraryItem*> searchItems(const std::function<bool(const LibraryItem&)>& predicate) const {
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByPredicate);
+        return scanItems(predicate);
+    }
+    
+    // Key of the title index: title, then ID to keep equal titles distinct
+    static std::string titleKey(const LibraryItem& item) {
+        return item.getTitle() + '\0' + item.getId();
+    }
+    
+    /**
+     * How well a normalised title matches a normalised needle: 0 exact,
+     * 1 prefix, 2 word prefix, 3 substring, or -1 for no match
+     */
+    static int titleMatchScore(std::string_view title, std::string_view needle) {
+        size_t pos = title.find(needle);
+        if (pos == std::string_view::npos) return -1;
+        if (title.size() == needle.size()) return 0;
+        if (pos == 0) return 1;
+        if (title[pos - 1] == ' ') return 2;
+        return 3;
+    }
+    
+    /**
+     * Runs a composable query. The planner uses a point lookup for an ID
+     * equality at the root, the type index when a type equality is ANDed in,
+     * the title index for title order, and otherwise a compiled scan of the
+     * catalog. Results are filtered lazily as the caller iterates.
+     */
+    QueryResult query(const ItemQuery& itemQuery) const {
+        ScopedLatency timer(metrics_, LibraryOperation::Query);
+        return runQuery(itemQuery, "");
+    }
+    
+    /**
+     * Returns one page of query results. Pass the previous page's nextToken
+     * to continue; tokens stay valid when items are added in between.
+     */
+    SearchPage queryPage(const ItemQuery& itemQuery, size_t pageSize, const std::string& token = "") const {
+        ScopedLatency timer(metrics_, LibraryOperation::Query);
+        return runQueryPage(itemQuery, pageSize, token);
+    }
+    
+    // The paged searches are timed under their own operations, not Query
+    SearchPage searchItemsByTitle(const std::string& title, size_t pageSize, const std::string& token = "") const {
+        trace(TraceOp::TitlePage, title, pageSize, token);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByTitle);
+        return runQueryPage(ItemQuery::titleContains(title).sortBy(ItemQuery::SortKey::Title), pageSize, token);
+    }
+    
+    SearchPage searchItemsByAuthor(const std::string& author, size_t pageSize, const std::string& token = "") const {
+        trace(TraceOp::AuthorPage, author, pageSize, token);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByAuthor);
+        return runQueryPage(ItemQuery::authorContains(author).sortBy(ItemQuery::SortKey::Title), pageSize, token);
+    }
+    
+    SearchPage searchItemsByGenre(const std::string& genre, size_t pageSize, const std::string& token = "") const {
+        trace(TraceOp::GenrePage, genre, pageSize, token);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByGenre);
+        return runQueryPage(ItemQuery::genreContains(genre).sortBy(ItemQuery::SortKey::Title), pageSize, token);
+    }
+    
+    SearchPage searchItemsByType(const std::string& type, size_t pageSize, const std::string& token = "") const {
+        trace(TraceOp::TypePage, type, pageSize, token);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByType);
+        return runQueryPage(ItemQuery::typeIs(type).sortBy(ItemQuery::SortKey::Title), pageSize, token);
+    }
+    
+private:
+    // queryPage without the timing, for callers that time themselves
+    SearchPage runQueryPage(const ItemQuery& itemQuery, size_t pageSize, const std::string& token) const {
+        if (pageSize == 0) throw LibraryException("Page size must be positive");
+        
+        std::string afterKey;
+        if (!token.empty()) {
+            char expected = itemQuery.getSortKey() == ItemQuery::SortKey::Title ? 'T' : 'I';
+            if (token[0] != expected || !SearchPage::decodeToken(token.substr(1), afterKey)) {
+                throw LibraryException("Invalid continuation token");
+            }
+        }
+        
+        ItemQuery bounded = itemQuery;
+        bounded.limit(pageSize + 1);
+        SearchPage page;
+        page.items.reserve(pageSize + 1);
+        for (const LibraryItem* item : runQuery(bounded, afterKey)) {
+            page.items.push_back(item);
+        }
+        if (page.items.size() > pageSize) {
+            page.items.pop_back();
+            const LibraryItem* last = page.items.back();
+            page.nextToken = itemQuery.getSortKey() == ItemQuery::SortKey::Title
+                ? "T" + SearchPage::encodeToken(titleKey(*last))
+                : "I" + SearchPage::encodeToken(last->getId());
+        }
+        return page;
+    }
+    
+public:
+    
+    /**
+     * Items with the given ISBN-10 or ISBN-13, hyphenated or not, found with
+     * a single hash probe
+     */
+    std::vector<const LibraryItem*> findItemsByIsbn(const std::string& isbn) const {
+        trace(TraceOp::FindByIsbn, isbn);
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByIsbn);
+        uint64_t key = Isbn::parse(isbn);
+        if (key == Isbn::kInvalid) throw LibraryException("Invalid ISBN: " + isbn);
+        auto it = isbnIndex_.find(key);
+        if (it == isbnIndex_.end()) return {};
+        return it->second;
+    }
+    
+    /**
+     * Typo-tolerant search over titles, authors and directors (see
+     * FuzzyIndex). Every word of the text must match within maxDistance
+     * edits; closest matches come first.
+     */
+    std::vector<const LibraryItem*> fuzzySearch(const std::string& text, int maxDistance = FuzzyIndex::kMaxDistance,
+                                                size_t limit = 20, unsigned fields = FuzzyIndex::AllFields) const {
+        trace(TraceOp::FuzzySearch, text, maxDistance, limit, fields);
+        ScopedLatency timer(metrics_, LibraryOperation::FuzzySearch);
+        return fuzzyIndex_.search(text, maxDistance, limit, fields);
+    }
+    
+    /**
+     * The k titles that best match the text: exact match, then prefix, then
+     * word prefix, then substring, ties broken by title. Keeps only k
+     * candidates in memory.
+     */
+    std::vector<const LibraryItem*> topItemsByTitle(const std::string& text, size_t k) const {
+        ScopedLatency timer(metrics_, LibraryOperation::SearchByTitle);
+        using Candidate = std::pair<int, const LibraryItem*>;
+        // Best match first; as a heap order it keeps the worst candidate on top
+        auto ranksBefore = [](const Candidate& a, const Candidate& b) {
+            if (a.first != b.first) return a.first < b.first;
+            if (a.second->getTitle() != b.second->getTitle()) return a.second->getTitle() < b.second->getTitle();
+            return a.second->getId() < b.second->getId();
+        };
+        std::vector<Candidate> heap;
+        if (k == 0) return {};
+        heap.reserve(k + 1);
+        std::string needle = TextNormalizer::normalize(text);
+        
+        for (const auto& pair : items_) {
+            int score = titleMatchScore(pair.second->getSearchKeys().get(SearchKeys::Title), needle);
+            if (score < 0) continue;
+            
+            Candidate candidate{score, pair.second.get()};
+            if (heap.size() < k) {
+                heap.push_back(candidate);
+                std::push_heap(heap.begin(), heap.end(), ranksBefore);
+            } else if (ranksBefore(candidate, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), ranksBefore);
+                heap.back() = candidate;
+                std::push_heap(heap.begin(), heap.end(), ranksBefore);
+            }
+        }
+        
+        std::sort_heap(heap.begin(), heap.end(), ranksBefore);
+        std::vector<const LibraryItem*> results;
+        results.reserve(heap.size());
+        for (const auto& candidate : heap) results.push_back(candidate.second);
+        return results;
+    }
+    
+    /**
+     * Consistent point-in-time view of the catalog and active loans. Cheap to
+     * take, and safe to call and read from another thread while this one
+     * keeps checking items in and out.
+     */
+    LibrarySnapshot snapshot() const {
+        return snapshots_.snapshot(clock_->today());
+    }
+    
+    void printOverdueItems() const {
+        ScopedLatency timer(metrics_, LibraryOperation::PrintOverdueItems);
+        snapshot().printOverdueItems(std::cout);
+    }
+    
+    // One notice file per patron with overdue loans, written to directory
+    OverdueNoticeSpool::Result writeOverdueNotices(const std::string& directory,
+                                                   const NoticeTemplate& noticeTemplate = NoticeTemplate::standard()) const {
+        ScopedLatency timer(metrics_, LibraryOperation::WriteOverdueNotices);
+        return OverdueNoticeSpool::write(snapshot(), directory, noticeTemplate);
+    }
+    
+    // Lists the patron's checkouts still held in the journal; older history
+    // lives in the archived journal segments
+    void printPatronHistory(const std::string& patronId) const {
+        std::cout << "\n=== PATRON HISTORY: " << patronId << " ===\n";
+        bool found = false;
+        journal_.forEach([&](const std::vector<std::string>& record) {
+            // transactionId, time, type, barcode, itemId, title, patronId, patronName, detail
+            if (record.size() < 9 || record[2] != "Checkout" || record[6] != patronId) return;
+            found = true;
+            std::cout << "Item: " << record[5] << " (" << record[4] << ")\n";
+            if (record[3] != record[4]) {
+                std::cout << "Copy: " << record[3] << "\n";
+            }
+            std::cout << "Patron: " << record[7] << " (" << record[6] << ")\n"
+                      << "Checked Out: "
+                      << DateFormatter::formatDateTime(std::chrono::system_clock::to_time_t(LogCodec::decodeTime(record[1]))) << "\n"
+                      << "Due Date: " << DateFormatter::formatDay(std::stoll(record[8])) << "\n\n";
+        });
+        if (!found) {
+            std::cout << "No transactions found for this patron.\n";
+        }
+    }
+    
+    /**
+     * Checkpoints to directory (which must exist) on a background thread
+     * after every everyRecords journaled changes. Journal segments hold
+     * segmentRecords records each; sealed ones are archived and freed at
+     * the next checkpoint.
+     */
+    void enableCheckpointing(const std::string& directory, uint64_t everyRecords, size_t segmentRecords = 1024) {
+        journal_.setSegmentRecords(segmentRecords);
+        checkpointer_.reset();
+        checkpointer_ = std::make_unique<Checkpointer>(directory);
+        checkpointEvery_ = everyRecords;
+    }
+    
+    /**
+     * Captures the state image and the sealed journal segments, then hands
+     * both to the background writer. The capture is O(state); the disk
+     * writes and freeing happen off this thread.
+     */
+    void checkpoint() {
+        if (!checkpointer_) throw LibraryException("Checkpointing is not enabled");
+        Checkpointer::Job job;
+        job.image = buildCheckpointImage();
+        // Archive every record the image covers, so history survives a restart
+        journal_.seal();
+        job.segments = journal_.takeSealed();
+        job.tails = checkpointer_->rotateTails();
+        checkpointer_->submit(std::move(job));
+    }
+    
+    // Waits for queued checkpoints to reach disk
+    void flushCheckpoints() {
+        if (checkpointer_) checkpointer_->flush();
+    }
+    
+    const TransactionJournal& getJournal() const { return journal_; }
+    
+    // Items most often borrowed by patrons who also borrowed itemId
+    std::vector<const LibraryItem*> recommendItems(const std::string& itemId, size_t limit = 5) const {
+        trace(TraceOp::Recommend, itemId, limit);
+        ScopedLatency timer(metrics_, LibraryOperation::Recommend);
+        std::vector<const LibraryItem*> results;
+        for (const auto& neighbor : recommendations_.recommend(itemId, limit)) {
+            auto it = items_.find(neighbor.first);
+            if (it != items_.end()) results.push_back(it->second.get());
+        }
+        return results;
+    }
+    
+    /**
+     * Checkout counts, loan lengths and fines grouped as the query asks,
+     * e.g. per genre per month or by patron type. Covers loans made since
+     * the library started, or since the history was last rebuilt from the
+     * journal; genre is empty for non-book items.
+     */
+    std::vector<CirculationHistory::Group> circulationReport(const CirculationHistory::Query& reportQuery) const {
+        ScopedLatency timer(metrics_, LibraryOperation::CirculationReport);
+        return circulation_.aggregate(reportQuery);
+    }
+    
+    /**
+     * Rebuilds recommendations from the checkout history: the archived
+     * journal segments, when checkpointing is enabled, plus the resident
+     * journal. Used after loading a checkpoint.
+     */
+    void rebuildRecommendations(unsigned threads = std::thread::hardware_concurrency()) {
+        std::vector<std::pair<std::string, std::string>> borrows;
+        forEachJournaled([&borrows](const std::vector<std::string>& record) {
+            // transactionId, time, type, barcode, itemId, title, patronId, ...
+            if (record.size() >= 7 && record[2] == "Checkout") borrows.emplace_back(record[6], record[4]);
+        });
+        recommendations_.rebuild(borrows, std::max(1u, threads));
+    }
+    
+    /**
+     * Rebuilds the circulation report rows from the same journal history.
+     * Open loans the journal does not cover, e.g. restored from a checkpoint
+     * whose archives are gone, keep a row of their own. Used after loading a
+     * checkpoint.
+     */
+    void rebuildCirculationHistory() {
+        circulation_ = CirculationHistory();
+        forEachJournaled([this](const std::vector<std::string>& record) {
+            // transactionId, time, type, barcode, itemId, title, patronId, patronName, detail
+            if (record.size() < 9 || (record[2] != "Checkout" && record[2] != "Return")) return;
+            EpochDay day = LibraryClock::toEpochDay(LogCodec::decodeTime(record[1]));
+            if (record[2] == "Checkout") {
+                const LibraryItem* item = findItemById(record[4]);
+                const LibraryPatron* patron = findPatronById(record[6]);
+                if (item && patron) recordCirculation(record[3], *item, *patron, day);
+            } else if (record[2] == "Return") {
+                circulation_.recordReturn(record[3], day, std::stod(record[8]));
+            }
+        });
+        for (const auto& pair : activeCheckouts_) {
+            const Checkout& checkout = *pair.second;
+            if (circulation_.isOpen(pair.first)) continue;
+            recordCirculation(pair.first, *checkout.getItem(), *checkout.getPatron(), checkout.getCheckoutDay());
+        }
+    }
+    Checkpointer* getCheckpointer() const { return checkpointer_.get(); }
+    
+    /**
+     * Rebuilds an empty library from a checkpoint image, then replays the
+     * changes journaled after it from the archives and live tails beside
+     * the image, so restart cost depends on current state and the changes
+     * since the last checkpoint rather than on uptime
+     */
+    void loadCheckpoint(const std::string& path) {
+        if (!items_.empty() || !patrons_.empty()) {
+            throw LibraryException("Checkpoints can only be loaded into an empty library");
+        }
+        std::ifstream in(path);
+        if (!in) throw LibraryException("Cannot open checkpoint: " + path);
+        
+        struct Restoring {
+            bool& flag;
+            ~Restoring() { flag = false; }
+        } restoring{restoring_};
+        restoring_ = true;
+        loadImage(in);
+        replayJournal(std::filesystem::path(path).parent_path().string());
+    }
+    
+private:
+    void loadImage(std::istream& in) {
+        std::vector<std::string> inactive;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty()) continue;
+            std::vector<std::string> f = LogCodec::split(line);
+            const std::string& kind = f[0];
+            if (kind == "checkpoint" && f.size() >= 2) {
+                journal_.resumeAfter(std::stoull(f[1]));
+            } else if (kind == "item") {
+                addItem(LogCodec::decodeItem(f, 1));
+            } else if (kind == "copy" && f.size() >= 3) {
+                addCopy(f[1], f[2]);
+            } else if (kind == "patron" || kind == "guest") {
+                auto patron = LogCodec::decodePatron(f, 1);
+                // Loans are reopened below, which needs the patron active
+                if (!patron->isActive()) inactive.push_back(patron->getId());
+                patron->setActive(true);
+                if (kind == "guest") addGuestPatron(std::move(patron));
+                else addPatron(std::move(patron));
+            } else if (kind == "loan" && f.size() >= 6) {
+                restoreLoan(f[1], f[2], std::stoll(f[3]), std::stoll(f[4]), std::stoi(f[5]));
+            } else if (kind == "account" && f.size() >= 4) {
+                ledger_->restoreAccount(f[1], std::stoll(f[2]), std::stoll(f[3]));
+            } else if (kind == "hold" && f.size() >= 8) {
+                LibraryItem* item = findItemById(f[2]);
+                LibraryPatron* patron = findPatronById(f[3]);
+                if (!item) throw ItemNotFoundException(f[2]);
+                if (!patron) throw PatronNotFoundException(f[3]);
+                holds_.restore({std::stoull(f[1]), item->shared_from_this(), patron->shared_from_this(),
+                                LogCodec::decodeTime(f[4]), LogCodec::decodeTime(f[5]), f[6] == "1",
+                                static_cast<size_t>(std::stoull(f[7]))});
+            } else if (kind == "holds" && f.size() >= 2) {
+                holds_.resumeHoldIds(std::stoull(f[1]));
+            } else if (kind == "free" && f.size() >= 2) {
+                LibraryItem* item = findItemById(f[1]);
+                if (!item) throw ItemNotFoundException(f[1]);
+                std::vector<size_t> order;
+                for (size_t i = 2; i < f.size(); ++i) order.push_back(static_cast<size_t>(std::stoull(f[i])));
+                item->restoreFreeOrder(order);
+            } else {
+                throw LibraryException("Malformed checkpoint record: " + kind);
+            }
+        }
+        for (const auto& patronId : inactive) setPatronActive(patronId, false);
+    }
+    
+    /**
+     * Reapplies, at their journaled times, the records that follow the
+     * loaded image, and keeps them in the journal. Stops at the first
+     * missing sequence number or torn last line; tails past that point are
+     * renamed *.unreplayed so a later restart cannot mistake them for
+     * records journaled after this one.
+     */
+    void replayJournal(const std::string& directory) {
+        auto files = Checkpointer::listSequenceFiles(directory, "journal-");
+        auto tails = Checkpointer::listSequenceFiles(directory, "tail-");
+        files.insert(files.end(), tails.begin(), tails.end());
+        std::stable_sort(files.begin(), files.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        
+        auto replayClock = std::make_shared<SimulatedClock>();
+        std::shared_ptr<LibraryClock> clock = std::move(clock_);
+        clock_ = replayClock;
+        uint64_t next = journal_.getLastSequence() + 1;
+        try {
+            for (const auto& file : files) {
+                if (file.first > next) break;
+                std::string name = file.second.filename().string();
+                // journal-<first>-<last>.log archives wholly before the image are skipped unread
+                size_t dash = name.find('-', 8);
+                if (name.compare(0, 8, "journal-") == 0 && dash != std::string::npos &&
+                    std::strtoull(name.c_str() + dash + 1, nullptr, 10) < next) {
+                    continue;
+                }
+                std::ifstream in(file.second);
+                std::string line;
+                while (std::getline(in, line) && !in.eof()) {
+                    std::vector<std::string> record = LogCodec::split(line);
+                    uint64_t sequence = journalSequence(record);
+                    if (sequence < next) continue;
+                    if (sequence > next || record.size() < 3) break;
+                    replayClock->set(LogCodec::decodeTime(record[1]));
+                    try {
+                        applyJournaled(record);
+                    } catch (const std::exception& e) {
+                        throw LibraryException("Journal replay failed at " + record[0] + ": " + e.what());
+                    }
+                    journal_.append(line);
+                    ++next;
+                }
+            }
+        } catch (...) {
+            clock_ = std::move(clock);
+            throw;
+        }
+        clock_ = std::move(clock);
+        
+        std::error_code error;
+        for (const auto& tail : tails) {
+            if (tail.first >= next) std::filesystem::rename(tail.second, tail.second.string() + ".unreplayed", error);
+        }
+    }
+    
+    // Performs one journaled change again; see journal() for the layouts
+    void applyJournaled(const std::vector<std::string>& r) {
+        const std::string& type = r[2];
+        auto need = [&r](size_t count) {
+            if (r.size() < 3 + count) throw LibraryException("Truncated journal record");
+        };
+        if (type == "Checkout") {
+            need(6);
+            auto copy = copies_.find(r[3]);
+            LibraryPatron* patron = findPatronById(r[6]);
+            if (copy == copies_.end()) throw ItemNotFoundException(r[3]);
+            if (!patron) throw PatronNotFoundException(r[6]);
+            checkoutCopy(*copy->second.first, copy->second.second, *patron);
+        } else if (type == "Return") {
+            need(6);
+            returnItem(r[3]);
+        } else if (type == "Renew") {
+            need(6);
+            renewItem(r[3]);
+        } else if (type == "AddItem") {
+            addItem(LogCodec::decodeItem(r, 3));
+        } else if (type == "AddCopy") {
+            need(2);
+            addCopy(r[3], r[4]);
+        } else if (type == "AddPatron") {
+            addPatron(LogCodec::decodePatron(r, 3));
+        } else if (type == "AddGuestPatron") {
+            addGuestPatron(LogCodec::decodePatron(r, 3));
+        } else if (type == "SetPatronActive") {
+            need(2);
+            setPatronActive(r[3], r[4] == "1");
+        } else if (type == "PayFine") {
+            need(2);
+            payFine(r[3], std::stod(r[4]));
+        } else if (type == "PlaceHold") {
+            need(3);
+            if (placeHold(r[3], r[4]) != std::stoull(r[5])) throw LibraryException("Hold ID differs from the journal");
+        } else if (type == "CancelHold") {
+            need(1);
+            cancelHold(std::stoull(r[3]));
+        } else if (type == "ExpireHolds") {
+            processExpiredHolds();
+        } else if (type == "RestoreLoan") {
+            need(5);
+            restoreLoan(r[3], r[4], std::stoll(r[5]), std::stoll(r[6]), std::stoi(r[7]));
+        } else {
+            throw LibraryException("Unknown journal record: " + type);
+        }
+    }
+    
+public:
+    
+    // Reopens a loan read back from a checkpoint or carried over from another
+    // system; it gets a circulation row so its return is counted
+    void restoreLoan(const std::string& barcode, const std::string& patronId,
+                     EpochDay checkoutDay, EpochDay dueDay, int renewals) {
+        trace(TraceOp::RestoreLoan, barcode, patronId, checkoutDay, dueDay, renewals);
+        auto copy = copies_.find(barcode);
+        if (copy == copies_.end()) throw ItemNotFoundException(barcode);
+        LibraryPatron* patronPtr = findPatronById(patronId);
+        if (!patronPtr) throw PatronNotFoundException(patronId);
+        auto checkout = std::make_shared<Checkout>(copy->second.first->shared_from_this(), patronPtr->shared_from_this(),
+                                                   0, copy->second.second, clock_->now());
+        checkout->restoreTerms(checkoutDay, dueDay, renewals);
+        openLoan(checkout);
+        recordCirculation(barcode, *copy->second.first, *patronPtr, checkoutDay);
+        journal(checkout->getTimestamp(), "RestoreLoan", {barcode, patronId, std::to_string(checkoutDay),
+                                                          std::to_string(dueDay), std::to_string(renewals)});
+        maybeCheckpoint();
+    }
+    
+    const LibraryMetrics& getMetrics() const { return metrics_; }
+    
+    void setClock(std::shared_ptr<LibraryClock> clock) {
+        if (!clock) throw LibraryException("Clock cannot be null");
+        clock_ = std::move(clock);
+    }
+    
+    const LibraryClock& getClock() const { return *clock_; }
+    
+    // O(1) dashboard aggregates, maintained as circulation happens
+    LibraryStats getStats() {
+        return stats_.snapshot(clock_->today(), ledger_->getTotalOutstanding(), holds_.size());
+    }
+    
+    void setPatronActive(const std::string& patronId, bool active) {
+        trace(TraceOp::SetPatronActive, patronId, active ? "1" : "0");
+        LibraryPatron* patron = findPatronById(patronId);
+        if (!patron) throw PatronNotFoundException(patronId);
+        patron->setActive(active);
+        journal(clock_->now(), "SetPatronActive", {patronId, active ? "1" : "0"});
+        maybeCheckpoint();
+    }
+    EpochDay today() const { return clock_->today(); }
+    
+    void setMaxRenewals(int maxRenewals) { maxRenewals_ = maxRenewals; }
+    int getMaxRenewals() const { return maxRenewals_; }
+    
+    // Extends a loan by the patron's getLoanExtensionDays(); accepts a copy
+    // barcode or an item ID like returnItem()
+    std::shared_ptr<Checkout> renewItem(const std::string& itemId) {
+        trace(TraceOp::Renew, itemId);
+        ScopedLatency timer(metrics_, LibraryOperation::Renew);
+        auto it = activeCheckouts_.find(itemId);
+        if (it == activeCheckouts_.end()) {
+            if (const LibraryItem* item = findItemById(itemId)) {
+                for (const auto& copy : item->getCopies()) {
+                    it = activeCheckouts_.find(copy.barcode);
+                    if (it != activeCheckouts_.end()) break;
+                }
+            }
+        }
+        if (it == activeCheckouts_.end()) {
+            throw RenewalException("No active checkout for item: " + itemId);
+        }
+        
+        auto now = clock_->now();
+        expireHolds(now);
+        if (const char* reason = renewalBlocker(*it->second, LibraryClock::toEpochDay(now))) {
+            throw RenewalException(reason);
+        }
+        renewLoan(it->second);
+        journal(now, "Renew", loanFields(*it->second, std::to_string(it->second->getDueDay())));
+        maybeCheckpoint();
+        return it->second;
+    }
+    
+    // Renews every eligible loan of a patron; ineligible loans are skipped
+    std::vector<std::shared_ptr<Checkout>> renewAllForPatron(const std::string& patronId) {
+        trace(TraceOp::RenewAll, patronId);
+        if (!findPatronById(patronId)) throw PatronNotFoundException(patronId);
+        std::vector<std::shared_ptr<Checkout>> renewed;
+        auto loans = patronLoans_.find(patronId);
+        if (loans == patronLoans_.end()) return renewed;
+        
+        auto now = clock_->now();
+        EpochDay today = LibraryClock::toEpochDay(now);
+        expireHolds(now);
+        for (const auto& barcode : loans->second) {
+            ScopedLatency timer(metrics_, LibraryOperation::Renew);
+            const auto& checkout = activeCheckouts_.at(barcode);
+            if (renewalBlocker(*checkout, today)) continue;
+            renewLoan(checkout);
+            journal(now, "Renew", loanFields(*checkout, std::to_string(checkout->getDueDay())));
+            renewed.push_back(checkout);
+        }
+        maybeCheckpoint();
+        return renewed;
+    }
+    
+    // Places a hold; if a copy is free it goes straight to the hold shelf
+    uint64_t placeHold(const std::string& itemId, const std::string& patronId) {
+        trace(TraceOp::PlaceHold, itemId, patronId);
+        LibraryItem* itemPtr = findItemById(itemId);
+        LibraryPatron* patronPtr = findPatronById(patronId);
+        if (!itemPtr) throw ItemNotFoundException(itemId);
+        if (!patronPtr) throw PatronNotFoundException(patronId);
+        if (!patronPtr->isActive()) throw LibraryException("Patron is not active: " + patronId);
+        
+        auto now = clock_->now();
+        expireHolds(now);
+        uint64_t holdId = holds_.place(itemPtr->shared_from_this(), patronPtr->shared_from_this(), now);
+        journal(now, "PlaceHold", {itemId, patronId, std::to_string(holdId)});
+        maybeCheckpoint();
+        return holdId;
+    }
+    
+    void cancelHold(uint64_t holdId) {
+        trace(TraceOp::CancelHold, holdId);
+        auto now = clock_->now();
+        holds_.cancel(holdId, now);
+        journal(now, "CancelHold", {std::to_string(holdId)});
+        maybeCheckpoint();
+    }
+    
+    size_t processExpiredHolds() {
+        trace(TraceOp::ProcessExpiredHolds);
+        size_t expired = expireHolds(clock_->now());
+        maybeCheckpoint();
+        return expired;
+    }
+    
+    std::vector<const HoldManager::Hold*> getHolds(const std::string& itemId) const {
+        return holds_.getHolds(*findItem(itemId));
+    }
+    
+    // The hold a copy has been set aside for, or nullptr
+    const HoldManager::Hold* findHoldForCopy(const std::string& barcode) const {
+        return holds_.findReadyForCopy(barcode);
+    }
+    
+    HoldManager& getHoldManager() { return holds_; }
+    
+    void setFinePolicy(const FinePolicy& policy) {
+        finePolicy_ = CompiledFinePolicy(policy);
+        // Snapshot rows carry resolved terms
+        for (const auto& pair : activeCheckouts_) snapshots_.publishLoan(*pair.second, finePolicy_);
+    }
+    
+    const CompiledFinePolicy& getFinePolicy() const { return finePolicy_; }
+    
+    /**
+     * Keeps fines in the given ledger, which other libraries may share, so
+     * a patron's fines and block apply wherever they borrow. Accounts in
+     * the previous ledger are dropped; outstanding fines in getStats()
+     * then cover every library sharing the ledger.
+     */
+    void shareFineLedger(std::shared_ptr<FineLedger> ledger) {
+        if (!ledger) throw LibraryException("Fine ledger cannot be null");
+        ledger_ = std::move(ledger);
+    }
+    
+    void payFine(const std::string& patronId, double amount) {
+        trace(TraceOp::PayFine, patronId, amount);
+        if (!findPatronById(patronId)) throw PatronNotFoundException(patronId);
+        ledger_->pay(patronId, amount);
+        journal(clock_->now(), "PayFine", {patronId, std::to_string(amount)});
+        maybeCheckpoint();
+    }
+    
+    double getPatronBalance(const std::string& patronId) const {
+        return ledger_->getBalance(patronId);
+    }
+    
+    void setFineBlockThreshold(double amount) {
+        ledger_->setBlockThreshold(amount);
+    }
+    
+    const FineLedger& getFineLedger() const { return *ledger_; }
+    
+    // Prices every active loan as of the given day in a single pass
+    std::vector<std::pair<std::shared_ptr<Checkout>, double>> assessFines(EpochDay asOf) const {
+        std::vector<std::shared_ptr<Checkout>> loans;
+        loans.reserve(activeCheckouts_.size());
+        for (const auto& pair : activeCheckouts_) {
+            loans.push_back(pair.second);
+        }
+        
+        FineBatch batch = finePolicy_.prepare(loans);
+        std::vector<int64_t> fineCents;
+        finePolicy_.evaluate(batch, asOf, fineCents);
+        
+        std::vector<std::pair<std::shared_ptr<Checkout>, double>> results;
+        results.reserve(loans.size());
+        for (size_t i = 0; i < loans.size(); ++i) {
+            results.emplace_back(loans[i], fineCents[i] / 100.0);
+        }
+        return results;
+    }
+    
+    void printInventory() const {
+        snapshot().printInventory(std::cout);
+    }
+};
+
+/**
+ * Replays a recorded trace into a library for regression and load tests.
+ * The target's clock follows the recorded library clock, so due dates,
+ * fines and hold expiry come out as they did originally. Operations that
+ * change state run one at a time in trace order; with several threads the
+ * reads between two changes run concurrently.
+ */
+class TraceReplayer {
+public:
+    struct Options {
+        double speed = 1.0;    // multiple of the recorded pace; 0 replays as fast as possible
+        unsigned threads = 1;
+    };
+    
+    struct Report {
+        uint64_t operations = 0;
+        uint64_t errors = 0;  // operations that threw, including those that failed when recorded
+        std::chrono::nanoseconds elapsed{0};
+        // From each operation's scheduled start to its completion, so time
+        // spent queued behind earlier operations counts
+        OperationStats latency;
+        
+        double throughput() const {
+            return elapsed.count() == 0 ? 0.0 : operations * 1e9 / static_cast<double>(elapsed.count());
+        }
+        
+        void print(std::ostream& out) const {
+            out << std::fixed << std::setprecision(2)
+                << "Replayed " << operations << " operations in " << elapsed.count() / 1e9 << "s ("
+                << throughput() << " ops/s), " << errors << " errors\n"
+                << "Latency (us): mean " << latency.meanNs() / 1000.0
+                << ", p50 " << latency.percentileNs(0.50) / 1000.0
+                << ", p99 " << latency.percentileNs(0.99) / 1000.0
+                << ", p999 " << latency.percentileNs(0.999) / 1000.0
+                << ", max " << latency.maxNs / 1000.0 << "\n";
+        }
+    };
+    
+private:
+    using SteadyTime = std::chrono::steady_clock::time_point;
+    
+    struct Task {
+        size_t index;
+        SteadyTime scheduled;
+    };
+    
+    std::vector<TraceRecord> records_;
+    
+    static void note(OperationStats& stats, SteadyTime scheduled, bool failed) {
+        auto elapsed = std::chrono::steady_clock::now() - scheduled;
+        uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        ++stats.count;
+        if (failed) ++stats.errors;
+        stats.totalNs += ns;
+        stats.maxNs = std::max(stats.maxNs, ns);
+        ++stats.buckets[LatencyHistogram::bucketFor(ns)];
+    }
+    
+    static void merge(OperationStats& into, const OperationStats& from) {
+        into.count += from.count;
+        into.errors += from.errors;
+        into.totalNs += from.totalNs;
+        into.maxNs = std::max(into.maxNs, from.maxNs);
+        for (int i = 0; i < LatencyHistogram::kBucketCount; ++i) into.buckets[i] += from.buckets[i];
+    }
+    
+    static size_t number(const std::string& text) { return static_cast<size_t>(std::stoull(text)); }
+    
+    // Runs one record; returns false if the operation threw
+    static bool execute(Library& library, const TraceRecord& record) {
+        try {
+            apply(library, record);
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    
+public:
+    explicit TraceReplayer(std::vector<TraceRecord> records) : records_(std::move(records)) {}
+    
+    static TraceReplayer load(const std::string& path) { return TraceReplayer(TraceRecorder::load(path)); }
+    
+    const std::vector<TraceRecord>& getRecords() const { return records_; }
+    
+    // Performs one recorded operation, throwing as the library does
+    static void apply(Library& library, const TraceRecord& record) {
+        const std::vector<std::string>& a = record.args;
+        auto need = [&a](size_t count) {
+            if (a.size() < count) throw LibraryException("Truncated trace record");
+        };
+        switch (record.op) {
+            case TraceOp::AddItem: library.addItem(LogCodec::decodeItem(a, 0)); break;
+            case TraceOp::AddCopy: need(2); library.addCopy(a[0], a[1]); break;
+            case TraceOp::AddPatron: library.addPatron(LogCodec::decodePatron(a, 0)); break;
+            case TraceOp::SetPatronActive: need(2); library.setPatronActive(a[0], a[1] == "1"); break;
+            case TraceOp::RestoreLoan:
+                need(5);
+                library.restoreLoan(a[0], a[1], std::stoll(a[2]), std::stoll(a[3]), std::stoi(a[4]));
+                break;
+            case TraceOp::Checkout: need(2); library.checkoutItem(a[0], a[1]); break;
+            case TraceOp::Return: need(1); library.returnItem(a[0]); break;
+            case TraceOp::Renew: need(1); library.renewItem(a[0]); break;
+            case TraceOp::RenewAll: need(1); library.renewAllForPatron(a[0]); break;
+            case TraceOp::PlaceHold: need(2); library.placeHold(a[0], a[1]); break;
+            case TraceOp::CancelHold: need(1); library.cancelHold(std::stoull(a[0])); break;
+            case TraceOp::ProcessExpiredHolds: library.processExpiredHolds(); break;
+            case TraceOp::PayFine: need(2); library.payFine(a[0], std::stod(a[1])); break;
+            case TraceOp::SearchByTitle: need(1); library.searchItemsByTitle(a[0]); break;
+            case TraceOp::SearchByAuthor: need(1); library.searchItemsByAuthor(a[0]); break;
+            case TraceOp::SearchByGenre: need(1); library.searchItemsByGenre(a[0]); break;
+            case TraceOp::SearchByType: need(1); library.searchItemsByType(a[0]); break;
+            case TraceOp::TitlePage: need(3); library.searchItemsByTitle(a[0], number(a[1]), a[2]); break;
+            case TraceOp::AuthorPage: need(3); library.searchItemsByAuthor(a[0], number(a[1]), a[2]); break;
+            case TraceOp::GenrePage: need(3); library.searchItemsByGenre(a[0], number(a[1]), a[2]); break;
+            case TraceOp::TypePage: need(3); library.searchItemsByType(a[0], number(a[1]), a[2]); break;
+            case TraceOp::FindByIsbn: need(1); library.findItemsByIsbn(a[0]); break;
+            case TraceOp::FuzzySearch:
+                need(4);
+                library.fuzzySearch(a[0], std::stoi(a[1]), number(a[2]), static_cast<unsigned>(std::stoul(a[3])));
+                break;
+            case TraceOp::FindPatronByCard: need(1); library.findPatronByCard(a[0]); break;
+            case TraceOp::FindPatronsByName: need(2); library.findPatronsByName(a[0], number(a[1])); break;
+            case TraceOp::Recommend: need(2); library.recommendItems(a[0], number(a[1])); break;
+            case TraceOp::Count: throw LibraryException("Invalid trace operation");
+        }
+    }
+    
+    /**
+     * Replays every record into target, normally a fresh library, and
+     * replaces its clock with a simulated one. Recorded failures, such as
+     * a checkout refused for fines, fail again and count as errors.
+     */
+    Report run(Library& target, const Options& options) const {
+        if (options.speed < 0) throw LibraryException("Replay speed cannot be negative");
+        auto clock = std::make_shared<SimulatedClock>();
+        target.setClock(clock);
+        unsigned threads = std::max(1u, options.threads);
+        
+        std::mutex mutex;
+        std::condition_variable work;
+        std::condition_variable drained;
+        std::deque<Task> queue;
+        size_t inFlight = 0;
+        bool stopping = false;
+        std::vector<OperationStats> workerStats(threads);
+        std::vector<std::thread> workers;
+        // The calling thread dispatches and runs changes; the rest run reads
+        for (unsigned w = 1; w < threads; ++w) {
+            workers.emplace_back([&, w]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    work.wait(lock, [&]() { return stopping || !queue.empty(); });
+                    if (queue.empty()) return;
+                    Task task = queue.front();
+                    queue.pop_front();
+                    lock.unlock();
+                    bool ok = execute(target, records_[task.index]);
+                    note(workerStats[w], task.scheduled, !ok);
+                    lock.lock();
+                    if (--inFlight == 0) drained.notify_all();
+                }
+            });
+        }
+        
+        SteadyTime start = std::chrono::steady_clock::now();
+        int64_t firstOffsetUs = records_.empty() ? 0 : records_.front().offsetUs;
+        for (size_t i = 0; i < records_.size(); ++i) {
+            const TraceRecord& record = records_[i];
+            SteadyTime scheduled = std::chrono::steady_clock::now();
+            if (options.speed > 0) {
+                auto offset = std::chrono::duration<double, std::micro>((record.offsetUs - firstOffsetUs) / options.speed);
+                scheduled = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset);
+                std::this_thread::sleep_until(scheduled);
+            }
+            
+            if (threads > 1 && isReadOnly(record.op)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back({i, scheduled});
+                ++inFlight;
+                work.notify_one();
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                drained.wait(lock, [&]() { return inFlight == 0; });
+            }
+            clock->set(std::chrono::system_clock::time_point(std::chrono::milliseconds(record.clockMs)));
+            bool ok = execute(target, record);
+            note(workerStats[0], scheduled, !ok);
+        }
+        
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            drained.wait(lock, [&]() { return inFlight == 0; });
+            stopping = true;
+        }
+        work.notify_all();
+        for (auto& worker : workers) worker.join();
+        
+        Report report;
+        report.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        for (const auto& stats : workerStats) merge(report.latency, stats);
+        report.operations = report.latency.count;
+        report.errors = report.latency.errors;
+        return report;
+    }
+};
+
+/**
+ * Read-only copy of a primary Library, kept current by applying the
+ * primary's replication stream on a background thread. Searches run through
+ * read() under a shared lock, so OPAC traffic scales out across replicas
+ * without touching the primary's circulation path.
+ */
+class LibraryReplica {
+public:
+    struct Lag {
+        uint64_t records;               // received but not yet applied
+        std::chrono::nanoseconds age;   // how long the oldest of those has waited
+    };
+    
+private:
+    std::shared_ptr<ReplicationChannel> channel_;
+    Library library_;
+    mutable std::shared_mutex mutex_;
+    std::atomic<uint64_t> appliedSequence_{0};
+    std::atomic<uint64_t> applyErrors_{0};
+    mutable std::mutex progressMutex_;
+    std::condition_variable progress_;
+    std::chrono::nanoseconds maxLag_ = std::chrono::seconds(5);
+    std::thread applier_;
+    
+    void apply(const ReplicationRecord& record) {
+        using Kind = ReplicationRecord::Kind;
+        const auto& f = record.fields;
+        switch (record.kind) {
+            case Kind::Item:
+                library_.addItem(LogCodec::decodeItem(f, 0));
+                break;
+            case Kind::Copy:
+                if (f.size() < 2) throw LibraryException("Truncated copy record");
+                library_.addCopy(f[0], f[1]);
+                break;
+            case Kind::Patron:
+                library_.addPatron(LogCodec::decodePatron(f, 0));
+                break;
+            case Kind::Active:
+                if (f.size() < 2) throw LibraryException("Truncated active record");
+                library_.setPatronActive(f[0], f[1] == "1");
+                break;
+            case Kind::CopyStatus:
+                if (f.size() < 2) throw LibraryException("Truncated status record");
+                library_.applyCopyStatus(f[0], f[1]);
+                break;
+            case Kind::Synced:
+                // End of the bootstrap image; only advances the sequence
+                break;
+        }
+    }
+    
+    void run() {
+        std::string line;
+        while (channel_->pop(line)) {
+            uint64_t sequence = 0;
+            try {
+                ReplicationRecord record = ReplicationRecord::decode(line);
+                sequence = record.sequence;
+                std::unique_lock<std::shared_mutex> lock(mutex_);
+                apply(record);
+            } catch (const std::exception&) {
+                // Keep following the stream; a bad record must not stall the replica
+                ++applyErrors_;
+            }
+            if (sequence != 0) {
+                std::lock_guard<std::mutex> lock(progressMutex_);
+                appliedSequence_ = sequence;
+            }
+            progress_.notify_all();
+        }
+    }
+    
+public:
+    explicit LibraryReplica(std::shared_ptr<ReplicationChannel> channel)
+        : channel_(std::move(channel))
+    {
+        applier_ = std::thread([this]() { run(); });
+    }
+    
+    ~LibraryReplica() {
+        channel_->close();
+        applier_.join();
+    }
+    
+    LibraryReplica(const LibraryReplica&) = delete;
+    LibraryReplica& operator=(const LibraryReplica&) = delete;
+    
+    // Runs func against the replica's Library under a shared lock
+    template<typename Func>
+    auto read(Func func) const -> decltype(func(std::declval<const Library&>())) {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return func(static_cast<const Library&>(library_));
+    }
+    
+    uint64_t getAppliedSequence() const { return appliedSequence_; }
+    uint64_t getApplyErrors() const { return applyErrors_; }
+    
+    Lag getLag() const {
+        uint64_t received = channel_->getLastSequence();
+        uint64_t applied = appliedSequence_;
+        int64_t oldest;
+        std::chrono::nanoseconds age(0);
+        if (channel_->oldestPending(oldest)) {
+            age = std::chrono::nanoseconds(ReplicationLog::steadyNowNs() - oldest);
+        }
+        return {received > applied ? received - applied : 0, age};
+    }
+    
+    void setMaxLag(std::chrono::nanoseconds maxLag) { maxLag_ = maxLag; }
+    
+    // True when the oldest unapplied record has waited longer than the
+    // configured bound; callers should route reads elsewhere
+    bool isStale() const { return getLag().age > maxLag_; }
+    
+    // Waits until the record with the given sequence has been applied
+    bool waitForSequence(uint64_t sequence, std::chrono::nanoseconds timeout) {
+        std::unique_lock<std::mutex> lock(progressMutex_);
+        return progress_.wait_for(lock, timeout, [&]() { return appliedSequence_ >= sequence; });
+    }
+};
+
+/**
+ * Consortium of branch libraries. Each branch owns a Library shard holding
+ * the items and patrons whose IDs start with its code ("DT-B001" lives in
+ * branch "DT"). Single-record operations go to the owning shard; searches
+ * fan out to every shard in parallel and the per-shard results, already in
+ * order, are merged. Shards are in-process partitions here; a remote shard
+ * would slot in behind the same routing.
+ */
+class BranchRouter {
+private:
+    std::map<std::string, std::unique_ptr<Library>> branches_;
+    // Patron ID -> branches holding a guest copy of the record
+    std::unordered_map<std::string, std::set<std::string>> guestBranches_;
+    // One fine account per patron across all branches
+    std::shared_ptr<FineLedger> fines_ = std::make_shared<FineLedger>();
+    
+    // Runs func on every shard concurrently and returns the results in branch order
+    template<typename Func>
+    auto fanOut(Func func) const -> std::vector<decltype(func(std::declval<const Library&>()))> {
+        using Result = decltype(func(std::declval<const Library&>()));
+        std::vector<std::future<Result>> pending;
+        pending.reserve(branches_.size());
+        for (const auto& branch : branches_) {
+            const Library* shard = branch.second.get();
+            pending.push_back(std::async(std::launch::async, [shard, &func]() { return func(*shard); }));
+        }
+        std::vector<Result> results;
+        results.reserve(pending.size());
+        for (auto& future : pending) results.push_back(future.get());
+        return results;
+    }
+    
+    // K-way merge of per-shard lists that are each sorted by less
+    template<typename T, typename Less>
+    static std::vector<T> mergeSorted(std::vector<std::vector<T>> lists, Less less, size_t limit) {
+        using Cursor = std::pair<size_t, size_t>;  // list, position
+        auto greater = [&](const Cursor& a, const Cursor& b) {
+            return less(lists[b.first][b.second], lists[a.first][a.second]);
+        };
+        std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heads(greater);
+        for (size_t i = 0; i < lists.size(); ++i) {
+            if (!lists[i].empty()) heads.push({i, 0});
+        }
+        std::vector<T> merged;
+        while (!heads.empty() && merged.size() < limit) {
+            Cursor head = heads.top();
+            heads.pop();
+            merged.push_back(lists[head.first][head.second]);
+            if (head.second + 1 < lists[head.first].size()) heads.push({head.first, head.second + 1});
+        }
+        return merged;
+    }
+    
+    static bool idLess(const LibraryItem* a, const LibraryItem* b) { return a->getId() < b->getId(); }
+    static bool titleLess(const LibraryItem* a, const LibraryItem* b) { return Library::titleKey(*a) < Library::titleKey(*b); }
+    
+    Library& owner(const std::string& id) {
+        return const_cast<Library&>(static_cast<const BranchRouter*>(this)->owner(id));
+    }
+    
+    const Library& owner(const std::string& id) const {
+        auto it = branches_.find(branchOf(id));
+        if (it == branches_.end()) throw LibraryException("No branch for ID: " + id);
+        return *it->second;
+    }
+    
+    // Registers a guest copy of a patron in the branch that owns itemId, so
+    // the patron can borrow or reserve there
+    Library& branchForPatron(const std::string& itemId, const std::string& patronId) {
+        Library& itemBranch = owner(itemId);
+        Library& home = owner(patronId);
+        if (&itemBranch != &home) {
+            std::string code = branchOf(itemId);
+            auto& guests = guestBranches_[patronId];
+            if (!guests.count(code)) {
+                itemBranch.addGuestPatron(home.findPatron(patronId)->clone());
+                guests.insert(code);
+            }
+        }
+        return itemBranch;
+    }
+    
+public:
+    // Branch code of an item, copy or patron ID: the text before the first '-'
+    static std::string branchOf(const std::string& id) {
+        size_t dash = id.find('-');
+        if (dash == std::string::npos || dash == 0) throw LibraryException("ID has no branch prefix: " + id);
+        return id.substr(0, dash);
+    }
+    
+    Library& addBranch(const std::string& code) {
+        if (code.empty() || code.find('-') != std::string::npos) {
+            throw LibraryException("Invalid branch code: " + code);
+        }
+        auto& shard = branches_[code];
+        if (shard) throw LibraryException("Branch already exists: " + code);
+        shard = std::make_unique<Library>();
+        shard->shareFineLedger(fines_);
+        return *shard;
+    }
+    
+    Library& getBranch(const std::string& code) {
+        auto it = branches_.find(code);
+        if (it == branches_.end()) throw LibraryException("Unknown branch: " + code);
+        return *it->second;
+    }
+    
+    size_t getBranchCount() const { return branches_.size(); }
+    
+    void addItem(std::unique_ptr<LibraryItem> item) {
+        if (!item) throw LibraryException("Cannot add null item");
+        owner(item->getId()).addItem(std::move(item));
+    }
+    
+    // Card numbers are unique across branches, not just within one.
+    // Re-registering also refreshes the patron's guest copies.
+    void addPatron(std::unique_ptr<LibraryPatron> patron) {
+        if (!patron) throw LibraryException("Cannot add null patron");
+        std::string card = PatronDirectory::cardOf(*patron);
+        if (!card.empty()) {
+            try {
+                const LibraryPatron* holder = findPatronByCard(card);
+                if (holder->getId() != patron->getId()) {
+                    throw LibraryException("Card " + card + " already belongs to patron " + holder->getId());
+                }
+            } catch (const PatronNotFoundException&) {
+            }
+        }
+        std::string patronId = patron->getId();
+        Library& home = owner(patronId);
+        home.addPatron(std::move(patron));
+        auto guests = guestBranches_.find(patronId);
+        if (guests == guestBranches_.end()) return;
+        for (const auto& code : guests->second) branches_.at(code)->addGuestPatron(home.findPatron(patronId)->clone());
+    }
+    
+    const LibraryItem* findItem(const std::string& id) const { return owner(id).findItem(id); }
+    const LibraryPatron* findPatron(const std::string& id) const { return owner(id).findPatron(id); }
+    
+    // Guest copies are not indexed by card, so this finds the home record
+    const LibraryPatron* findPatronByCard(const std::string& cardId) const {
+        for (const auto& branch : branches_) {
+            try {
+                return branch.second->findPatronByCard(cardId);
+            } catch (const PatronNotFoundException&) {
+            }
+        }
+        throw PatronNotFoundException(cardId);
+    }
+    
+    // Name matches from every branch's own patrons, ordered by name then ID
+    std::vector<const LibraryPatron*> findPatronsByName(const std::string& prefix, size_t limit = 10) const {
+        std::vector<const LibraryPatron*> results;
+        for (const auto& branch : branches_) {
+            auto matches = branch.second->findPatronsByName(prefix, limit);
+            results.insert(results.end(), matches.begin(), matches.end());
+        }
+        std::stable_sort(results.begin(), results.end(), [](const LibraryPatron* a, const LibraryPatron* b) {
+            std::string nameA = TextNormalizer::normalize(a->getName());
+            std::string nameB = TextNormalizer::normalize(b->getName());
+            return nameA != nameB ? nameA < nameB : a->getId() < b->getId();
+        });
+        if (results.size() > limit) results.resize(limit);
+        return results;
+    }
+    
+    // Checks out from the branch holding the item, on behalf of a patron
+    // from any branch
+    std::shared_ptr<Checkout> checkoutItem(const std::string& itemIdOrBarcode, const std::string& patronId) {
+        return branchForPatron(itemIdOrBarcode, patronId).checkoutItem(itemIdOrBarcode, patronId);
+    }
+    
+    std::shared_ptr<Return> returnItem(const std::string& itemIdOrBarcode) {
+        return owner(itemIdOrBarcode).returnItem(itemIdOrBarcode);
+    }
+    
+    // Reserves an item held at any branch
+    uint64_t placeHold(const std::string& itemId, const std::string& patronId) {
+        return branchForPatron(itemId, patronId).placeHold(itemId, patronId);
+    }
+    
+    // Fines from every branch are paid, and owed, in one account
+    void payFine(const std::string& patronId, double amount) { owner(patronId).payFine(patronId, amount); }
+    double getPatronBalance(const std::string& patronId) const { return fines_->getBalance(patronId); }
+    
+    // Applies to the patron's home record and every guest copy
+    void setPatronActive(const std::string& patronId, bool active) {
+        owner(patronId).setPatronActive(patronId, active);
+        auto guests = guestBranches_.find(patronId);
+        if (guests == guestBranches_.end()) return;
+        for (const auto& code : guests->second) branches_.at(code)->setPatronActive(patronId, active);
+    }
+    
+    std::vector<const LibraryItem*> searchItemsByTitle(const std::string& title) const {
+        return mergeSorted(fanOut([&](const Library& shard) { return shard.searchItemsByTitle(title); }),
+                           idLess, std::numeric_limits<size_t>::max());
+    }
+    
+    std::vector<const LibraryItem*> searchItemsByAuthor(const std::string& author) const {
+        return mergeSorted(fanOut([&](const Library& shard) { return shard.searchItemsByAuthor(author); }),
+                           idLess, std::numeric_limits<size_t>::max());
+    }
+    
+    std::vector<const LibraryItem*> findItemsByIsbn(const std::string& isbn) const {
+        auto perBranch = fanOut([&](const Library& shard) { return shard.findItemsByIsbn(isbn); });
+        std::vector<const LibraryItem*> results;
+        for (const auto& books : perBranch) results.insert(results.end(), books.begin(), books.end());
+        return results;
+    }
+    
+    /**
+     * One page of results across all branches. Continuation tokens hold the
+     * last sort key, which every shard can seek to, so each page asks each
+     * shard for at most pageSize + 1 rows.
+     */
+    SearchPage queryPage(const ItemQuery& itemQuery, size_t pageSize, const std::string& token = "") const {
+        if (pageSize == 0) throw LibraryException("Page size must be positive");
+        bool byTitle = itemQuery.getSortKey() == ItemQuery::SortKey::Title;
+        auto pages = fanOut([&](const Library& shard) { return shard.queryPage(itemQuery, pageSize, token); });
+        
+        bool more = false;
+        std::vector<std::vector<const LibraryItem*>> lists;
+        lists.reserve(pages.size());
+        for (auto& page : pages) {
+            more = more || page.hasMore();
+            lists.push_back(std::move(page.items));
+        }
+        size_t total = 0;
+        for (const auto& list : lists) total += list.size();
+        
+        SearchPage merged;
+        merged.items = byTitle ? mergeSorted(std::move(lists), titleLess, pageSize)
+                               : mergeSorted(std::move(lists), idLess, pageSize);
+        if (more || total > merged.items.size()) {
+            const LibraryItem* last = merged.items.back();
+            merged.nextToken = byTitle ? "T" + SearchPage::encodeToken(Library::titleKey(*last))
+                                       : "I" + SearchPage::encodeToken(last->getId());
+        }
+        return merged;
+    }
+    
+    // The k best title matches across all branches (see Library::topItemsByTitle)
+    std::vector<const LibraryItem*> topItemsByTitle(const std::string& text, size_t k) const {
+        auto perBranch = fanOut([&](const Library& shard) { return shard.topItemsByTitle(text, k); });
+        std::vector<const LibraryItem*> candidates;
+        for (const auto& items : perBranch) candidates.insert(candidates.end(), items.begin(), items.end());
+        // Re-rank the union; each shard's top k covers the global top k
+        std::string needle = TextNormalizer::normalize(text);
+        auto score = [&needle](const LibraryItem* item) {
+            return Library::titleMatchScore(item->getSearchKeys().get(SearchKeys::Title), needle);
+        };
+        std::stable_sort(candidates.begin(), candidates.end(), [&](const LibraryItem* a, const LibraryItem* b) {
+            int sa = score(a), sb = score(b);
+            if (sa != sb) return sa < sb;
+            return titleLess(a, b);
+        });
+        if (candidates.size() > k) candidates.resize(k);
+        return candidates;
+    }
+};
+
+/**
+ * Simple test framework for unit testing
+ */
+class UnitTest {
+private:
+    int passed_ = 0;
+    int failed_ = 0;
+    
+public:
+    template<typename Func>
+    void test(const std::string& testName, Func testFunc) {
+        try {
+            testFunc();
+            std::cout << "✓ PASS: " << testName << std::endl;
+            passed_++;
+        }
+        catch (const std::exception& e) {
+            std::cout << "✗ FAIL: " << testName << " - " << e.what() << std::endl;
+            failed_++;
+        }
+    }
+    
+    void printSummary() const {
+        std::cout << "\n===== TEST RESULTS =====\n";
+        std::cout << "Passed: " << passed_ << std::endl;
+        std::cout << "Failed: " << failed_ << std::endl;
+        std::cout << "========================\n";
+    }
+};
+
+/**
+ * Empty scratch directory under the system temp directory, removed again
+ * when the test that owns it finishes, whether or not it passed
+ */
+class TempDirectory {
+private:
+    std::string path_;
+    
+public:
+    explicit TempDirectory(const std::string& name)
+        : path_((std::filesystem::temp_directory_path() / name).string())
+    {
+        std::filesystem::remove_all(path_);
+        std::filesystem::create_directories(path_);
+    }
+    
+    ~TempDirectory() {
+        std::error_code ignored;
+        std::filesystem::remove_all(path_, ignored);
+    }
+    
+    TempDirectory(const TempDirectory&) = delete;
+    TempDirectory& operator=(const TempDirectory&) = delete;
+    
+    const std::string& getPath() const { return path_; }
+};
+
+/**
+ * Function to run all unit tests
+ */
+void runTests() {
     UnitTest tester;
     
-    // Test Book creation
-    tester.test("Create Book", []() {
-        auto book = std::make_unique<Book>("B123", "The Great Gatsby", "F. Scott Fitzgerald", "978-3-16-148410-0", "Fiction");
-        if (book->getTitle() != "The Great Gatsby") {
-            throw std::runtime_error("Book title does not match");
+    // Test Book creation
+    tester.test("Create Book", []() {
+        auto book = std::make_unique<Book>("B123", "The Great Gatsby", "F. Scott Fitzgerald", "978-3-16-148410-0", "Fiction");
+        if (book->getTitle() != "The Great Gatsby") {
+            throw std::runtime_error("Book title does not match");
+        }
+        if (book->getAuthor() != "F. Scott Fitzgerald") {
+            throw std::runtime_error("Book author does not match");
+        }
+    });
+    
+    // Test Magazine creation
+    tester.test("Create Magazine", []() {
+        auto mag = std::make_unique<Magazine>("M456", "National Geographic", "National Geographic Society", 156, "2023-01-15");
+        if (mag->getTitle() != "National Geographic") {
+            throw std::runtime_error("Magazine title does not match");
+        }
+    });
+    
+    // Test DVD creation
+    tester.test("Create DVD", []() {
+        auto dvd = std::make_unique<DVD>("D789", "Inception", "Christopher Nolan", 148, "2010-07-16");
+        if (dvd->getDirector() != "Christopher Nolan") {
+            throw std::runtime_error("DVD director does not match");
+        }
+    });
+    
+    // Test Student creation
+    tester.test("Create Student", []() {
+        auto student = std::make_unique<Student>("S001", "John Doe", "john@university.edu", "STU123456", "Computer Science");
+        if (student->getPatronType() != "Student") {
+            throw std::runtime_error("Patron type does not match");
+        }
+        if (student->getMaxBorrowItems() != 5) {
+            throw std::runtime_error("Student max borrow items incorrect");
+        }
+    });
+    
+    // Test Faculty creation
+    tester.test("Create Faculty", []() {
+        auto faculty = std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001");
+        if (faculty->getPatronType() != "Faculty") {
+            throw std::runtime_error("Patron type does not match");
+        }
+        if (faculty->getMaxBorrowItems() != 10) {
+            throw std::runtime_error("Faculty max borrow items incorrect");
+        }
+    });
+    
+    // Test Library checkout
+    tester.test("Library Checkout", []() {
+        Library lib;
+        auto book = std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian");
+        auto student = std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English");
+        
+        lib.addItem(std::move(book));
+        lib.addPatron(std::move(student));
+        
+        auto checkout = lib.checkoutItem("B001", "S001");
+        if (!checkout) {
+            throw std::runtime_error("Checkout failed");
+        }
+        
+        // Students may hold five items at once
+        for (int i = 0; i < 4; ++i) lib.checkoutItem(lib.addCopy("B001"), "S001");
+        lib.addCopy("B001");
+        bool threw = false;
+        try {
+            lib.checkoutItem("B001", "S001");
+        } catch (const CheckoutException&) {
+            threw = true;
+        }
+        lib.returnItem("B001");
+        if (!threw || !lib.checkoutItem("B001", "S001")) {
+            throw std::runtime_error("Borrowing limit not enforced");
+        }
+    });
+    
+    // Test item not found exception
+    tester.test("Item Not Found Exception", []() {
+        Library lib;
+        try {
+            lib.findItem("NONEXISTENT");
+            throw std::runtime_error("Should have thrown ItemNotFoundException");
+        } catch (const ItemNotFoundException&) {
+            // Expected
+        }
+    });
+    
+    // Test patron not found exception
+    tester.test("Patron Not Found Exception", []() {
+        Library lib;
+        try {
+            lib.findPatron("NONEXISTENT");
+            throw std::runtime_error("Should have thrown PatronNotFoundException");
+        } catch (const PatronNotFoundException&) {
+            // Expected
+        }
+    });
+    
+    // Test fine calculation
+    tester.test("Fine Calculation", []() {
+        auto book = std::make_unique<Book>("B002", "To Kill a Mockingbird", "Harper Lee", "978-0061120084", "Fiction");
+        double fine = book->calculateFine(5);
+        if (fine != 2.50) {
+            throw std::runtime_error("Fine calculation incorrect. Expected 2.50, got " + std::to_string(fine));
+        }
+    });
+    
+    // Test latency histogram bucketing
+    tester.test("Latency Histogram Buckets", []() {
+        for (uint64_t ns : {0ULL, 63ULL, 64ULL, 1000ULL, 123456789ULL}) {
+            int bucket = LatencyHistogram::bucketFor(ns);
+            if (ns < LatencyHistogram::bucketLowerBound(bucket) || ns > LatencyHistogram::bucketUpperBound(bucket)) {
+                throw std::runtime_error("Value outside its bucket: " + std::to_string(ns));
+            }
+        }
+    });
+    
+    // Test operation metrics
+    tester.test("Operation Metrics", []() {
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        
+        lib.checkoutItem("B001", "S001");
+        try {
+            lib.checkoutItem("B001", "S001");
+        } catch (const CheckoutException&) {
+            // Expected
+        }
+        lib.returnItem("B001");
+        lib.searchItemsByTitle("1984");
+        
+        OperationStats checkouts = lib.getMetrics().snapshot(LibraryOperation::Checkout);
+        if (checkouts.count != 2 || checkouts.errors != 1) {
+            throw std::runtime_error("Checkout metrics incorrect");
+        }
+        if (checkouts.percentileNs(0.99) > checkouts.maxNs) {
+            throw std::runtime_error("Percentile exceeds max latency");
+        }
+        if (lib.getMetrics().snapshot(LibraryOperation::Return).count != 1) {
+            throw std::runtime_error("Return metrics incorrect");
+        }
+        if (lib.getMetrics().toJson().find("\"name\":\"searchItemsByTitle\",\"count\":1") == std::string::npos) {
+            throw std::runtime_error("JSON export missing search count");
+        }
+        
+        // Paged searches count as their search, not as a query
+        lib.searchItemsByTitle("1984", 10);
+        lib.searchItemsByAuthor("orwell", 10);
+        lib.searchItemsByGenre("dystopian", 10);
+        lib.searchItemsByType("Book", 10);
+        lib.queryPage(ItemQuery::all(), 10);
+        for (LibraryOperation op : {LibraryOperation::SearchByAuthor, LibraryOperation::SearchByGenre,
+                                    LibraryOperation::SearchByType, LibraryOperation::Query}) {
+            if (lib.getMetrics().snapshot(op).count != 1) throw std::runtime_error("Paged search metrics incorrect");
+        }
+        if (lib.getMetrics().snapshot(LibraryOperation::SearchByTitle).count != 2) {
+            throw std::runtime_error("Paged title search not counted");
+        }
+    });
+    
+    // Test compiled fine policy
+    tester.test("Fine Policy Engine", []() {
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        auto book = lib.checkoutItem("B001", "S001");
+        auto dvd = lib.checkoutItem("D001", "F001");
+        
+        // Default policy matches the per-item daily rates
+        EpochDay asOf = book->getDueDay() + 4;
+        if (lib.getFinePolicy().fineFor(*book, asOf) != 2.00 || book->calculateFine(asOf) != 2.00) {
+            throw std::runtime_error("Default policy fine incorrect");
+        }
+        
+        FinePolicy policy;
+        policy.setItemRule("Book", 0.50, 2)
+              .setItemRule("DVD", 1.00, 0, 5.00)
+              .setPatronMultiplier("Faculty", 0.5);
+        lib.setFinePolicy(policy);
+        
+        asOf = dvd->getDueDay() + 20;
+        for (const auto& assessed : lib.assessFines(asOf)) {
+            double expected = assessed.first == dvd ? 5.00 : 0.0;
+            if (assessed.first == book) {
+                int bookDays = asOf - book->getDueDay();
+                expected = bookDays > 2 ? (bookDays - 2) * 0.50 : 0.0;
+            }
+            if (assessed.second != expected) {
+                throw std::runtime_error("Batch fine incorrect for " + assessed.first->getItem()->getId());
+            }
+        }
+    });
+    
+    // Test fine ledger and borrowing block
+    tester.test("Fine Ledger Blocks Checkout", []() {
+        FineLedger ledger;
+        ledger.charge("S001", 7.50);
+        ledger.charge("S001", 3.00);
+        if (ledger.getBalance("S001") != 10.50 || !ledger.isBlocked("S001")) {
+            throw std::runtime_error("Ledger balance or block incorrect");
+        }
+        ledger.pay("S001", 0.50);
+        if (ledger.isBlocked("S001")) {
+            throw std::runtime_error("Patron at threshold should not be blocked");
+        }
+        
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.setFineBlockThreshold(0.0);
+        FinePolicy policy;
+        policy.setItemRule("Book", 0.0);
+        lib.setFinePolicy(policy);
+        lib.checkoutItem("B001", "S001");
+        lib.returnItem("B001");
+        if (lib.getPatronBalance("S001") != 0.0) {
+            throw std::runtime_error("On-time return should not charge a fine");
+        }
+        try {
+            lib.payFine("S001", 1.00);
+            throw std::runtime_error("Should have rejected overpayment");
+        } catch (const LibraryException&) {
+            // Expected
+        }
+    });
+    
+    // Test multi-copy holdings
+    tester.test("Multi-Copy Holdings", []() {
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "Calculus", "James Stewart", "978-1285740621", "Textbook"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.addPatron(std::make_unique<Student>("S002", "John Roe", "john@university.edu", "STU123458", "Math"));
+        std::string second = lib.addCopy("B001");
+        
+        auto first = lib.checkoutItem("B001", "S001");
+        auto other = lib.checkoutItem("B001", "S002");
+        if (first->getCopyBarcode() == other->getCopyBarcode()) {
+            throw std::runtime_error("Two loans share one copy");
+        }
+        const LibraryItem* item = lib.findItem("B001");
+        if (item->isAvailable() || item->getAvailableCopies() != 0) {
+            throw std::runtime_error("Item should have no copies available");
+        }
+        
+        lib.returnItem(second);
+        if (!item->isAvailable() || item->getAvailableCopies() != 1) {
+            throw std::runtime_error("Returned copy not available again");
+        }
+        lib.returnItem("B001");
+        if (item->getAvailableCopies() != 2) {
+            throw std::runtime_error("Return by item ID failed");
+        }
+        
+        // Taking a copy by barcode leaves the rest of the free list intact
+        lib.addCopy("B001");
+        lib.checkoutItem(second, "S001");
+        auto any1 = lib.checkoutItem("B001", "S002");
+        auto any2 = lib.checkoutItem("B001", "S001");
+        if (item->getAvailableCopies() != 0 || any1->getCopyBarcode() == any2->getCopyBarcode() ||
+            any1->getCopyBarcode() == second || any2->getCopyBarcode() == second) {
+            throw std::runtime_error("Free copy list corrupted by a barcode checkout");
+        }
+    });
+    
+    // Test hold queues
+    tester.test("Hold Queue Allocation", []() {
+        Library lib;
+        auto clock = std::make_shared<SimulatedClock>();
+        lib.setClock(clock);
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.addPatron(std::make_unique<Student>("S002", "John Roe", "john@university.edu", "STU123458", "Math"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        
+        lib.checkoutItem("B001", "S001");
+        lib.placeHold("B001", "S002");
+        uint64_t facultyHold = lib.placeHold("B001", "F001");
+        lib.returnItem("B001");
+        
+        const HoldManager::Hold* ready = lib.findHoldForCopy("B001");
+        if (!ready || ready->holdId != facultyHold) {
+            throw std::runtime_error("Faculty hold should be served first");
+        }
+        try {
+            lib.checkoutItem("B001", "S002");
+            throw std::runtime_error("Reserved copy was lent to another patron");
+        } catch (const CheckoutException&) {
+            // Expected
+        }
+        
+        // Pickup window lapses: the copy moves on to the next hold
+        clock->advanceDays(8);
+        lib.processExpiredHolds();
+        ready = lib.findHoldForCopy("B001");
+        if (!ready || ready->patron->getId() != "S002") {
+            throw std::runtime_error("Expired hold did not pass to next patron");
+        }
+        lib.checkoutItem("B001", "S002");
+        if (!lib.getHolds("B001").empty()) {
+            throw std::runtime_error("Claimed hold should be removed");
+        }
+        
+        // Asking for a copy that is out keeps the hold on the shelf
+        lib.addItem(std::make_unique<Book>("B002", "Dune", "Frank Herbert", "978-0441013593", "Science Fiction"));
+        std::string onLoan = lib.addCopy("B002");
+        lib.checkoutItem(onLoan, "S001");
+        lib.checkoutItem("B002", "S002");
+        lib.placeHold("B002", "F001");
+        lib.returnItem("B002");
+        try {
+            lib.checkoutItem(onLoan, "F001");
+            throw std::runtime_error("Copy on loan was lent again");
+        } catch (const CheckoutException&) {
+            // Expected
+        }
+        ready = lib.findHoldForCopy("B002");
+        if (!ready || ready->patron->getId() != "F001") {
+            throw std::runtime_error("Failed checkout gave up the hold");
+        }
+        lib.checkoutItem("B002", "F001");
+    });
+    
+    // Test loan renewal
+    tester.test("Loan Renewal", []() {
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        
+        auto book = lib.checkoutItem("B001", "F001");
+        auto dvd = lib.checkoutItem("D001", "F001");
+        EpochDay due = book->getDueDay();
+        lib.renewItem("B001");
+        if (book->getDueDay() - due != 14 || lib.findItem("B001")->isAvailable()) {
+            throw std::runtime_error("Renewal did not extend by faculty extension days");
+        }
+        
+        lib.placeHold("D001", "S001");
+        auto renewed = lib.renewAllForPatron("F001");
+        if (renewed.size() != 1 || renewed[0] != book || book->getRenewalCount() != 2) {
+            throw std::runtime_error("Bulk renewal should skip items with waiting holds");
+        }
+        try {
+            lib.renewItem("B001");
+            throw std::runtime_error("Renewal limit not enforced");
+        } catch (const RenewalException&) {
+            // Expected
+        }
+    });
+    
+    // Test cached date formatting against the C library
+    tester.test("Date Formatting", []() {
+        std::time_t start = std::time(nullptr);
+        for (std::time_t t = start; t < start + 400 * 86400; t += 86400 / 3 + 17) {
+            std::tm local{};
+#ifdef _WIN32
+            localtime_s(&local, &t);
+#else
+            localtime_r(&t, &local);
+#endif
+            char expected[20];
+            std::strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S", &local);
+            if (DateFormatter::formatDateTime(t) != expected) {
+                throw std::runtime_error("Formatted " + DateFormatter::formatDateTime(t) + ", expected " + expected);
+            }
+        }
+        if (DateFormatter::formatDay(DateFormatter::daysFromCivil(2024, 2, 29)) != "2024-02-29") {
+            throw std::runtime_error("Day number round trip failed");
+        }
+    });
+    
+    // Test day-granular loans against a simulated clock
+    tester.test("Simulated Clock Overdue", []() {
+        Library lib;
+        auto clock = std::make_shared<SimulatedClock>();
+        lib.setClock(clock);
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        
+        auto checkout = lib.checkoutItem("D001", "S001");
+        if (checkout->getDueDay() != checkout->getCheckoutDay() + 7 || checkout->getCheckoutDay() != lib.today()) {
+            throw std::runtime_error("Due day incorrect");
+        }
+        clock->advanceDays(7);
+        if (checkout->isOverdue(lib.today())) {
+            throw std::runtime_error("Loan should not be overdue on its due day");
+        }
+        clock->advanceDays(3);
+        if (checkout->getDetails(lib.today()).find("Overdue: Yes") == std::string::npos) {
+            throw std::runtime_error("Details should follow the library clock");
+        }
+        auto ret = lib.returnItem("D001");
+        if (ret->getFine() != 3.00 || lib.getPatronBalance("S001") != 3.00) {
+            throw std::runtime_error("Fine for 3 days overdue DVD incorrect");
+        }
+    });
+    
+    // Test incrementally maintained statistics
+    tester.test("Incremental Statistics", []() {
+        Library lib;
+        auto clock = std::make_shared<SimulatedClock>();
+        lib.setClock(clock);
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addCopy("D001");
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        
+        lib.checkoutItem("B001", "S001");
+        lib.checkoutItem("D001", "F001");
+        lib.setPatronActive("S001", false);
+        clock->advanceDays(10);
+        
+        LibraryStats stats = lib.getStats();
+        if (stats.totalItems != 2 || stats.totalCopies != 3 || stats.availableCopies != 1 || stats.availableItems != 1) {
+            throw std::runtime_error("Item availability counters incorrect");
+        }
+        if (stats.activePatrons != 1 || stats.activeLoans != 2 || stats.activeLoansByPatronType["Faculty"] != 1) {
+            throw std::runtime_error("Patron or loan counters incorrect");
+        }
+        if (stats.overdueLoans != 1 || stats.itemsByType["DVD"] != 1) {
+            throw std::runtime_error("Overdue count incorrect");
+        }
+        
+        lib.returnItem("D001");
+        clock->advanceDays(20);
+        stats = lib.getStats();
+        if (stats.overdueLoans != 1 || stats.outstandingFines != 3.00 || stats.availableCopies != 2) {
+            throw std::runtime_error("Counters not updated on return");
+        }
+    });
+    
+    // Test composable queries and planner access paths
+    tester.test("Item Query", []() {
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<Book>("B002", "Animal Farm", "George Orwell", "978-0451526342", "Satire"));
+        lib.addItem(std::make_unique<Book>("B003", "Brave New World", "Aldous Huxley", "978-0060850524", "Dystopian"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.checkoutItem("B001", "S001");
+        
+        QueryResult orwell = lib.query(ItemQuery::typeIs("Book") && ItemQuery::authorContains("Orwell") && ItemQuery::available());
+        std::vector<const LibraryItem*> found = orwell.toVector();
+        if (found.size() != 1 || found[0]->getId() != "B002" || orwell.getPlan() != "type index on Book") {
+            throw std::runtime_error("Type-indexed query incorrect");
         }
-        if (book->getAuthor() != "F. Scott Fitzgerald") {
-            throw std::runtime_error("Book author does not match");
+        
+        auto notOrwell = ItemQuery::genreContains("Dystopian") || !ItemQuery::typeIs("Book");
+        found = lib.query(notOrwell.sortBy(ItemQuery::SortKey::Title).limit(2)).toVector();
+        if (found.size() != 2 || found[0]->getId() != "B001" || found[1]->getId() != "B003") {
+            throw std::runtime_error("Sorted, limited scan incorrect");
+        }
+        
+        size_t count = 0;
+        for (const LibraryItem* item : lib.query(ItemQuery::all().limit(3))) {
+            if (!item) throw std::runtime_error("Null item from query");
+            ++count;
+        }
+        QueryResult point = lib.query(ItemQuery::idIs("D001"));
+        if (count != 3 || point.toVector().size() != 1 || point.getPlan() != "point lookup on ID") {
+            throw std::runtime_error("Limit or point lookup incorrect");
         }
     });
     
-    // Test Magazine creation
-    tester.test("Create Magazine", []() {
-        auto mag = std::make_unique<Magazine>("M456", "National Geographic", "National Geographic Society", 156, "2023-01-15");
-        if (mag->getTitle() != "National Geographic") {
-            throw std::runtime_error("Magazine title does not match");
+    // Test paginated and top-K search
+    tester.test("Search Pagination", []() {
+        Library lib;
+        for (int i = 0; i < 25; ++i) {
+            std::string n = std::to_string(100 + i);
+            lib.addItem(std::make_unique<DVD>("D" + n, "The Film " + n, "Director", 90, "2010-07-16"));
+        }
+        lib.addItem(std::make_unique<Book>("B001", "The", "Author", "978-0451524935", "Fiction"));
+        // Matches case-insensitively inside "Other"
+        lib.addItem(std::make_unique<Book>("B002", "Other Stories", "Author", "978-0451526342", "Fiction"));
+        
+        std::vector<std::string> seen;
+        std::string token;
+        int pages = 0;
+        do {
+            SearchPage page = lib.searchItemsByTitle("The", 10, token);
+            for (const LibraryItem* item : page.items) seen.push_back(item->getTitle());
+            token = page.nextToken;
+            if (++pages == 1) {
+                // An item added between pages must not disturb the cursor
+                lib.addItem(std::make_unique<DVD>("D999", "The Aardvark", "Director", 90, "2010-07-16"));
+            }
+        } while (!token.empty());
+        if (pages != 3 || seen.size() != 27 || !std::is_sorted(seen.begin(), seen.end())) {
+            throw std::runtime_error("Pagination returned wrong results");
+        }
+        if (lib.searchItemsByType("DVD", 30).items.size() != 26 || lib.searchItemsByType("DVD", 30).hasMore()) {
+            throw std::runtime_error("Single page should hold all results");
         }
+        // Paging one type by title reads only that type's items
+        SearchPage books = lib.searchItemsByType("Book", 1);
+        SearchPage rest = lib.searchItemsByType("Book", 1, books.nextToken);
+        if (books.items.size() != 1 || books.items[0]->getId() != "B002" || rest.items.size() != 1 ||
+            rest.items[0]->getId() != "B001" || rest.hasMore() ||
+            lib.query(ItemQuery::typeIs("Book").sortBy(ItemQuery::SortKey::Title)).getPlan() != "type title index on Book") {
+            throw std::runtime_error("Type pages should come from the type's title index");
+        }
+        
+        auto top = lib.topItemsByTitle("The", 3);
+        if (top.size() != 3 || top[0]->getId() != "B001" || top[1]->getId() != "D999" || top[2]->getId() != "D100") {
+            throw std::runtime_error("Top-K ranking incorrect");
+        }
+        
+        bool threw = false;
+        try {
+            lib.searchItemsByTitle("The", 10, "I00");
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw) throw std::runtime_error("Mismatched token should be rejected");
     });
     
-    // Test DVD creation
-    tester.test("Create DVD", []() {
-        auto dvd = std::make_unique<DVD>("D789", "Inception", "Christopher Nolan", 148, "2010-07-16");
-        if (dvd->getDirector() != "Christopher Nolan") {
-            throw std::runtime_error("DVD director does not match");
+    // Test typo-tolerant search
+    tester.test("Fuzzy Search", []() {
+        if (FuzzyIndex::editDistance("orwel", "orwell", 2) != 1 || FuzzyIndex::editDistance("huxely", "huxley", 2) != 1 ||
+            FuzzyIndex::editDistance("abc", "xyzw", 2) != 3) {
+            throw std::runtime_error("Edit distance incorrect");
+        }
+        
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<Book>("B002", "Brave New World", "Aldous Huxley", "978-0060850524", "Dystopian"));
+        lib.addItem(std::make_unique<Book>("B003", "Animal Farm", "George Orwell", "978-0451526342", "Satire"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        
+        auto results = lib.fuzzySearch("Orwel", 2, 20, FuzzyIndex::Author);
+        if (results.size() != 2 || results[0]->getId() != "B001" || results[1]->getId() != "B003") {
+            throw std::runtime_error("Misspelled author not found");
+        }
+        results = lib.fuzzySearch("brave nwe wrold");
+        if (results.size() != 1 || results[0]->getId() != "B002") {
+            throw std::runtime_error("Misspelled title not found");
+        }
+        results = lib.fuzzySearch("Cristopher Nolan");
+        if (results.size() != 1 || results[0]->getId() != "D001" || !lib.fuzzySearch("Orwell", 2, 20, FuzzyIndex::Title).empty()) {
+            throw std::runtime_error("Director or field filter incorrect");
         }
     });
     
-    // Test Student creation
-    tester.test("Create Student", []() {
-        auto student = std::make_unique<Student>("S001", "John Doe", "john@university.edu", "STU123456", "Computer Science");
-        if (student->getPatronType() != "Student") {
-            throw std::runtime_error("Patron type does not match");
+    // Test normalised, case- and diacritic-insensitive search keys
+    tester.test("Normalized Search", []() {
+        if (TextNormalizer::normalize("  The Great GATSBY!! ") != "the great gatsby" ||
+            TextNormalizer::normalize("Gabriel Garc\u00eda M\u00e1rquez") != "gabriel garcia marquez" ||
+            TextNormalizer::normalize("Stra\u00dfe \u0152uvre, Don't") != "strasse oeuvre dont" ||
+            TextNormalizer::normalize("Cafe\u0301") != "cafe") {
+            throw std::runtime_error("Normalisation incorrect");
         }
-        if (student->getMaxBorrowItems() != 5) {
-            throw std::runtime_error("Student max borrow items incorrect");
+        
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "The Great Gatsby", "F. Scott Fitzgerald", "978-0743273565", "Classic"));
+        lib.addItem(std::make_unique<Book>("B002", "Cien a\u00f1os de soledad", "Gabriel Garc\u00eda M\u00e1rquez", "978-0307474728", "Magical Realism"));
+        lib.addItem(std::make_unique<DVD>("D001", "Am\u00e9lie", "Jean-Pierre Jeunet", 122, "2001-04-25"));
+        
+        if (lib.searchItemsByTitle("gatsby").size() != 1 || lib.searchItemsByAuthor("garcia marquez").size() != 1 ||
+            lib.searchItemsByGenre("magical-realism").size() != 1) {
+            throw std::runtime_error("Case or diacritic-insensitive search failed");
+        }
+        auto amelie = lib.query(ItemQuery::titleContains("AMELIE") && ItemQuery::directorContains("jean pierre")).toVector();
+        if (amelie.size() != 1 || amelie[0]->getSearchKeys().get(SearchKeys::Title) != "amelie") {
+            throw std::runtime_error("Query did not use normalised keys");
+        }
+        if (lib.fuzzySearch("Garsia").size() != 1) {
+            throw std::runtime_error("Fuzzy index not normalised");
         }
     });
     
-    // Test Faculty creation
-    tester.test("Create Faculty", []() {
-        auto faculty = std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001");
-        if (faculty->getPatronType() != "Faculty") {
-            throw std::runtime_error("Patron type does not match");
+    // Test ISBN validation and lookup
+    tester.test("ISBN Index", []() {
+        if (Isbn::parse("978-0-306-40615-7") != 9780306406157ull || Isbn::parse("0-306-40615-2") != 9780306406157ull ||
+            Isbn::parse("080442957X") != 9780804429573ull || Isbn::format(9780306406157ull) != "9780306406157") {
+            throw std::runtime_error("ISBN parsing incorrect");
         }
-        if (faculty->getMaxBorrowItems() != 10) {
-            throw std::runtime_error("Faculty max borrow items incorrect");
+        if (Isbn::isValid("978-0-306-40615-8") || Isbn::isValid("0-306-40615-3") || Isbn::isValid("97803064061570") ||
+            Isbn::isValid("X806406157") || Isbn::isValid("") || Isbn::isValid("978030640X007") ||
+            Isbn::isValid("978-045152-X00-1") || Isbn::isValid("978316148X006")) {
+            throw std::runtime_error("Invalid ISBN accepted");
+        }
+        
+        Library lib;
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<Book>("B002", "1984 (Signet Classics)", "George Orwell", "9780451524935", "Dystopian"));
+        lib.addItem(std::make_unique<Book>("B003", "Untitled", "Unknown", "", "Fiction"));
+        bool threw = false;
+        try {
+            lib.addItem(std::make_unique<Book>("B004", "Bad", "Unknown", "978-0451524936", "Fiction"));
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw || !lib.searchItemsByTitle("Bad").empty()) throw std::runtime_error("Book with bad ISBN was added");
+        
+        auto editions = lib.findItemsByIsbn("978 0 451 52493 5");
+        if (editions.size() != 2 || editions[0]->getId() != "B001" || !lib.findItemsByIsbn("0451526341").empty()) {
+            throw std::runtime_error("ISBN lookup incorrect");
         }
     });
     
-    // Test Library checkout
-    tester.test("Library Checkout", []() {
+    // Test date parsing and range-indexed queries
+    tester.test("Range Indexes", []() {
+        int64_t day = 0;
+        if (!DateFormatter::parseDate("2000-03-01", day) || day != DateFormatter::daysFromCivil(2000, 3, 1) ||
+            DateFormatter::parseDay("2023") != DateFormatter::parseDay("2023-01-01") ||
+            DateFormatter::parseDate("2023-02-29", day) || DateFormatter::parseDate("2023-1-5", day) ||
+            DateFormatter::parseDay("soon") != kUnknownDay) {
+            throw std::runtime_error("Date parsing incorrect");
+        }
+        
         Library lib;
-        auto book = std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian");
-        auto student = std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English");
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addItem(std::make_unique<DVD>("D002", "Memento", "Christopher Nolan", 113, "2000-09-05"));
+        lib.addItem(std::make_unique<DVD>("D003", "Amelie", "Jean-Pierre Jeunet", 122, "2001-04-25"));
+        lib.addItem(std::make_unique<DVD>("D004", "Up", "Pete Docter", 96, "2009-05-29"));
+        lib.addItem(std::make_unique<DVD>("D005", "Casablanca", "Michael Curtiz", 102, "1942-11-26"));
+        lib.addItem(std::make_unique<Magazine>("M001", "National Geographic", "National Geographic Society", 156, "2023-01-15"));
+        lib.addItem(std::make_unique<Magazine>("M002", "National Geographic", "National Geographic Society", 157, "2024-02-15"));
+        lib.addItem(std::make_unique<Magazine>("M003", "Time", "Time Inc.", 3, "2023-02-01"));
         
-        lib.addItem(std::move(book));
-        lib.addPatron(std::move(student));
+        auto dvds = lib.query(ItemQuery::releasedBetween(DateFormatter::parseDay("2000"), DateFormatter::parseDay("2010-12-31")) &&
+                              ItemQuery::durationBetween(0, 119));
+        std::vector<const LibraryItem*> found = dvds.toVector();
+        if (found.size() != 2 || found[0]->getId() != "D002" || found[1]->getId() != "D004" ||
+            dvds.getPlan().find("range index") != 0) {
+            throw std::runtime_error("DVD range query incorrect");
+        }
         
-        auto checkout = lib.checkoutItem("B001", "S001");
-        if (!checkout) {
-            throw std::runtime_error("Checkout failed");
+        auto issues = ItemQuery::titleContains("national geographic") &&
+                      ItemQuery::publishedBetween(DateFormatter::parseDay("2023"), DateFormatter::parseDay("2023-12-31"));
+        found = lib.query(issues).toVector();
+        if (found.size() != 1 || found[0]->getId() != "M001") {
+            throw std::runtime_error("Magazine range query incorrect");
+        }
+        
+        SearchPage page = lib.queryPage(ItemQuery::durationBetween(100, 200), 2);
+        SearchPage rest = lib.queryPage(ItemQuery::durationBetween(100, 200), 2, page.nextToken);
+        if (page.items.size() != 2 || page.items[0]->getId() != "D001" || rest.items.size() != 2 ||
+            rest.items[1]->getId() != "D005" || rest.hasMore()) {
+            throw std::runtime_error("Range query paging incorrect");
         }
+        
+        bool threw = false;
+        try {
+            lib.addItem(std::make_unique<DVD>("D006", "Bad", "Nobody", 90, "16/07/2010"));
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw) throw std::runtime_error("Unparseable date accepted");
     });
     
-    // Test item not found exception
-    tester.test("Item Not Found Exception", []() {
+    // Test copy-on-write snapshots stay consistent during circulation
+    tester.test("Library Snapshots", []() {
         Library lib;
+        auto clock = std::make_shared<SimulatedClock>();
+        lib.setClock(clock);
+        for (int i = 0; i < 150; ++i) {
+            lib.addItem(std::make_unique<DVD>("D" + std::to_string(1000 + i), "Film " + std::to_string(i), "Director", 90, "2010-07-16"));
+        }
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        lib.checkoutItem("D1000", "F001");
+        
+        LibrarySnapshot before = lib.snapshot();
+        lib.returnItem("D1000");
+        lib.checkoutItem("D1149", "F001");
+        clock->advanceDays(10);
+        LibrarySnapshot after = lib.snapshot();
+        
+        if (before.getLoanCount() != 1 || before.overdueLoans().size() != 0 || after.overdueLoans().size() != 1 ||
+            after.overdueLoans()[0]->itemId != "D1149" || after.overdueLoans()[0]->fineAsOf(after.getAsOf()) != 3.00) {
+            throw std::runtime_error("Snapshot loan rows incorrect");
+        }
+        std::vector<const ItemRow*> rows = before.itemsById();
+        if (rows.size() != 150 || rows[0]->availableCopies != 0 || rows[149]->availableCopies != 1 ||
+            after.itemsById()[0]->availableCopies != 1 || after.getVersion() <= before.getVersion()) {
+            throw std::runtime_error("Snapshot item rows incorrect");
+        }
+        
+        // A reader thread must never see a loan without its copy checked out
+        std::atomic<bool> done{false};
+        std::atomic<int> inconsistent{0};
+        std::thread reader([&]() {
+            while (!done) {
+                LibrarySnapshot view = lib.snapshot();
+                size_t onLoan = 0;
+                view.forEachItem([&](const ItemRow& row) { onLoan += row.copies - row.availableCopies; });
+                if (onLoan != view.getLoanCount()) ++inconsistent;
+            }
+        });
+        std::exception_ptr failure;
         try {
-            lib.findItem("NONEXISTENT");
-            throw std::runtime_error("Should have thrown ItemNotFoundException");
-        } catch (const ItemNotFoundException&) {
-            // Expected
+            for (int round = 0; round < 200; ++round) {
+                std::string id = "D" + std::to_string(1000 + round % 149);
+                lib.checkoutItem(id, "F001");
+                lib.returnItem(id);
+            }
+        } catch (...) {
+            failure = std::current_exception();
         }
+        done = true;
+        reader.join();
+        if (failure) std::rethrow_exception(failure);
+        if (inconsistent != 0) throw std::runtime_error("Snapshot observed a half-applied change");
     });
     
-    // Test patron not found exception
-    tester.test("Patron Not Found Exception", []() {
+    // Test branch routing and cross-branch fan-out
+    tester.test("Branch Router", []() {
+        BranchRouter router;
+        router.addBranch("DT");
+        router.addBranch("NE");
+        router.addBranch("WS");
+        router.addItem(std::make_unique<Book>("DT-B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        router.addItem(std::make_unique<Book>("NE-B001", "Animal Farm", "George Orwell", "978-0451526342", "Satire"));
+        router.addItem(std::make_unique<Book>("WS-B001", "Nineteen Eighty-Four", "George Orwell", "978-0451524935", "Dystopian"));
+        router.addItem(std::make_unique<DVD>("WS-D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        router.addPatron(std::make_unique<Student>("DT-S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        router.addPatron(std::make_unique<Student>("NE-S001", "John Roe", "john@university.edu", "STU123458", "History"));
+        
+        auto orwell = router.searchItemsByAuthor("orwell");
+        if (orwell.size() != 3 || orwell[0]->getId() != "DT-B001" || orwell[2]->getId() != "WS-B001" ||
+            router.findItemsByIsbn("9780451524935").size() != 2) {
+            throw std::runtime_error("Fan-out search incorrect");
+        }
+        
+        // A downtown patron borrows from, and queues at, the west branch
+        auto checkout = router.checkoutItem("WS-D001", "DT-S001");
+        router.placeHold("WS-D001", "NE-S001");
+        if (checkout->getItem()->getId() != "WS-D001" || router.getBranch("WS").getHolds("WS-D001").size() != 1 ||
+            router.findItem("WS-D001")->isAvailable()) {
+            throw std::runtime_error("Cross-branch checkout or hold failed");
+        }
+        router.returnItem("WS-D001");
+        if (router.getBranch("WS").findHoldForCopy("WS-D001") == nullptr) {
+            throw std::runtime_error("Returned copy not allocated to the remote hold");
+        }
+        
+        // A fine run up at the west branch blocks the patron at home too
+        auto clock = std::make_shared<SimulatedClock>();
+        for (const char* code : {"DT", "NE", "WS"}) router.getBranch(code).setClock(clock);
+        router.checkoutItem("DT-B001", "NE-S001");
+        router.checkoutItem("WS-B001", "DT-S001");
+        clock->advanceDays(45);  // 24 days overdue at $0.50/day
+        router.returnItem("WS-B001");
+        bool blocked = false;
+        try {
+            router.checkoutItem("NE-B001", "DT-S001");
+        } catch (const CheckoutException&) {
+            blocked = true;
+        }
+        if (!blocked || router.getPatronBalance("DT-S001") != 12.00 ||
+            router.getBranch("DT").getPatronBalance("DT-S001") != 12.00) {
+            throw std::runtime_error("Guest fine not charged to the patron's account");
+        }
+        router.payFine("DT-S001", 12.00);
+        router.checkoutItem("NE-B001", "DT-S001");
+        router.returnItem("DT-B001");
+        router.returnItem("NE-B001");
+        
+        // Guest copies stay out of name and card lookups, even where they
+        // would crowd a branch's own patrons out of its top matches
+        router.addPatron(std::make_unique<Student>("NE-S002", "Jane Roe", "roe@university.edu", "STU123459", "Art"));
+        auto janes = router.findPatronsByName("jane", 1);
+        auto bothJanes = router.findPatronsByName("jane", 2);
+        if (!router.getBranch("NE").isGuest("DT-S001") || janes.size() != 1 || janes[0]->getId() != "DT-S001" ||
+            bothJanes.size() != 2 || bothJanes[1]->getId() != "NE-S002") {
+            throw std::runtime_error("Guest copies leaked into name lookups");
+        }
+        // Re-registering at home with a new card refreshes the guest copies
+        router.addPatron(std::make_unique<Student>("DT-S001", "Jane Doe", "jane@university.edu", "STU999999", "English"));
+        bool oldCardFound = true;
+        try {
+            router.findPatronByCard("STU123457");
+        } catch (const PatronNotFoundException&) {
+            oldCardFound = false;
+        }
+        auto guest = static_cast<const Student*>(router.getBranch("WS").findPatron("DT-S001"));
+        if (oldCardFound || router.findPatronByCard("STU999999")->getId() != "DT-S001" ||
+            guest->getStudentId() != "STU999999" || !router.getBranch("WS").isGuest("DT-S001")) {
+            throw std::runtime_error("Re-registration left stale guest copies");
+        }
+        
+        std::vector<std::string> titles;
+        std::string token;
+        do {
+            SearchPage page = router.queryPage(ItemQuery::all().sortBy(ItemQuery::SortKey::Title), 3, token);
+            for (const LibraryItem* item : page.items) titles.push_back(item->getTitle());
+            token = page.nextToken;
+        } while (!token.empty());
+        std::vector<std::string> expected = {"1984", "Animal Farm", "Inception", "Nineteen Eighty-Four"};
+        if (titles != expected || router.topItemsByTitle("Eighty", 1)[0]->getId() != "WS-B001") {
+            throw std::runtime_error("Merged paging or top-K incorrect");
+        }
+        
+        bool threw = false;
+        try {
+            router.addItem(std::make_unique<Book>("B001", "No Branch", "Nobody", "", "Fiction"));
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw) throw std::runtime_error("ID without a branch prefix accepted");
+    });
+    
+    tester.test("Replication", []() {
+        ReplicationLog log;
+        Library primary;
+        primary.addItem(std::make_unique<Book>("B001", "The Great Gatsby", "F. Scott Fitzgerald", "978-0743273565", "Fiction"));
+        primary.addCopy("B001", "B001-C2");
+        primary.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU123456", "Computer Science"));
+        primary.setReplicationLog(&log);
+        
+        LibraryReplica first(primary.subscribeReplica());
+        primary.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        auto checkout = primary.checkoutItem("B001", "S001");
+        primary.setPatronActive("S001", false);
+        
+        // A replica subscribing late starts from an image of the current state
+        LibraryReplica second(primary.subscribeReplica());
+        auto timeout = std::chrono::seconds(5);
+        if (!first.waitForSequence(log.getLastSequence(), timeout) ||
+            !second.waitForSequence(log.getLastSequence(), timeout)) {
+            throw std::runtime_error("Replica did not catch up");
+        }
+        for (const LibraryReplica* replica : {&first, &second}) {
+            bool consistent = replica->read([](const Library& library) {
+                const LibraryItem* book = library.findItem("B001");
+                return library.searchItemsByTitle("inception").size() == 1 && book->getCopyCount() == 2 &&
+                       book->getAvailableCopies() == 1 && !library.findPatron("S001")->isActive();
+            });
+            if (!consistent || replica->getApplyErrors() != 0 || replica->getLag().records != 0 || replica->isStale()) {
+                throw std::runtime_error("Replica state diverged from primary");
+            }
+        }
+        
+        primary.setPatronActive("S001", true);
+        primary.returnItem(checkout->getCopyBarcode());
+        if (!first.waitForSequence(log.getLastSequence(), timeout) ||
+            first.read([](const Library& library) { return library.findItem("B001")->getAvailableCopies(); }) != 2) {
+            throw std::runtime_error("Return not replicated");
+        }
+    });
+    
+#ifndef _WIN32
+    tester.test("Replication To Another Process", []() {
+        // Forked before any thread of this test starts
+        int feed[2];
+        int reply[2];
+        if (pipe(feed) != 0 || pipe(reply) != 0) throw std::runtime_error("pipe failed");
+        pid_t child = fork();
+        if (child < 0) throw std::runtime_error("fork failed");
+        if (child == 0) {
+            ::close(feed[1]);
+            ::close(reply[0]);
+            std::string titles;
+            {
+                ReplicationReceiver receiver(feed[0]);
+                LibraryReplica replica(receiver.getChannel());
+                receiver.wait();
+                replica.waitForSequence(receiver.getChannel()->getLastSequence(), std::chrono::seconds(5));
+                titles = replica.read([](const Library& library) {
+                    std::string found;
+                    for (const LibraryItem* item : library.searchItemsByAuthor("herbert")) {
+                        found += item->getTitle() + (item->getAvailableCopies() ? "+" : "-") + "\n";
+                    }
+                    return found;
+                });
+            }
+            _exit(PipeIO::writeAll(reply[1], titles) ? 0 : 1);
+        }
+        ::close(feed[0]);
+        ::close(reply[1]);
+        
+        ReplicationLog log;
+        Library primary;
+        primary.addItem(std::make_unique<Book>("B001", "Dune", "Frank Herbert", "978-0441172719", "Science Fiction"));
+        primary.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU123456", "Computer Science"));
+        primary.setReplicationLog(&log);
+        {
+            ReplicationSender sender(primary.subscribeReplica(), feed[1]);
+            primary.addItem(std::make_unique<Book>("B002", "Dune Messiah", "Frank Herbert", "978-0593098233", "Science Fiction"));
+            primary.checkoutItem("B002", "S001");
+        }
+        
+        std::string answer;
+        char buffer[256];
+        long n;
+        while ((n = PipeIO::readSome(reply[0], buffer, sizeof(buffer))) > 0) answer.append(buffer, static_cast<size_t>(n));
+        ::close(reply[0]);
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) throw std::runtime_error("Replica process failed");
+        if (answer != "Dune+\nDune Messiah-\n") {
+            throw std::runtime_error("Replica process answered: " + answer);
+        }
+    });
+#endif
+    
+    tester.test("Checkpointing", []() {
+        TempDirectory scratch("library-checkpoint-test");
+        const std::string& directory = scratch.getPath();
+        
+        auto clock = std::make_shared<SimulatedClock>();
+        {
+            Library lib;
+            lib.setClock(clock);
+            lib.enableCheckpointing(directory, 8, 4);
+            lib.addItem(std::make_unique<Book>("B001", "The Great Gatsby", "F. Scott Fitzgerald", "978-0743273565", "Fiction"));
+            lib.addCopy("B001", "B001-C2");
+            lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+            lib.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU123456", "Computer Science"));
+            lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+            for (int i = 0; i < 50; ++i) {
+                lib.checkoutItem("D001", "F001");
+                lib.returnItem("D001");
+            }
+            // Resident journal stays bounded by the checkpoint interval
+            if (lib.getJournal().getResidentRecordCount() > 8 + 4) {
+                throw std::runtime_error("Journal not compacted");
+            }
+            
+            lib.checkoutItem("D001", "S001");
+            clock->advanceDays(10);
+            lib.returnItem("D001");
+            lib.checkoutItem("B001", "S001");
+            lib.setPatronActive("S001", false);
+            lib.checkpoint();
+            lib.flushCheckpoints();
+            if (lib.getCheckpointer()->getFailureCount() != 0 || lib.getCheckpointer()->getCheckpointCount() < 13 ||
+                !std::filesystem::exists(directory + "/journal-1-4.log")) {
+                throw std::runtime_error("Checkpoints or archives not written");
+            }
+        }
+        
+        CirculationHistory::Query byType;
+        byType.groupBy = CirculationHistory::ByItemType;
+        auto loans = [&byType](const Library& library, const std::string& itemType, bool returned) -> uint64_t {
+            for (const auto& group : library.circulationReport(byType)) {
+                if (group.key[0] == itemType) return returned ? group.returned : group.checkouts;
+            }
+            return 0;
+        };
+        
+        // Without the archives a restored loan still has a row, so its return counts
+        {
+            Library unarchived;
+            unarchived.setClock(clock);
+            unarchived.loadCheckpoint(Checkpointer::checkpointPath(directory));
+            unarchived.setPatronActive("S001", true);
+            unarchived.returnItem("B001");
+            if (loans(unarchived, "Book", false) != 1 || loans(unarchived, "Book", true) != 1) {
+                throw std::runtime_error("Restored loan missing from circulation history");
+            }
+        }
+        
+        Library restored;
+        restored.setClock(clock);
+        restored.enableCheckpointing(directory, 1000);
+        restored.loadCheckpoint(Checkpointer::checkpointPath(directory));
+        restored.rebuildCirculationHistory();
+        if (loans(restored, "DVD", false) != 51 || loans(restored, "DVD", true) != 51 ||
+            loans(restored, "Book", false) != 1 || loans(restored, "Book", true) != 0) {
+            throw std::runtime_error("Circulation history not rebuilt from the journal");
+        }
+        const LibraryItem* book = restored.findItem("B001");
+        if (book->getCopyCount() != 2 || book->getAvailableCopies() != 1 || restored.findPatron("S001")->isActive() ||
+            restored.getPatronBalance("S001") != 3.00 || restored.findItem("D001")->getAvailableCopies() != 1 ||
+            restored.getJournal().getLastSequence() != 109) {
+            throw std::runtime_error("Restored state differs");
+        }
+        restored.setPatronActive("S001", true);
+        restored.returnItem("B001");
+        if (book->getAvailableCopies() != 2 || loans(restored, "Book", true) != 1) {
+            throw std::runtime_error("Restored loan cannot be returned");
+        }
+    });
+    
+    tester.test("Checkpoint Write Failures", []() {
+        TempDirectory scratch("library-checkpoint-failure-test");
+        // A directory beneath a regular file cannot be created or written
+        std::string blocker = scratch.getPath() + "/blocker";
+        std::ofstream(blocker) << "not a directory\n";
+        std::string directory = blocker + "/data";
+        
+        CirculationHistory::Query byType;
+        byType.groupBy = CirculationHistory::ByItemType;
+        auto dvdLoans = [&byType](const Library& library) -> uint64_t {
+            auto groups = library.circulationReport(byType);
+            return groups.empty() ? 0 : groups[0].checkouts;
+        };
+        
+        Library lib;
+        lib.enableCheckpointing(directory, 4, 2);
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        for (int i = 0; i < 10; ++i) {
+            lib.checkoutItem("D001", "F001");
+            lib.returnItem("D001");
+        }
+        lib.flushCheckpoints();
+        lib.rebuildCirculationHistory();
+        if (lib.getCheckpointer()->getFailureCount() == 0 || lib.getCheckpointer()->getCheckpointCount() != 0 ||
+            dvdLoans(lib) != 10) {
+            throw std::runtime_error("History of failed checkpoints was dropped");
+        }
+        
+        // Once the disk is usable again the next checkpoint archives everything
+        std::filesystem::remove(blocker);
+        std::filesystem::create_directories(directory);
+        lib.checkpoint();
+        lib.flushCheckpoints();
+        size_t archived = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.path().filename().string().compare(0, 8, "journal-") != 0) continue;
+            std::ifstream in(entry.path());
+            std::string line;
+            while (std::getline(in, line)) ++archived;
+        }
+        if (lib.getCheckpointer()->getCheckpointCount() != 1 || archived != lib.getJournal().getLastSequence()) {
+            throw std::runtime_error("Retried checkpoint did not archive every record");
+        }
+        Library restored;
+        restored.enableCheckpointing(directory, 1000);
+        restored.loadCheckpoint(Checkpointer::checkpointPath(directory));
+        restored.rebuildCirculationHistory();
+        if (dvdLoans(restored) != 10) throw std::runtime_error("Restored history incomplete");
+    });
+    
+    tester.test("Checkpoint Tail Replay", []() {
+        TempDirectory scratch("library-tail-replay-test");
+        std::string live = scratch.getPath() + "/live";
+        std::string expected = scratch.getPath() + "/expected";
+        std::string replayed = scratch.getPath() + "/replayed";
+        for (const auto& directory : {live, expected, replayed}) std::filesystem::create_directories(directory);
+        
+        auto clock = std::make_shared<SimulatedClock>(std::chrono::system_clock::from_time_t(1704067200 + 43200));  // 2024-01-01
+        Library lib;
+        lib.setClock(clock);
+        lib.enableCheckpointing(live, 1000);
+        lib.addItem(std::make_unique<Book>("B001", "The Great Gatsby", "F. Scott Fitzgerald", "978-0743273565", "Fiction"));
+        lib.addCopy("B001");
+        lib.addCopy("B001");
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU123456", "Computer Science"));
+        lib.addPatron(std::make_unique<Student>("S002", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        lib.checkpoint();
+        
+        // Everything below is only in the journal tail when the library stops
+        lib.addPatron(std::make_unique<Student>("S003", "Bob Lee", "bob@university.edu", "STU123458", "History"));
+        lib.checkoutItem("D001", "S001");
+        lib.placeHold("D001", "S002");
+        lib.placeHold("D001", "S003");
+        lib.placeHold("D001", "F001");
+        lib.placeHold("B001", "S002");
+        lib.checkoutItem("B001", "S001");
+        lib.cancelHold(lib.placeHold("B001", "S003"));
+        clock->advanceDays(10);
+        lib.returnItem("D001");  // S002's B001 hold expires; F001 gets D001
+        lib.payFine("S001", 1.0);
+        lib.renewAllForPatron("S001");
+        lib.addGuestPatron(std::make_unique<Faculty>("G001", "Dr. Guest", "guest@college.edu", "Physics", "EXT001"));
+        lib.setPatronActive("S003", false);
+        lib.checkoutItem("B001", "G001");
+        lib.flushCheckpoints();
+        if (Checkpointer::listSequenceFiles(live, "tail-").empty()) throw std::runtime_error("No journal tail written");
+        
+        // The running library's state, written elsewhere so the live directory
+        // keeps only the first image and the tail, as after a crash
+        lib.enableCheckpointing(expected, 1000);
+        lib.checkpoint();
+        lib.flushCheckpoints();
+        
+        Library restored;
+        restored.setClock(clock);
+        restored.loadCheckpoint(Checkpointer::checkpointPath(live));
+        restored.enableCheckpointing(replayed, 1000);
+        restored.checkpoint();
+        restored.flushCheckpoints();
+        
+        auto imageLines = [](const std::string& directory) {
+            std::ifstream in(Checkpointer::checkpointPath(directory));
+            std::vector<std::string> lines;
+            std::string line;
+            while (std::getline(in, line)) lines.push_back(line);
+            // Fine accounts come out in hash order
+            std::sort(lines.begin(), lines.end());
+            return lines;
+        };
+        auto holdIds = [](const Library& library) {
+            std::vector<uint64_t> ids;
+            for (const auto* hold : library.getHolds("D001")) ids.push_back(hold->holdId);
+            return ids;
+        };
+        if (imageLines(expected).size() < 10 || imageLines(expected) != imageLines(replayed) ||
+            holdIds(lib) != holdIds(restored) || restored.getJournal().getLastSequence() != lib.getJournal().getLastSequence()) {
+            throw std::runtime_error("Replayed state differs");
+        }
+        if (restored.placeHold("B001", "S001") != lib.placeHold("B001", "S001")) {
+            throw std::runtime_error("Hold IDs not resumed");
+        }
+    });
+    
+    tester.test("Recommendations", []() {
+        TempDirectory scratch("library-recommendations-test");
+        Library lib;
+        // Most of the history is archived, some of it still being written
+        lib.enableCheckpointing(scratch.getPath(), 4, 2);
+        for (int i = 0; i < 12; ++i) {
+            lib.addItem(std::make_unique<Book>("B" + std::to_string(100 + i), "Book " + std::to_string(i), "Author", "", "Fiction"));
+        }
+        // P0-P3 all borrow B100 and B101; P0-P1 also B102; P3 also B103..B111
+        for (int p = 0; p < 4; ++p) {
+            lib.addPatron(std::make_unique<Faculty>("F" + std::to_string(p), "Patron", "p@university.edu", "History", "FAC" + std::to_string(p)));
+        }
+        auto borrow = [&lib](const std::string& itemId, const std::string& patronId) {
+            lib.checkoutItem(itemId, patronId);
+            lib.returnItem(itemId);
+        };
+        for (int p = 0; p < 4; ++p) {
+            borrow("B100", "F" + std::to_string(p));
+            borrow("B101", "F" + std::to_string(p));
+            if (p < 2) borrow("B102", "F" + std::to_string(p));
+        }
+        for (int i = 3; i < 12; ++i) borrow("B" + std::to_string(100 + i), "F3");
+        borrow("B100", "F0");  // repeat borrows do not count twice
+        
+        auto top = lib.recommendItems("B100", 3);
+        if (top.size() != 3 || top[0]->getId() != "B101" || top[1]->getId() != "B102" || top[2]->getId() != "B103" ||
+            lib.recommendItems("B111", 20).size() != CoBorrowIndex::kNeighbors || !lib.recommendItems("B999").empty()) {
+            throw std::runtime_error("Incremental recommendations incorrect");
+        }
+        
+        // A parallel rebuild from the journal yields the same model
+        std::vector<std::string> before;
+        for (const LibraryItem* item : lib.recommendItems("B100", 8)) before.push_back(item->getId());
+        lib.rebuildRecommendations(3);
+        std::vector<std::string> after;
+        for (const LibraryItem* item : lib.recommendItems("B100", 8)) after.push_back(item->getId());
+        if (before != after || before.size() != 8) {
+            throw std::runtime_error("Rebuilt recommendations differ");
+        }
+    });
+    
+    tester.test("Circulation Reports", []() {
+        Library lib;
+        auto clock = std::make_shared<SimulatedClock>(std::chrono::system_clock::from_time_t(1704067200 + 43200));  // 2024-01-01
+        lib.setClock(clock);
+        lib.addItem(std::make_unique<Book>("B001", "The Great Gatsby", "F. Scott Fitzgerald", "978-0743273565", "Fiction"));
+        lib.addItem(std::make_unique<Book>("B002", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.addItem(std::make_unique<DVD>("D001", "Inception", "Christopher Nolan", 148, "2010-07-16"));
+        lib.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU123456", "Computer Science"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Dr. Smith", "smith@university.edu", "Computer Science", "FAC001"));
+        lib.checkoutItem("B001", "S001");
+        lib.checkoutItem("D001", "F001");
+        clock->advanceDays(4);
+        lib.returnItem("B001");
+        lib.returnItem("D001");
+        clock->advanceDays(30);  // February
+        lib.checkoutItem("B001", "F001");
+        lib.checkoutItem("B002", "S001");
+        clock->advanceDays(10);
+        lib.returnItem("B001");
+        
+        CirculationHistory::Query byGenreMonth;
+        byGenreMonth.groupBy = CirculationHistory::ByGenre | CirculationHistory::ByMonth;
+        auto groups = lib.circulationReport(byGenreMonth);
+        std::vector<std::string> fictionJanuary = {"Fiction", "2024-01"};
+        if (groups.size() != 4 || groups[0].checkouts != 1 || groups[2].key != fictionJanuary) {
+            throw std::runtime_error("Genre by month grouping incorrect");
+        }
+        
+        CirculationHistory::Query byPatronType;
+        byPatronType.groupBy = CirculationHistory::ByPatronType;
+        groups = lib.circulationReport(byPatronType);
+        // Faculty: 4 and 10 days; Students: 4 days and one open loan
+        if (groups.size() != 2 || groups[0].key[0] != "Faculty" || groups[0].averageLoanDays != 7.0 ||
+            groups[1].returned != 1 || groups[1].averageLoanDays != 4.0) {
+            throw std::runtime_error("Average loan length by patron type incorrect");
+        }
+        
+        // Parallel scans over many rows agree with a single-threaded scan
+        CirculationHistory history;
+        history.reserve(300000);
+        const char* genres[] = {"Fiction", "Dystopian", "History"};
+        for (int row = 0; row < 300000; ++row) {
+            std::string barcode = "C" + std::to_string(row);
+            bool isDvd = row % 5 == 0;
+            history.recordCheckout(barcode, (isDvd ? "D" : "B") + std::to_string(row % 97), isDvd ? ItemKind::DVD : ItemKind::Book,
+                                   isDvd ? "" : genres[row % 3], row % 2 ? PatronKind::Student : PatronKind::Faculty,
+                                   19000 + row % 700);
+            if (row % 3) history.recordReturn(barcode, 19000 + row % 700 + row % 20, (row % 7) * 0.25);
+        }
+        CirculationHistory::Query topDvds;
+        topDvds.groupBy = CirculationHistory::ByItem | CirculationHistory::ByYear;
+        topDvds.itemType = "DVD";
+        topDvds.limit = 5;
+        auto parallel = history.aggregate(topDvds, 4);
+        auto serial = history.aggregate(topDvds, 1);
+        bool same = parallel.size() == 5 && serial.size() == 5;
+        for (size_t i = 0; same && i < parallel.size(); ++i) {
+            same = parallel[i].key == serial[i].key && parallel[i].checkouts == serial[i].checkouts &&
+                   parallel[i].totalFines == serial[i].totalFines && parallel[i].averageLoanDays == serial[i].averageLoanDays;
+        }
+        if (!same || parallel[0].key[0].compare(0, 1, "D") != 0) {
+            throw std::runtime_error("Parallel aggregation differs from serial");
+        }
+    });
+    
+    tester.test("Overdue Notices", []() {
+        TempDirectory scratch("library-notice-test");
+        const std::string& directory = scratch.getPath();
+        
         Library lib;
+        auto clock = std::make_shared<SimulatedClock>(std::chrono::system_clock::from_time_t(1704067200 + 43200));  // 2024-01-01
+        lib.setClock(clock);
+        for (int i = 0; i < 600; ++i) {
+            std::string n = std::to_string(1000 + i);
+            lib.addItem(std::make_unique<DVD>("D" + n, "Film " + n, "Director", 90, "2010-07-16"));
+            lib.addPatron(std::make_unique<Student>("S" + n, "Student " + n, "s" + n + "@university.edu", "STU" + n, "History"));
+            lib.checkoutItem("D" + n, "S" + n);
+        }
+        // IDs that a lossy file name mapping would send to the same file
+        for (const std::string id : {"S.1", "S/1", "S_1"}) {
+            lib.addItem(std::make_unique<DVD>("D" + id, "Film " + id, "Director", 90, "2010-07-16"));
+            lib.addPatron(std::make_unique<Student>(id, "Student " + id, "x@university.edu", "STU" + id, "History"));
+            lib.checkoutItem("D" + id, id);
+        }
+        lib.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        lib.checkoutItem("B001", "S1000");
+        clock->advanceDays(10);  // DVDs 3 days overdue, the book not yet due
+        
+        auto result = lib.writeOverdueNotices(directory);
+        for (const char* file : {"/S%2E1.txt", "/S%2F1.txt", "/S_1.txt"}) {
+            if (!std::filesystem::exists(directory + file)) throw std::runtime_error(std::string("Missing notice ") + file);
+        }
+        std::ifstream in(directory + "/" + OverdueNoticeSpool::fileNameFor("S1000"));
+        std::stringstream text;
+        text << in.rdbuf();
+        if (result.notices != 603 || result.loans != 603 || !result.failures.empty() ||
+            text.str().find("To: s1000@university.edu") != 0 ||
+            text.str().find("- Film 1000 (D1000), due 2024-01-08, 3 day(s) overdue, fine $3.00\n") == std::string::npos ||
+            text.str().find("1984") != std::string::npos) {
+            throw std::runtime_error("Standard notices incorrect");
+        }
+        
+        clock->advanceDays(30);
+        NoticeTemplate brief("{{patron_id}}:{{#loans}} {{item_id}}={{fine}}{{/loans}} total={{total_fine}}");
+        result = lib.writeOverdueNotices(directory, brief);
+        std::ifstream briefIn(directory + "/S1000.txt");
+        std::string line;
+        std::getline(briefIn, line);
+        if (result.notices != 603 || result.loans != 604 || line != "S1000: D1000=33.00 B001=9.50 total=42.50") {
+            throw std::runtime_error("Custom template notices incorrect: " + line);
+        }
+        
+        bool threw = false;
         try {
-            lib.findPatron("NONEXISTENT");
-            throw std::runtime_error("Should have thrown PatronNotFoundException");
+            NoticeTemplate bad("{{#loans}}{{patron_name}} {{unknown}}{{/loans}}");
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw) throw std::runtime_error("Unknown template field accepted");
+    });
+    
+    tester.test("Type Registry", []() {
+        const ItemTypeSpec* dvd = findItemType("dvd");
+        if (!dvd || dvd->kind != ItemKind::DVD || findItemType("Scroll") || !findPatronType("FACULTY")) {
+            throw std::runtime_error("Type lookup incorrect");
+        }
+        
+        auto item = createItem(dvd->kind, "D1", {"Heat", "Michael Mann", "170", "1995-12-15"});
+        if (item->getKind() != ItemKind::DVD || item->getItemType() != "DVD" ||
+            itemFieldValues(*item)[2] != "170" || item->calculateFine(2) != 2.00) {
+            throw std::runtime_error("Registered item incorrect");
+        }
+        
+        auto patron = createPatron(PatronKind::Faculty, "F1", "Prof X", "x@u.edu", {"Physics", "E1"});
+        auto copy = patron->clone();
+        if (copy->getPatronType() != "Faculty" || copy->getMaxBorrowItems() != patron->getMaxBorrowItems() ||
+            patronFieldValues(*copy)[0] != "Physics") {
+            throw std::runtime_error("Registered patron incorrect");
+        }
+        
+        // Creator and genre lookups follow the registry rather than the class
+        auto magazine = createItem(ItemKind::Magazine, "M1", {"Wired", "Conde Nast", "12", ""});
+        auto book = createItem(ItemKind::Book, "B1", {"Dune", "Frank Herbert", "", "Science Fiction"});
+        if (!CompiledItemPredicate::fieldEquals(*magazine, ItemField::Publisher, "Conde Nast") ||
+            CompiledItemPredicate::fieldEquals(*magazine, ItemField::Author, "Conde Nast") ||
+            !CompiledItemPredicate::fieldEquals(*book, ItemField::Genre, "Science Fiction") ||
+            CompiledItemPredicate::registryField(ItemKind::DVD, ItemField::Genre) != -1 ||
+            itemGenre(*book) != "Science Fiction" || !itemGenre(*item).empty()) {
+            throw std::runtime_error("Registry field lookup incorrect");
+        }
+        if (CompiledItemPredicate::registryField(ItemKind::DVD, ItemField::Duration) != 2 ||
+            CompiledItemPredicate::rangeValue(*item, ItemField::ReleaseDay) != DateFormatter::parseDay("1995-12-15") ||
+            CompiledItemPredicate::rangeValue(*magazine, ItemField::PublicationDay) != kUnknownDay ||
+            CompiledItemPredicate::rangeValue(*book, ItemField::Duration) != kUnknownDay) {
+            throw std::runtime_error("Range fields should follow the registry");
+        }
+        
+        // Field counts come from the registry, and each value is checked against its input kind
+        const std::vector<FieldValues> rejected = {
+            {"Heat", "Michael Mann", "abc", "1995-12-15"},
+            {"Heat", "Michael Mann", "170", "15/12/1995"},
+            {"Heat", "Michael Mann", "170"},
+            {"Heat", "Michael Mann", "170", "1995-12-15", "extra"},
+        };
+        for (const auto& fields : rejected) {
+            bool threw = false;
+            try {
+                createItem(ItemKind::DVD, "D2", fields);
+            } catch (const LibraryException&) {
+                threw = true;
+            }
+            if (!threw) throw std::runtime_error("Invalid DVD fields accepted: " + fields.back());
+        }
+        if (!fieldError(kBookFields[2], "978-0441172719").empty() || fieldError(kBookFields[2], "123").empty() ||
+            fieldError(kDvdFields[2], "").empty() || !fieldError(kDvdFields[3], "").empty()) {
+            throw std::runtime_error("Field validation incorrect");
+        }
+    });
+    
+    tester.test("Patron Directory", []() {
+        Library lib;
+        lib.addPatron(std::make_unique<Student>("S001", "John Smith", "john@university.edu", "STU001", "History"));
+        lib.addPatron(std::make_unique<Student>("S002", "Alice Johnson", "alice@university.edu", "STU002", "Biology"));
+        lib.addPatron(std::make_unique<Faculty>("F001", "Jos\u00e9 Garc\u00eda", "jose@university.edu", "Physics", "EMP001"));
+        
+        if (lib.findPatronByCard(" stu002 ")->getId() != "S002" || lib.findPatronByCard("EMP001")->getId() != "F001") {
+            throw std::runtime_error("Card lookup incorrect");
+        }
+        auto joh = lib.findPatronsByName("Joh");
+        auto garcia = lib.findPatronsByName("garc");
+        if (joh.size() != 2 || joh[0]->getId() != "S001" || joh[1]->getId() != "S002" ||
+            garcia.size() != 1 || garcia[0]->getId() != "F001" || lib.findPatronsByName("Joh", 1).size() != 1 ||
+            !lib.findPatronsByName("ith").empty()) {
+            throw std::runtime_error("Name prefix lookup incorrect");
+        }
+        
+        bool threw = false;
+        try {
+            lib.addPatron(std::make_unique<Student>("S003", "Bob Smith", "bob@university.edu", "stu001", "Art"));
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw || lib.findPatronsByName("bob").size() != 0) throw std::runtime_error("Duplicate card accepted");
+        
+        // Re-registering moves the patron to the new card and name
+        lib.addPatron(std::make_unique<Student>("S001", "Jonathan Smith", "john@university.edu", "STU101", "History"));
+        threw = false;
+        try {
+            lib.findPatronByCard("STU001");
         } catch (const PatronNotFoundException&) {
-            // Expected
+            threw = true;
+        }
+        if (!threw || lib.findPatronByCard("STU101")->getName() != "Jonathan Smith" ||
+            lib.findPatronsByName("john").size() != 1 || lib.findPatronsByName("jonathan").size() != 1) {
+            throw std::runtime_error("Re-registered patron not reindexed");
+        }
+        
+        BranchRouter router;
+        router.addBranch("MAIN");
+        router.addBranch("EAST");
+        router.addPatron(std::make_unique<Student>("MAIN-S1", "Carol Jones", "carol@university.edu", "STU900", "Math"));
+        router.addPatron(std::make_unique<Student>("EAST-S1", "Carl Jonas", "carl@university.edu", "STU901", "Art"));
+        auto car = router.findPatronsByName("car");
+        threw = false;
+        try {
+            router.addPatron(std::make_unique<Student>("EAST-S2", "Dan Cole", "dan@university.edu", "STU900", "Art"));
+        } catch (const LibraryException&) {
+            threw = true;
+        }
+        if (!threw || router.findPatronByCard("stu900")->getId() != "MAIN-S1" ||
+            car.size() != 2 || car[0]->getId() != "EAST-S1" || car[1]->getId() != "MAIN-S1") {
+            throw std::runtime_error("Branch patron lookup incorrect");
         }
     });
     
-    // Test fine calculation
-    tester.test("Fine Calculation", []() {
-        auto book = std::make_unique<Book>("B002", "To Kill a Mockingbird", "Harper Lee", "978-0061120084", "Fiction");
-        double fine = book->calculateFine(5);
-        if (fine != 2.50) {
-            throw std::runtime_error("Fine calculation incorrect. Expected 2.50, got " + std::to_string(fine));
+    tester.test("Trace Replay", []() {
+        std::string path = (std::filesystem::temp_directory_path() / "library-trace-test.bin").string();
+        auto clock = std::make_shared<SimulatedClock>(std::chrono::system_clock::from_time_t(1704067200 + 43200));  // 2024-01-01
+        Library original;
+        original.setClock(clock);
+        original.addItem(std::make_unique<Book>("B001", "1984", "George Orwell", "978-0451524935", "Dystopian"));
+        original.addPatron(std::make_unique<Student>("S001", "Jane Doe", "jane@university.edu", "STU123457", "English"));
+        original.checkoutItem("B001", "S001");
+        
+        std::vector<std::string> ids;
+        {
+            TraceRecorder recorder(path);
+            original.setTraceRecorder(&recorder);
+            for (int i = 0; i < 20; ++i) {
+                std::string n = std::to_string(100 + i);
+                original.addItem(std::make_unique<DVD>("D" + n, "Film " + n, "Director", 90, "2010-07-16"));
+                original.addPatron(std::make_unique<Faculty>("F" + n, "Prof " + n, "f@university.edu", "History", "EMP" + n));
+                original.checkoutItem("D" + n, "F" + n);
+                original.searchItemsByTitle("film");
+                original.findPatronByCard("emp" + n);
+            }
+            clock->advanceDays(40);  // 33 days overdue at $1.00/day
+            for (int i = 0; i < 20; ++i) original.returnItem("D" + std::to_string(100 + i));
+            original.searchItemsByTitle("Film", 5, "");
+            original.findPatronsByName("prof 11");
+            try {
+                original.checkoutItem("D100", "F100");  // blocked by fines
+            } catch (const CheckoutException&) {
+            }
+            original.payFine("F100", 33.0);
+            original.checkoutItem("D100", "F100");
+            original.setTraceRecorder(nullptr);
+            original.getJournal().forEach([&ids](const std::vector<std::string>& record) { ids.push_back(record[0]); });
+        }
+        std::sort(ids.begin(), ids.end());
+        if (ids.size() != 85 || std::adjacent_find(ids.begin(), ids.end()) != ids.end()) {
+            throw std::runtime_error("Transaction IDs not unique");
+        }
+        
+        TraceReplayer replayer = TraceReplayer::load(path);
+        std::string trace;
+        {
+            std::ifstream in(path, std::ios::binary);
+            trace.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        std::filesystem::remove(path);
+        TraceReplayer::Options options;
+        options.speed = 0;
+        options.threads = 3;
+        Library replay;
+        TraceReplayer::Report report = replayer.run(replay, options);
+        
+        LibraryStats expected = original.getStats();
+        LibraryStats actual = replay.getStats();
+        if (report.operations != replayer.getRecords().size() || report.operations != 128 || report.errors != 1 ||
+            report.latency.count != report.operations || report.throughput() <= 0) {
+            throw std::runtime_error("Replay report incorrect");
+        }
+        if (actual.activeLoans != expected.activeLoans || actual.totalPatrons != expected.totalPatrons ||
+            replay.getPatronBalance("F101") != 33.0 || replay.getPatronBalance("F100") != 0.0 ||
+            replay.findItem("B001")->isAvailable() || replay.getClock().now() != clock->now()) {
+            throw std::runtime_error("Replayed state differs from the original");
+        }
+        
+        // A foreign file, a cut-off trace, and a record claiming 2^40 arguments
+        std::string header = trace.substr(0, 9);
+        for (const std::string& bad : {std::string("not a trace"), trace.substr(0, trace.size() - 3),
+                                       header + std::string("\x00\x00\x05\x80\x80\x80\x80\x80\x20", 9)}) {
+            std::ofstream(path, std::ios::binary | std::ios::trunc) << bad;
+            bool threw = false;
+            try {
+                TraceRecorder::load(path);
+            } catch (const LibraryException&) {
+                threw = true;
+            }
+            std::filesystem::remove(path);
+            if (!threw) throw std::runtime_error("Malformed file loaded as a trace");
         }
     });
     
@@ -789,10 +8484,10 @@ int main() {
     std::cout << "\n=== DEMO: Checkout Operations ===" << std::endl;
     try {
         auto checkout1 = library.checkoutItem("B001", "S001");
-        std::cout << "Checkout successful!\n" << checkout1->getDetails() << "\n\n";
+        std::cout << "Checkout successful!\n" << checkout1->getDetails(library.today()) << "\n\n";
         
         auto checkout2 = library.checkoutItem("D001", "F001");
-        std::cout << "Checkout successful!\n" << checkout2->getDetails() << "\n\n";
+        std::cout << "Checkout successful!\n" << checkout2->getDetails(library.today()) << "\n\n";
     } catch (const std::exception& e) {
         std::cout << "Error: " << e.what() << std::endl;
     }
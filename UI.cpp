@@ -4,12 +4,16 @@
 #include <vector>
 #include <cctype>
 #include <algorithm>
+#include <fstream>
 #include "MainFile.cpp"
 
 class LibraryUI {
 private:
     Library library_;
     bool running_;
+    bool sampleData_ = true;
+    // Transactions between checkpoints when started with --checkpoint-dir
+    static constexpr uint64_t kCheckpointEvery = 1000;
     
     // Helper functions
     std::string getUserInput(const std::string& prompt) {
@@ -51,23 +55,35 @@ private:
         std::cout << "6. View Inventory\n";
         std::cout << "7. View Overdue Items\n";
         std::cout << "8. View Patron History\n";
-        std::cout << "9. Exit\n";
+        std::cout << "9. View Performance Metrics\n";
+        std::cout << "10. Pay Fines\n";
+        std::cout << "11. Place Hold\n";
+        std::cout << "12. Renew Loans\n";
+        std::cout << "13. View Statistics\n";
+        std::cout << "14. Circulation Reports\n";
+        std::cout << "15. Find Patron\n";
+        std::cout << "16. Exit\n";
         std::cout << "========================================\n";
     }
     
+    // Menus list every registered type; the options after them are fixed
     void displayAddItemMenu() {
         std::cout << "\n--- Add Item ---\n";
-        std::cout << "1. Add Book\n";
-        std::cout << "2. Add Magazine\n";
-        std::cout << "3. Add DVD\n";
-        std::cout << "4. Back to Main Menu\n";
+        int option = 1;
+        for (const auto& spec : kItemTypes) {
+            std::cout << option++ << ". Add " << spec.name << "\n";
+        }
+        std::cout << option++ << ". Add Copy of Existing Item\n";
+        std::cout << option << ". Back to Main Menu\n";
     }
     
     void displayAddPatronMenu() {
         std::cout << "\n--- Add Patron ---\n";
-        std::cout << "1. Add Student\n";
-        std::cout << "2. Add Faculty\n";
-        std::cout << "3. Back to Main Menu\n";
+        int option = 1;
+        for (const auto& spec : kPatronTypes) {
+            std::cout << option++ << ". Add " << spec.name << "\n";
+        }
+        std::cout << option << ". Back to Main Menu\n";
     }
     
     void displaySearchMenu() {
@@ -76,141 +92,125 @@ private:
         std::cout << "2. Search by Author\n";
         std::cout << "3. Search by Genre\n";
         std::cout << "4. Search by Type\n";
-        std::cout << "5. Back to Main Menu\n";
+        std::cout << "5. Search by ISBN\n";
+        std::cout << "6. Back to Main Menu\n";
     }
     
-    void addBook() {
-        std::cout << "\n--- Add Book ---\n";
-        std::string id = getUserInput("Enter Book ID: ");
-        std::string title = getUserInput("Enter Title: ");
-        std::string author = getUserInput("Enter Author: ");
-        std::string isbn = getUserInput("Enter ISBN: ");
-        std::string genre = getUserInput("Enter Genre: ");
-        
-        try {
-            library_.addItem(std::make_unique<Book>(id, title, author, isbn, genre));
-            std::cout << "✓ Book added successfully!\n";
-        } catch (const std::exception& e) {
-            std::cout << "✗ Error: " << e.what() << "\n";
+    static std::string fieldPrompt(const FieldSpec& field) {
+        std::string prompt = std::string("Enter ") + field.label;
+        if (field.input == FieldInput::Date) prompt += " (YYYY-MM-DD, or blank)";
+        if (field.input == FieldInput::Isbn) prompt += " (ISBN-10 or ISBN-13, or blank)";
+        return prompt + ": ";
+    }
+    
+    // Asks for each field in turn, repeating a field until its value is valid
+    FieldValues readFields(const FieldList& specs) {
+        FieldValues fields;
+        for (const FieldSpec& spec : specs) {
+            while (true) {
+                std::string value = getUserInput(fieldPrompt(spec));
+                std::string error = fieldError(spec, value);
+                if (error.empty()) {
+                    fields.push_back(std::move(value));
+                    break;
+                }
+                std::cout << "✗ Error: " << error << ". Please try again.\n";
+            }
         }
+        return fields;
     }
     
-    void addMagazine() {
-        std::cout << "\n--- Add Magazine ---\n";
-        std::string id = getUserInput("Enter Magazine ID: ");
-        std::string title = getUserInput("Enter Title: ");
-        std::string publisher = getUserInput("Enter Publisher: ");
-        int issueNumber = getIntInput("Enter Issue Number: ");
-        std::string publicationDate = getUserInput("Enter Publication Date (YYYY-MM-DD): ");
+    void addItemOfType(const ItemTypeSpec& spec) {
+        std::cout << "\n--- Add " << spec.name << " ---\n";
+        std::string id = getUserInput(std::string("Enter ") + spec.name + " ID: ");
+        FieldValues fields = readFields(spec.fields);
         
         try {
-            library_.addItem(std::make_unique<Magazine>(id, title, publisher, issueNumber, publicationDate));
-            std::cout << "✓ Magazine added successfully!\n";
+            library_.addItem(createItem(spec.kind, id, fields));
+            std::cout << "✓ " << spec.name << " added successfully!\n";
         } catch (const std::exception& e) {
             std::cout << "✗ Error: " << e.what() << "\n";
         }
     }
     
-    void addDVD() {
-        std::cout << "\n--- Add DVD ---\n";
-        std::string id = getUserInput("Enter DVD ID: ");
-        std::string title = getUserInput("Enter Title: ");
-        std::string director = getUserInput("Enter Director: ");
-        int duration = getIntInput("Enter Duration (minutes): ");
-        std::string releaseDate = getUserInput("Enter Release Date (YYYY-MM-DD): ");
+    void addCopy() {
+        std::cout << "\n--- Add Copy ---\n";
+        std::string itemId = getUserInput("Enter Item ID: ");
+        std::string barcode = getUserInput("Enter Copy Barcode (leave blank to generate): ");
         
         try {
-            library_.addItem(std::make_unique<DVD>(id, title, director, duration, releaseDate));
-            std::cout << "✓ DVD added successfully!\n";
+            barcode = library_.addCopy(itemId, barcode);
+            std::cout << "✓ Copy " << barcode << " added successfully!\n";
         } catch (const std::exception& e) {
             std::cout << "✗ Error: " << e.what() << "\n";
         }
     }
     
     void handleAddItem() {
+        const int typeCount = static_cast<int>(kItemTypes.size());
         while (true) {
             displayAddItemMenu();
             int choice = getIntInput("Select option: ");
             
-            switch (choice) {
-                case 1:
-                    addBook();
-                    break;
-                case 2:
-                    addMagazine();
-                    break;
-                case 3:
-                    addDVD();
-                    break;
-                case 4:
-                    return;
-                default:
-                    std::cout << "Invalid option. Please try again.\n";
+            if (choice >= 1 && choice <= typeCount) {
+                addItemOfType(kItemTypes[choice - 1]);
+            } else if (choice == typeCount + 1) {
+                addCopy();
+            } else if (choice == typeCount + 2) {
+                return;
+            } else {
+                std::cout << "Invalid option. Please try again.\n";
             }
         }
     }
     
-    void addStudent() {
-        std::cout << "\n--- Add Student ---\n";
+    void addPatronOfType(const PatronTypeSpec& spec) {
+        std::cout << "\n--- Add " << spec.name << " ---\n";
         std::string id = getUserInput("Enter Patron ID: ");
         std::string name = getUserInput("Enter Name: ");
         std::string contactInfo = getUserInput("Enter Contact Info (email): ");
-        std::string studentId = getUserInput("Enter Student ID: ");
-        std::string major = getUserInput("Enter Major: ");
+        FieldValues fields = readFields(spec.fields);
         
         try {
-            library_.addPatron(std::make_unique<Student>(id, name, contactInfo, studentId, major));
-            std::cout << "✓ Student added successfully!\n";
-        } catch (const std::exception& e) {
-            std::cout << "✗ Error: " << e.what() << "\n";
-        }
-    }
-    
-    void addFaculty() {
-        std::cout << "\n--- Add Faculty ---\n";
-        std::string id = getUserInput("Enter Patron ID: ");
-        std::string name = getUserInput("Enter Name: ");
-        std::string contactInfo = getUserInput("Enter Contact Info (email): ");
-        std::string department = getUserInput("Enter Department: ");
-        std::string employeeId = getUserInput("Enter Employee ID: ");
-        
-        try {
-            library_.addPatron(std::make_unique<Faculty>(id, name, contactInfo, department, employeeId));
-            std::cout << "✓ Faculty added successfully!\n";
+            library_.addPatron(createPatron(spec.kind, id, name, contactInfo, fields));
+            std::cout << "✓ " << spec.name << " added successfully!\n";
         } catch (const std::exception& e) {
             std::cout << "✗ Error: " << e.what() << "\n";
         }
     }
     
     void handleAddPatron() {
+        const int typeCount = static_cast<int>(kPatronTypes.size());
         while (true) {
             displayAddPatronMenu();
             int choice = getIntInput("Select option: ");
             
-            switch (choice) {
-                case 1:
-                    addStudent();
-                    break;
-                case 2:
-                    addFaculty();
-                    break;
-                case 3:
-                    return;
-                default:
-                    std::cout << "Invalid option. Please try again.\n";
+            if (choice >= 1 && choice <= typeCount) {
+                addPatronOfType(kPatronTypes[choice - 1]);
+            } else if (choice == typeCount + 1) {
+                return;
+            } else {
+                std::cout << "Invalid option. Please try again.\n";
             }
         }
     }
     
     void checkoutItem() {
         std::cout << "\n--- Checkout Item ---\n";
-        std::string itemId = getUserInput("Enter Item ID: ");
+        std::string itemId = getUserInput("Enter Item ID or Copy Barcode: ");
         std::string patronId = getUserInput("Enter Patron ID: ");
         
         try {
             auto checkout = library_.checkoutItem(itemId, patronId);
             std::cout << "\n✓ Item checked out successfully!\n";
-            std::cout << checkout->getDetails() << "\n";
+            std::cout << checkout->getDetails(library_.today()) << "\n";
+            auto alsoBorrowed = library_.recommendItems(checkout->getItem()->getId(), 3);
+            if (!alsoBorrowed.empty()) {
+                std::cout << "\nPatrons who borrowed this also borrowed:\n";
+                for (const LibraryItem* item : alsoBorrowed) {
+                    std::cout << "  - " << item->getTitle() << " (" << item->getId() << ")\n";
+                }
+            }
         } catch (const std::exception& e) {
             std::cout << "✗ Error: " << e.what() << "\n";
         }
@@ -218,111 +218,124 @@ private:
     
     void returnItem() {
         std::cout << "\n--- Return Item ---\n";
-        std::string itemId = getUserInput("Enter Item ID: ");
+        std::string itemId = getUserInput("Enter Item ID or Copy Barcode: ");
         
         try {
             auto ret = library_.returnItem(itemId);
             std::cout << "\n✓ Item returned successfully!\n";
             std::cout << ret->getDetails() << "\n";
+            
+            const auto* hold = library_.findHoldForCopy(ret->getCheckout()->getCopyBarcode());
+            if (hold) {
+                std::cout << "→ Place on hold shelf for: " << hold->patron->getName()
+                          << " (" << hold->patron->getId() << ")\n";
+            }
         } catch (const std::exception& e) {
             std::cout << "✗ Error: " << e.what() << "\n";
         }
     }
     
-    void searchByTitle() {
-        std::string title = getUserInput("Enter title to search: ");
-        auto results = library_.searchItemsByTitle(title);
-        
-        if (results.empty()) {
-            std::cout << "No items found with title containing: " << title << "\n";
-        } else {
+    static constexpr size_t kSearchPageSize = 10;
+    
+    // Prints search results one page at a time; fetchPage maps a
+    // continuation token to the next page. Returns false if nothing matched.
+    template<typename FetchPage>
+    bool showSearchResults(const FetchPage& fetchPage, const std::string& emptyMessage) {
+        try {
+            SearchPage page = fetchPage(std::string());
+            if (page.items.empty()) {
+                std::cout << emptyMessage << "\n";
+                return false;
+            }
             std::cout << "\n--- Search Results ---\n";
-            for (const auto& item : results) {
-                std::cout << "ID: " << item->getId() << "\n";
-                std::cout << "Title: " << item->getTitle() << "\n";
-                std::cout << "Type: " << item->getItemType() << "\n";
-                std::cout << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n";
-                std::cout << item->getDetails() << "\n";
-                std::cout << "---\n";
+            while (true) {
+                for (const auto& item : page.items) {
+                    std::cout << "ID: " << item->getId() << "\n";
+                    std::cout << "Title: " << item->getTitle() << "\n";
+                    std::cout << "Type: " << item->getItemType() << "\n";
+                    std::cout << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n";
+                    std::cout << item->getDetails() << "\n";
+                    std::cout << "---\n";
+                }
+                if (!page.hasMore()) break;
+                std::string more = getUserInput("Show more results? (y/n): ");
+                if (more != "y" && more != "Y") break;
+                page = fetchPage(page.nextToken);
             }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+        return true;
+    }
+    
+    // Offers close spellings after a search that found nothing
+    void suggestFuzzyMatches(const std::string& text, unsigned fields) {
+        auto suggestions = library_.fuzzySearch(text, FuzzyIndex::kMaxDistance, 5, fields);
+        if (suggestions.empty()) return;
+        std::cout << "Did you mean:\n";
+        for (const auto& item : suggestions) {
+            std::cout << "  " << item->getId() << " - " << item->getTitle() << " (" << item->getItemType() << ")\n";
         }
     }
     
+    void searchByTitle() {
+        std::string title = getUserInput("Enter title to search: ");
+        bool found = showSearchResults([&](const std::string& token) {
+            return library_.searchItemsByTitle(title, kSearchPageSize, token);
+        }, "No items found with title containing: " + title);
+        if (!found) suggestFuzzyMatches(title, FuzzyIndex::Title);
+    }
+    
     void searchByAuthor() {
         std::string author = getUserInput("Enter author to search: ");
-        auto results = library_.searchItemsByAuthor(author);
-        
-        if (results.empty()) {
-            std::cout << "No books found by author: " << author << "\n";
-        } else {
-            std::cout << "\n--- Search Results ---\n";
-            for (const auto& item : results) {
-                std::cout << "ID: " << item->getId() << "\n";
-                std::cout << "Title: " << item->getTitle() << "\n";
-                std::cout << "Type: " << item->getItemType() << "\n";
-                std::cout << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n";
-                std::cout << item->getDetails() << "\n";
-                std::cout << "---\n";
-            }
-        }
+        bool found = showSearchResults([&](const std::string& token) {
+            return library_.searchItemsByAuthor(author, kSearchPageSize, token);
+        }, "No books found by author: " + author);
+        if (!found) suggestFuzzyMatches(author, FuzzyIndex::Author);
     }
     
     void searchByGenre() {
         std::string genre = getUserInput("Enter genre to search: ");
-        auto results = library_.searchItemsByGenre(genre);
-        
-        if (results.empty()) {
-            std::cout << "No books found in genre: " << genre << "\n";
-        } else {
-            std::cout << "\n--- Search Results ---\n";
-            for (const auto& item : results) {
-                std::cout << "ID: " << item->getId() << "\n";
-                std::cout << "Title: " << item->getTitle() << "\n";
-                std::cout << "Type: " << item->getItemType() << "\n";
-                std::cout << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n";
-                std::cout << item->getDetails() << "\n";
-                std::cout << "---\n";
-            }
-        }
+        showSearchResults([&](const std::string& token) {
+            return library_.searchItemsByGenre(genre, kSearchPageSize, token);
+        }, "No books found in genre: " + genre);
     }
     
     void searchByType() {
         std::cout << "Item Types:\n";
-        std::cout << "1. Book\n";
-        std::cout << "2. Magazine\n";
-        std::cout << "3. DVD\n";
+        for (size_t i = 0; i < kItemTypes.size(); ++i) {
+            std::cout << i + 1 << ". " << kItemTypes[i].name << "\n";
+        }
         int choice = getIntInput("Select type: ");
-        
-        std::string type;
-        switch (choice) {
-            case 1:
-                type = "Book";
-                break;
-            case 2:
-                type = "Magazine";
-                break;
-            case 3:
-                type = "DVD";
-                break;
-            default:
-                std::cout << "Invalid type.\n";
-                return;
+        if (choice < 1 || choice > static_cast<int>(kItemTypes.size())) {
+            std::cout << "Invalid type.\n";
+            return;
         }
+        std::string type = kItemTypes[choice - 1].name;
         
-        auto results = library_.searchItemsByType(type);
-        
-        if (results.empty()) {
-            std::cout << "No items found of type: " << type << "\n";
-        } else {
+        showSearchResults([&](const std::string& token) {
+            return library_.searchItemsByType(type, kSearchPageSize, token);
+        }, "No items found of type: " + type);
+    }
+    
+    void searchByIsbn() {
+        std::string isbn = getUserInput("Enter or scan ISBN: ");
+        try {
+            auto results = library_.findItemsByIsbn(isbn);
+            if (results.empty()) {
+                std::cout << "No books found with ISBN: " << isbn << "\n";
+                return;
+            }
             std::cout << "\n--- Search Results ---\n";
             for (const auto& item : results) {
                 std::cout << "ID: " << item->getId() << "\n";
                 std::cout << "Title: " << item->getTitle() << "\n";
-                std::cout << "Type: " << item->getItemType() << "\n";
                 std::cout << "Status: " << (item->isAvailable() ? "Available" : "Checked Out") << "\n";
                 std::cout << item->getDetails() << "\n";
                 std::cout << "---\n";
             }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
         }
     }
     
@@ -345,6 +358,9 @@ private:
                     searchByType();
                     break;
                 case 5:
+                    searchByIsbn();
+                    break;
+                case 6:
                     return;
                 default:
                     std::cout << "Invalid option. Please try again.\n";
@@ -358,6 +374,44 @@ private:
     
     void viewOverdueItems() {
         library_.printOverdueItems();
+        
+        std::string directory = getUserInput("\nWrite overdue notices to directory (leave blank to skip): ");
+        if (directory.empty()) return;
+        
+        try {
+            auto result = library_.writeOverdueNotices(directory);
+            std::cout << "✓ Wrote " << result.notices << " notice(s) covering " << result.loans
+                      << " overdue loan(s) to " << directory << "\n";
+            for (const auto& patronId : result.failures) {
+                std::cout << "✗ Error: Could not write notice for patron " << patronId << "\n";
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+    }
+    
+    // Accepts a card swipe or the start of any word of a patron's name
+    void findPatron() {
+        std::cout << "\n--- Find Patron ---\n";
+        std::string text = getUserInput("Swipe card or enter name: ");
+        
+        std::vector<const LibraryPatron*> matches;
+        try {
+            matches.push_back(library_.findPatronByCard(text));
+        } catch (const PatronNotFoundException&) {
+            matches = library_.findPatronsByName(text);
+        }
+        
+        if (matches.empty()) {
+            std::cout << "No patrons found.\n";
+            return;
+        }
+        for (const LibraryPatron* patron : matches) {
+            std::string card = PatronDirectory::cardOf(*patron);
+            std::cout << patron->getId() << " - " << patron->getName() << " (" << patron->getPatronType()
+                      << (card.empty() ? "" : ", card " + card) << ")"
+                      << (patron->isActive() ? "" : " [inactive]") << "\n";
+        }
     }
     
     void viewPatronHistory() {
@@ -365,16 +419,197 @@ private:
         library_.printPatronHistory(patronId);
     }
     
+    void placeHold() {
+        std::cout << "\n--- Place Hold ---\n";
+        std::string itemId = getUserInput("Enter Item ID: ");
+        std::string patronId = getUserInput("Enter Patron ID: ");
+        
+        try {
+            uint64_t holdId = library_.placeHold(itemId, patronId);
+            std::cout << "✓ Hold " << holdId << " placed successfully!\n";
+            
+            auto holds = library_.getHolds(itemId);
+            for (size_t i = 0; i < holds.size(); ++i) {
+                std::cout << (i + 1) << ". " << holds[i]->patron->getName()
+                          << " (" << holds[i]->patron->getId() << ")"
+                          << (holds[i]->ready ? " - ready for pickup" : "") << "\n";
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+    }
+    
+    void renewLoans() {
+        std::cout << "\n--- Renew Loans ---\n";
+        std::cout << "1. Renew One Item\n";
+        std::cout << "2. Renew All Loans for a Patron\n";
+        int choice = getIntInput("Select option: ");
+        
+        try {
+            if (choice == 1) {
+                std::string itemId = getUserInput("Enter Item ID or Copy Barcode: ");
+                auto checkout = library_.renewItem(itemId);
+                std::cout << "✓ Renewed. New due date: " << checkout->getFormattedDueDate() << "\n";
+            } else if (choice == 2) {
+                std::string patronId = getUserInput("Enter Patron ID: ");
+                auto renewed = library_.renewAllForPatron(patronId);
+                std::cout << "✓ Renewed " << renewed.size() << " loan(s)\n";
+                for (const auto& checkout : renewed) {
+                    std::cout << "- " << checkout->getItem()->getTitle() << " (" << checkout->getCopyBarcode()
+                              << ") due " << checkout->getFormattedDueDate() << "\n";
+                }
+            } else {
+                std::cout << "Invalid option.\n";
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+    }
+    
+    void payFines() {
+        std::cout << "\n--- Pay Fines ---\n";
+        std::string patronId = getUserInput("Enter Patron ID: ");
+        
+        try {
+            library_.findPatron(patronId);
+            double balance = library_.getPatronBalance(patronId);
+            std::cout << "Outstanding balance: $" << std::fixed << std::setprecision(2) << balance << "\n";
+            if (balance <= 0.0) return;
+            
+            double amount = getDoubleInput("Enter payment amount: ");
+            if (amount < 0.0) return;
+            library_.payFine(patronId, amount);
+            std::cout << "✓ Payment recorded. Remaining balance: $"
+                      << library_.getPatronBalance(patronId) << "\n";
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+    }
+    
+    void viewStatistics() {
+        LibraryStats stats = library_.getStats();
+        std::cout << "\n=== LIBRARY STATISTICS ===\n";
+        std::cout << "Items: " << stats.totalItems << " (" << stats.availableItems << " available)\n";
+        for (const auto& pair : stats.itemsByType) {
+            std::cout << "  " << pair.first << ": " << pair.second << "\n";
+        }
+        std::cout << "Copies: " << stats.totalCopies << " (" << stats.availableCopies << " available)\n";
+        std::cout << "Patrons: " << stats.totalPatrons << " (" << stats.activePatrons << " active)\n";
+        std::cout << "Active Loans: " << stats.activeLoans << "\n";
+        for (const auto& pair : stats.activeLoansByPatronType) {
+            std::cout << "  " << pair.first << ": " << pair.second << "\n";
+        }
+        std::cout << "Overdue Loans: " << stats.overdueLoans << "\n";
+        std::cout << "Pending Holds: " << stats.pendingHolds << "\n";
+        std::cout << "Outstanding Fines: $" << std::fixed << std::setprecision(2) << stats.outstandingFines << "\n";
+    }
+    
+    void viewReports() {
+        std::cout << "\n--- Circulation Reports ---\n";
+        std::cout << "1. Checkouts per Genre per Month\n";
+        std::cout << "2. Average Loan Length by Patron Type\n";
+        std::cout << "3. Most-Borrowed Items\n";
+        int choice = getIntInput("Select option: ");
+        
+        CirculationHistory::Query query;
+        if (choice == 1) {
+            query.groupBy = CirculationHistory::ByGenre | CirculationHistory::ByMonth;
+        } else if (choice == 2) {
+            query.groupBy = CirculationHistory::ByPatronType;
+        } else if (choice == 3) {
+            query.groupBy = CirculationHistory::ByItem;
+            query.itemType = getUserInput("Item type (Book, Magazine, DVD; blank for all): ");
+            std::string year = getUserInput("Year (blank for all time): ");
+            if (!year.empty()) {
+                EpochDay first = DateFormatter::parseDay(year);
+                if (year.size() != 4 || first == kUnknownDay) {
+                    std::cout << "✗ Error: Invalid year: " << year << "\n";
+                    return;
+                }
+                query.fromDay = first;
+                query.toDay = DateFormatter::parseDay(std::to_string(std::stoi(year) + 1)) - 1;
+            }
+            query.limit = 10;
+        } else {
+            std::cout << "Invalid option.\n";
+            return;
+        }
+        
+        try {
+            auto groups = library_.circulationReport(query);
+            if (groups.empty()) {
+                std::cout << "No loans recorded for this report.\n";
+                return;
+            }
+            std::cout << std::fixed << std::setprecision(1);
+            for (const auto& group : groups) {
+                std::string label;
+                for (const auto& part : group.key) {
+                    if (!label.empty()) label += " / ";
+                    label += part.empty() ? "(none)" : part;
+                }
+                std::cout << std::left << std::setw(32) << label << std::right
+                          << std::setw(6) << group.checkouts << " checkouts";
+                if (choice == 2 && group.returned > 0) {
+                    std::cout << ", " << group.averageLoanDays << " days average loan";
+                }
+                std::cout << "\n";
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ Error: " << e.what() << "\n";
+        }
+    }
+    
+    void viewMetrics() {
+        library_.getMetrics().printReport(std::cout);
+        
+        std::string path = getUserInput("\nExport as JSON to file (leave blank to skip): ");
+        if (path.empty()) return;
+        
+        std::ofstream out(path);
+        if (!out) {
+            std::cout << "✗ Error: Could not open file: " << path << "\n";
+            return;
+        }
+        out << library_.getMetrics().toJson() << "\n";
+        std::cout << "✓ Metrics exported to " << path << "\n";
+    }
+    
 public:
     LibraryUI() : running_(true) {}
     
+    /**
+     * Checkpoints to directory from now on, first resuming from the
+     * checkpoint already there, if any, instead of loading sample data.
+     * A new directory gets an empty checkpoint, so a session that ends
+     * without one is replayed onto it from the journal tail.
+     */
+    void checkpointTo(const std::string& directory) {
+        std::filesystem::create_directories(directory);
+        library_.enableCheckpointing(directory, kCheckpointEvery);
+        std::string image = Checkpointer::checkpointPath(directory);
+        if (std::filesystem::exists(image)) {
+            library_.loadCheckpoint(image);
+            library_.rebuildRecommendations();
+            library_.rebuildCirculationHistory();
+            sampleData_ = false;
+            std::cout << "✓ Resumed from " << image << "\n";
+        } else {
+            library_.checkpoint();
+            library_.flushCheckpoints();
+        }
+    }
+    
+    // Records the session, sample data included, for replaying later
+    void recordTo(TraceRecorder* recorder) { library_.setTraceRecorder(recorder); }
+    
     void run() {
         std::cout << "\n╔════════════════════════════════════════╗\n";
         std::cout << "║  Welcome to Library Management System  ║\n";
         std::cout << "╚════════════════════════════════════════╝\n";
         
         // Load some sample data
-        loadSampleData();
+        if (sampleData_) loadSampleData();
         
         while (running_) {
             displayMainMenu();
@@ -406,7 +641,32 @@ public:
                     viewPatronHistory();
                     break;
                 case 9:
+                    viewMetrics();
+                    break;
+                case 10:
+                    payFines();
+                    break;
+                case 11:
+                    placeHold();
+                    break;
+                case 12:
+                    renewLoans();
+                    break;
+                case 13:
+                    viewStatistics();
+                    break;
+                case 14:
+                    viewReports();
+                    break;
+                case 15:
+                    findPatron();
+                    break;
+                case 16:
                     running_ = false;
+                    if (library_.getCheckpointer()) {
+                        library_.checkpoint();
+                        library_.flushCheckpoints();
+                    }
                     std::cout << "\n✓ Thank you for using the Library Management System!\n";
                     std::cout << "Goodbye!\n\n";
                     break;
@@ -446,8 +706,57 @@ public:
     }
 };
 
-int main() {
-    LibraryUI ui;
-    ui.run();
+static int usage() {
+    std::cerr << "Usage: LibrarySystem [--checkpoint-dir <directory>] [--record <trace>]\n"
+              << "       LibrarySystem --replay <trace> [--speed <multiple>|max] [--threads <n>]\n";
+    return 2;
+}
+
+// Replays a recorded session into a fresh library and reports its performance
+static int replayTrace(const std::vector<std::string>& args) {
+    if (args.size() < 2 || args.size() % 2 != 0) return usage();
+    TraceReplayer::Options options;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        if (args[i] == "--speed") {
+            options.speed = args[i + 1] == "max" ? 0.0 : std::stod(args[i + 1]);
+        } else if (args[i] == "--threads") {
+            options.threads = static_cast<unsigned>(std::stoul(args[i + 1]));
+        } else {
+            return usage();
+        }
+    }
+    
+    Library library;
+    TraceReplayer::Report report = TraceReplayer::load(args[1]).run(library, options);
+    report.print(std::cout);
+    library.getMetrics().printReport(std::cout);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        if (!args.empty() && args[0] == "--replay") return replayTrace(args);
+        
+        std::unique_ptr<TraceRecorder> recorder;
+        std::string checkpointDirectory;
+        for (size_t i = 0; i < args.size(); i += 2) {
+            if (i + 1 >= args.size()) return usage();
+            if (args[i] == "--record") {
+                recorder = std::make_unique<TraceRecorder>(args[i + 1]);
+            } else if (args[i] == "--checkpoint-dir") {
+                checkpointDirectory = args[i + 1];
+            } else {
+                return usage();
+            }
+        }
+        LibraryUI ui;
+        if (!checkpointDirectory.empty()) ui.checkpointTo(checkpointDirectory);
+        if (recorder) ui.recordTo(recorder.get());
+        ui.run();
+    } catch (const std::exception& e) {
+        std::cerr << "✗ Error: " << e.what() << "\n";
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file